@@ -0,0 +1,125 @@
+// Consistent-hash ring shared by the master (routing) and the workers
+// (replica placement) : both must see the same workers and use the same
+// number of virtual nodes to agree on the owner of a key.
+
+#ifndef DISTRIBUTEDKV_CONSISTENT_HASH_RING_H_
+#define DISTRIBUTEDKV_CONSISTENT_HASH_RING_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+//! @brief Consistent-hash ring mapping keys to their owning worker.
+//! 
+//! @details Every worker is placed on the ring as `vnodes` virtual nodes, a
+//!          key belongs to the first virtual node clockwise from its hash.
+//!          Lookups are O(log N) and adding a worker only moves the keys
+//!          that now fall on its virtual nodes.
+class consistentHashRing {
+ public:
+  //! @brief Set the number of virtual nodes used for workers added later.
+  void SetVirtualNodes(int vnodes) {
+    std::unique_lock<std::shared_timed_mutex> lock(mu_);
+    vnodes_ = std::max(1, vnodes);
+  }
+
+  //! @brief Place a worker on the ring, adding it twice is a no-op.
+  void Add(uint16_t port) {
+    std::unique_lock<std::shared_timed_mutex> lock(mu_);
+    for (int i = 0; i < vnodes_; ++i) {
+      ring_.emplace(Hash(std::to_string(port) + "#" + std::to_string(i)), port);
+    }
+  }
+
+  //! @brief Replace the workers on the ring.
+  void Reset(const std::vector<uint16_t>& ports) {
+    std::unique_lock<std::shared_timed_mutex> lock(mu_);
+    ring_.clear();
+    for (uint16_t port : ports) {
+      for (int i = 0; i < vnodes_; ++i) {
+        ring_.emplace(Hash(std::to_string(port) + "#" + std::to_string(i)),
+                      port);
+      }
+    }
+  }
+
+  //! @brief Take a worker off the ring.
+  void Remove(uint16_t port) {
+    std::unique_lock<std::shared_timed_mutex> lock(mu_);
+    for (auto it = ring_.begin(); it != ring_.end();) {
+      if (it->second == port) {
+        it = ring_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  //! @brief Get the worker owning the key.
+  //! 
+  //! @return 0 if no worker is on the ring.
+  uint16_t Owner(const std::string& key) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mu_);
+    if (ring_.empty()) {
+      return 0;
+    }
+    auto it = ring_.lower_bound(Hash(key));
+    if (it == ring_.end()) {
+      it = ring_.begin();
+    }
+    return it->second;
+  }
+
+  //! @brief Get the key's owner followed by the next distinct workers
+  //!        clockwise : its preference list.
+  //! 
+  //! @return at most `n` workers, fewer if the ring has fewer.
+  std::vector<uint16_t> GetNodes(const std::string& key, size_t n) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mu_);
+    std::vector<uint16_t> nodes;
+    if (ring_.empty()) {
+      return nodes;
+    }
+    auto it = ring_.lower_bound(Hash(key));
+    for (size_t steps = 0; steps < ring_.size() && nodes.size() < n;
+         ++steps, ++it) {
+      if (it == ring_.end()) {
+        it = ring_.begin();
+      }
+      if (std::find(nodes.begin(), nodes.end(), it->second) == nodes.end()) {
+        nodes.push_back(it->second);
+      }
+    }
+    return nodes;
+  }
+
+  //! @brief Stable 64-bit hash : FNV-1a finished by the murmur3 mixer.
+  static uint64_t Hash(const std::string& data) {
+    return Hash(data.data(), data.size());
+  }
+
+  static uint64_t Hash(const char* data, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i) {
+      h ^= static_cast<unsigned char>(data[i]);
+      h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+ private:
+  mutable std::shared_timed_mutex mu_;
+  int vnodes_ = 128;
+  std::map<uint64_t, uint16_t> ring_;
+};
+
+#endif  // DISTRIBUTEDKV_CONSISTENT_HASH_RING_H_
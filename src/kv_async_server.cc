@@ -16,15 +16,23 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <new>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/strings/str_format.h"
 
+#include <google/protobuf/arena.h>
 #include <grpc/support/log.h>
 #include <grpcpp/grpcpp.h>
 
@@ -35,6 +43,12 @@
 #endif
 
 ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+ABSL_FLAG(int, threads, 1,
+          "Completion queues, each polled by its own thread");
+ABSL_FLAG(bool, arena, false,
+          "Build the messages of a call on a per-CallData protobuf arena");
+ABSL_FLAG(int, stats_interval_s, 0,
+          "Print the allocation counters every N seconds, 0 disables");
 
 using grpc::Server;
 using grpc::ServerAsyncResponseWriter;
@@ -46,16 +60,53 @@ using distributedKV::Greeter;
 using distributedKV::HelloReply;
 using distributedKV::HelloRequest;
 
+// Allocation counters. `handler_allocations` counts the heap allocations
+// made while our serving code runs (taking a CallData for the next call and
+// building the reply), through the operator new below. gRPC's own per-call
+// allocations (the context and the request of the next call among them) are
+// not ours to remove and are not counted.
+std::atomic<uint64_t> calls_served{0};
+std::atomic<uint64_t> calldata_allocated{0};
+std::atomic<uint64_t> handler_allocations{0};
+thread_local bool in_handler = false;
+
+void* operator new(std::size_t size) {
+  if (in_handler) {
+    handler_allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  void* p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+
+// Not inlined : GCC would see a new-expression's memory go to free() and
+// warn (-Wmismatched-new-delete).
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+// The sized and array forms too : replacing the plain one alone leaves the
+// set half replaced (-Wsized-deallocation).
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete[](void* p, std::size_t) noexcept { operator delete(p); }
+
 class ServerImpl final {
  public:
   ~ServerImpl() {
     server_->Shutdown();
-    // Always shutdown the completion queue after the server.
-    cq_->Shutdown();
+    // Always shutdown the completion queues after the server.
+    for (auto& cq : cqs_) {
+      cq->Shutdown();
+    }
   }
 
   // There is no shutdown handling in this code.
-  void Run(uint16_t port) {
+  void Run(uint16_t port, int threads, bool arena) {
     std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
 
     ServerBuilder builder;
@@ -64,92 +115,170 @@ class ServerImpl final {
     // Register "service_" as the instance through which we'll communicate with
     // clients. In this case it corresponds to an *asynchronous* service.
     builder.RegisterService(&service_);
-    // Get hold of the completion queue used for the asynchronous communication
-    // with the gRPC runtime.
-    cq_ = builder.AddCompletionQueue();
+    // Get hold of the completion queues used for the asynchronous
+    // communication with the gRPC runtime, one per serving thread.
+    for (int i = 0; i < std::max(1, threads); ++i) {
+      cqs_.push_back(builder.AddCompletionQueue());
+    }
     // Finally assemble the server.
     server_ = builder.BuildAndStart();
     std::cout << "Server listening on " << server_address << std::endl;
 
-    // Proceed to the server's main loop.
-    HandleRpcs();
+    // Proceed to the server's main loop, on every queue.
+    std::vector<std::thread> pollers;
+    for (size_t i = 1; i < cqs_.size(); ++i) {
+      pollers.emplace_back(&ServerImpl::HandleRpcs, this, cqs_[i].get(), arena);
+    }
+    HandleRpcs(cqs_[0].get(), arena);
   }
 
  private:
   // Class encompasing the state and logic needed to serve a request.
+  //
+  // Instances are pooled : a finished CallData goes back to the free list of
+  // its thread, and the next call takes it from there instead of allocating
+  // a new one. Each completion queue is polled by a single thread, so a
+  // CallData is always taken and returned on the same thread and the free
+  // list needs no lock. Reused instances keep their messages (cleared, their
+  // strings keep their capacity) or reset their arena, which keeps its first
+  // block ; once the pool has grown to the number of concurrent calls, serving
+  // a request allocates nothing on our side.
   class CallData {
    public:
-    // Take in the "service" instance (in this case representing an asynchronous
-    // server) and the completion queue "cq" used for asynchronous communication
-    // with the gRPC runtime.
-    CallData(Greeter::AsyncService* service, ServerCompletionQueue* cq)
-        : service_(service), cq_(cq), responder_(&ctx_), status_(CREATE) {
-      // Invoke the serving logic right away.
-      Proceed();
+    // Take a CallData from this thread's free list, or allocate one if it is
+    // empty, and start serving the next call with it.
+    static void Spawn(Greeter::AsyncService* service, ServerCompletionQueue* cq,
+                      bool arena) {
+      in_handler = true;
+      CallData* call = free_list_;
+      if (call != nullptr) {
+        free_list_ = call->next_free_;
+      } else {
+        call = new CallData(service, cq, arena);
+        calldata_allocated.fetch_add(1, std::memory_order_relaxed);
+      }
+      call->Reset();
+      in_handler = false;
+      call->Start();
     }
 
     void Proceed() {
-      if (status_ == CREATE) {
-        // Make this instance progress to the PROCESS state.
-        status_ = PROCESS;
-
-        // As part of the initial CREATE state, we *request* that the system
-        // start processing SayHello requests. In this request, "this" acts are
-        // the tag uniquely identifying the request (so that different CallData
-        // instances can serve different requests concurrently), in this case
-        // the memory address of this CallData instance.
-        service_->RequestSayHello(&ctx_, &request_, &responder_, cq_, cq_,
-                                  this);
-      } else if (status_ == PROCESS) {
+      if (status_ == PROCESS) {
         // Spawn a new CallData instance to serve new clients while we process
-        // the one for this CallData. The instance will deallocate itself as
+        // the one for this CallData. The instance will go back to the pool as
         // part of its FINISH state.
-        new CallData(service_, cq_);
+        Spawn(service_, cq_, arena_ != nullptr);
 
-        // The actual processing.
-        std::string prefix("Hello ");
-        reply_.set_message(prefix + request_.name());
+        in_handler = true;
+        // The actual processing. Append into the reply's string, which a
+        // reused message still holds, rather than building a temporary.
+        std::string* message = reply_->mutable_message();
+        message->assign("Hello ");
+        message->append(request_->name());
+        in_handler = false;
 
         // And we are done! Let the gRPC runtime know we've finished, using the
         // memory address of this instance as the uniquely identifying tag for
         // the event.
         status_ = FINISH;
-        responder_.Finish(reply_, Status::OK, this);
+        rpc_->responder.Finish(*reply_, Status::OK, this);
       } else {
         GPR_ASSERT(status_ == FINISH);
-        // Once in the FINISH state, deallocate ourselves (CallData).
-        delete this;
+        calls_served.fetch_add(1, std::memory_order_relaxed);
+        // Once in the FINISH state, return ourselves (CallData) to the pool.
+        next_free_ = free_list_;
+        free_list_ = this;
       }
     }
 
    private:
+    // Take in the "service" instance (in this case representing an asynchronous
+    // server) and the completion queue "cq" used for asynchronous communication
+    // with the gRPC runtime.
+    CallData(Greeter::AsyncService* service, ServerCompletionQueue* cq,
+             bool arena)
+        : service_(service), cq_(cq) {
+      if (arena) {
+        google::protobuf::ArenaOptions options;
+        options.initial_block = arena_block_;
+        options.initial_block_size = sizeof(arena_block_);
+        arena_.reset(new google::protobuf::Arena(options));
+      }
+    }
+
+    // Clear the messages of the previous call.
+    void Reset() {
+      if (arena_ != nullptr) {
+        arena_->Reset();
+        request_ = google::protobuf::Arena::CreateMessage<HelloRequest>(
+            arena_.get());
+        reply_ = google::protobuf::Arena::CreateMessage<HelloReply>(
+            arena_.get());
+      } else {
+        request_->Clear();
+        reply_->Clear();
+      }
+    }
+
+    // *Request* that the system start processing SayHello requests. In this
+    // request, "this" acts are the tag uniquely identifying the request (so
+    // that different CallData instances can serve different requests
+    // concurrently), in this case the memory address of this CallData
+    // instance.
+    void Start() {
+      // The context and the responder cannot be reset, they are rebuilt in
+      // place.
+      if (rpc_ != nullptr) {
+        rpc_->~rpcState();
+      }
+      rpc_ = new (&rpc_storage_) rpcState;
+      status_ = PROCESS;
+      service_->RequestSayHello(&rpc_->ctx, request_, &rpc_->responder, cq_,
+                                cq_, this);
+    }
+
+    // Context for the rpc, allowing to tweak aspects of it such as the use
+    // of compression, authentication, as well as to send metadata back to the
+    // client, and the means to get back to the client.
+    struct rpcState {
+      ServerContext ctx;
+      ServerAsyncResponseWriter<HelloReply> responder{&ctx};
+    };
+
     // The means of communication with the gRPC runtime for an asynchronous
     // server.
     Greeter::AsyncService* service_;
     // The producer-consumer queue where for asynchronous server notifications.
     ServerCompletionQueue* cq_;
-    // Context for the rpc, allowing to tweak aspects of it such as the use
-    // of compression, authentication, as well as to send metadata back to the
-    // client.
-    ServerContext ctx_;
+    // Storage of the per-call state, reused by every call.
+    std::aligned_storage<sizeof(rpcState), alignof(rpcState)>::type
+        rpc_storage_;
+    rpcState* rpc_ = nullptr;
 
-    // What we get from the client.
-    HelloRequest request_;
-    // What we send back to the client.
-    HelloReply reply_;
-
-    // The means to get back to the client.
-    ServerAsyncResponseWriter<HelloReply> responder_;
+    // What we get from the client and what we send back to it : the owned
+    // messages below, or messages on the arena.
+    HelloRequest owned_request_;
+    HelloReply owned_reply_;
+    HelloRequest* request_ = &owned_request_;
+    HelloReply* reply_ = &owned_reply_;
+    // First block of the arena, kept across resets.
+    alignas(8) char arena_block_[1024];
+    std::unique_ptr<google::protobuf::Arena> arena_;
 
     // Let's implement a tiny state machine with the following states.
-    enum CallStatus { CREATE, PROCESS, FINISH };
+    enum CallStatus { PROCESS, FINISH };
     CallStatus status_;  // The current serving state.
+
+    // Next instance on the free list.
+    CallData* next_free_ = nullptr;
+    // This thread's finished instances.
+    static thread_local CallData* free_list_;
   };
 
-  // This can be run in multiple threads if needed.
-  void HandleRpcs() {
+  // Run once per completion queue, on its own thread.
+  void HandleRpcs(ServerCompletionQueue* cq, bool arena) {
     // Spawn a new CallData instance to serve new clients.
-    new CallData(&service_, cq_.get());
+    CallData::Spawn(&service_, cq, arena);
     void* tag;  // uniquely identifies a request.
     bool ok;
     while (true) {
@@ -157,22 +286,48 @@ class ServerImpl final {
       // event is uniquely identified by its tag, which in this case is the
       // memory address of a CallData instance.
       // The return value of Next should always be checked. This return value
-      // tells us whether there is any kind of event or cq_ is shutting down.
-      GPR_ASSERT(cq_->Next(&tag, &ok));
+      // tells us whether there is any kind of event or the queue is shutting
+      // down.
+      GPR_ASSERT(cq->Next(&tag, &ok));
       GPR_ASSERT(ok);
       static_cast<CallData*>(tag)->Proceed();
     }
   }
 
-  std::unique_ptr<ServerCompletionQueue> cq_;
+  std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
   Greeter::AsyncService service_;
   std::unique_ptr<Server> server_;
 };
 
+thread_local ServerImpl::CallData* ServerImpl::CallData::free_list_ = nullptr;
+
+// Print the counters every `interval_s` seconds.
+void ReportAllocations(int interval_s) {
+  uint64_t last_calls = 0;
+  uint64_t last_allocations = 0;
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(interval_s));
+    uint64_t calls = calls_served.load(std::memory_order_relaxed);
+    uint64_t allocations = handler_allocations.load(std::memory_order_relaxed);
+    std::cout << "calls " << calls << " (+" << calls - last_calls
+              << "), CallData allocated "
+              << calldata_allocated.load(std::memory_order_relaxed)
+              << ", handler allocations " << allocations << " (+"
+              << allocations - last_allocations << ")" << std::endl;
+    last_calls = calls;
+    last_allocations = allocations;
+  }
+}
+
 int main(int argc, char** argv) {
   absl::ParseCommandLine(argc, argv);
+  const int stats_interval_s = absl::GetFlag(FLAGS_stats_interval_s);
+  if (stats_interval_s > 0) {
+    std::thread(ReportAllocations, stats_interval_s).detach();
+  }
   ServerImpl server;
-  server.Run(absl::GetFlag(FLAGS_port));
+  server.Run(absl::GetFlag(FLAGS_port), absl::GetFlag(FLAGS_threads),
+             absl::GetFlag(FLAGS_arena));
 
   return 0;
 }
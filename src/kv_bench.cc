@@ -0,0 +1,619 @@
+/*
+ *
+ * Copyright 2015 gRPC authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_format.h"
+
+#include <grpcpp/grpcpp.h>
+
+#ifdef BAZEL_BUILD
+#include "examples/protos/distributedKV.grpc.pb.h"
+#else
+#include "distributedKV.grpc.pb.h"
+#endif
+
+#include "routing_table.h"
+
+ABSL_FLAG(std::string, target, "localhost:50051", "Server address");
+ABSL_FLAG(int, duration_s, 10, "Measured run time in seconds");
+ABSL_FLAG(int, warmup_s, 1, "Run time before measuring starts, in seconds");
+ABSL_FLAG(int, threads, 2, "Completion queue threads");
+ABSL_FLAG(int, channels, 2, "Channels (connections) to the target");
+ABSL_FLAG(int, concurrency, 64, "Requests in flight over all threads");
+ABSL_FLAG(double, qps, 0,
+          "Target request rate (open loop), 0 runs closed loop at "
+          "`concurrency` requests in flight");
+ABSL_FLAG(int64_t, keys, 100000, "Number of distinct keys");
+ABSL_FLAG(std::string, distribution, "uniform",
+          "Key distribution : uniform, zipfian or latest");
+ABSL_FLAG(double, zipf_theta, 0.99, "Skew of the zipfian and latest keys");
+ABSL_FLAG(int, value_size, 100, "Value size in bytes");
+ABSL_FLAG(int, value_size_max, 0,
+          "If above value_size, values are uniformly sized in between");
+ABSL_FLAG(int, get_pct, 90, "Share of Get requests, in percent");
+ABSL_FLAG(int, put_pct, 10, "Share of Put requests, in percent");
+ABSL_FLAG(int, del_pct, 0, "Share of Del requests, in percent");
+ABSL_FLAG(std::string, read_policy, "primary",
+          "Copy a Get reads : primary, any, bounded or least");
+ABSL_FLAG(bool, direct, false,
+          "Send primary gets, puts and deletes straight to the owning worker, "
+          "using the master's routing table");
+ABSL_FLAG(bool, preload, true, "Bulk load every key before the run");
+ABSL_FLAG(std::string, out, "", "Write the JSON report to a file, "
+          "stdout if empty");
+
+using grpc::Channel;
+using grpc::ClientAsyncResponseReader;
+using grpc::ClientContext;
+using grpc::CompletionQueue;
+using grpc::Status;
+
+using distributedKV::kvMethods;
+using distributedKV::KVRequest;
+using distributedKV::KVResponse;
+using distributedKV::BulkLoadResponse;
+using distributedKV::ReadPolicy;
+
+using Clock = std::chrono::steady_clock;
+
+enum benchOp { kGet = 0, kPut = 1, kDel = 2, kOps = 3 };
+const char* const kOpNames[kOps] = {"get", "put", "del"};
+
+
+//! @brief Log-linear latency histogram in the manner of HdrHistogram.
+//!
+//! @details Values (ns) below 2^kSubBits are exact, above every power of two
+//!          is split into 2^(kSubBits-1) buckets : the relative error stays
+//!          under 1% from nanoseconds up to minutes in a few thousand
+//!          counters. Not thread-safe, one per thread and merged at the end.
+class latencyHistogram {
+ public:
+  latencyHistogram() : counts_(kBuckets, 0) {}
+
+  void Record(uint64_t ns) {
+    counts_[index(ns)] += 1;
+    count_ += 1;
+    sum_ += ns;
+    max_ = std::max(max_, ns);
+  }
+
+  void Merge(const latencyHistogram& other) {
+    for (size_t i = 0; i < kBuckets; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  //! @brief Get the value at quantile `q` in [0, 1].
+  uint64_t Percentile(double q) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(std::ceil(q * count_));
+    rank = std::max<uint64_t>(1, std::min(rank, count_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return std::min(highest(i), max_);
+      }
+    }
+    return max_;
+  }
+
+  uint64_t Count() const { return count_; }
+  uint64_t Max() const { return max_; }
+  double Mean() const { return count_ == 0 ? 0 : double(sum_) / count_; }
+
+ private:
+  static constexpr int kSubBits = 7;
+  static constexpr uint64_t kSubCount = 1ULL << kSubBits;
+  static constexpr uint64_t kHalf = kSubCount / 2;
+  //!< Values up to 2^kTopBit ns (about 18 minutes) are kept apart.
+  static constexpr int kTopBit = 40;
+  static constexpr size_t kBuckets = kSubCount + (kTopBit - kSubBits) * kHalf;
+
+  static size_t index(uint64_t v) {
+    if (v < kSubCount) {
+      return v;
+    }
+    int exponent = 63 - __builtin_clzll(v);
+    if (exponent >= kTopBit) {
+      return kBuckets - 1;
+    }
+    int shift = exponent - kSubBits + 1;
+    return kSubCount + (shift - 1) * kHalf + ((v >> shift) - kHalf);
+  }
+
+  //! @brief Largest value falling in bucket `i`.
+  static uint64_t highest(size_t i) {
+    if (i < kSubCount) {
+      return i;
+    }
+    int shift = (i - kSubCount) / kHalf + 1;
+    uint64_t sub = (i - kSubCount) % kHalf + kHalf;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t max_ = 0;
+};
+
+
+//! @brief Picks the keys of the requests.
+//!
+//! @details `uniform` spreads the requests evenly, `zipfian` makes a few keys
+//!          hot (YCSB's generator, ranks scattered over the key space so the
+//!          hot keys do not share a worker) and `latest` makes the keys
+//!          written last the hottest, each Put of it writing a new key.
+class keyGenerator {
+ public:
+  keyGenerator(const std::string& distribution, int64_t keys, double theta)
+      : latest_(distribution == "latest"),
+        zipfian_(distribution == "zipfian" || latest_),
+        keys_(std::max<int64_t>(1, keys)), inserted_(keys_), theta_(theta) {
+    if (!zipfian_) {
+      return;
+    }
+    for (int64_t i = 1; i <= keys_; ++i) {
+      zetan_ += 1 / std::pow(double(i), theta_);
+    }
+    double zeta2 = 1 + 1 / std::pow(2.0, theta_);
+    alpha_ = 1 / (1 - theta_);
+    eta_ = (1 - std::pow(2.0 / keys_, 1 - theta_)) / (1 - zeta2 / zetan_);
+  }
+
+  //! @brief Key of a Get or Del.
+  int64_t Next(std::mt19937_64& rng) {
+    if (!zipfian_) {
+      return std::uniform_int_distribution<int64_t>(0, keys_ - 1)(rng);
+    }
+    int64_t rank = zipf(rng);
+    if (latest_) {
+      int64_t latest = inserted_.load(std::memory_order_relaxed) - 1;
+      return std::max<int64_t>(0, latest - rank);
+    }
+    return scramble(rank);
+  }
+
+  //! @brief Key of a Put.
+  int64_t NextWrite(std::mt19937_64& rng) {
+    if (latest_) {
+      return inserted_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return Next(rng);
+  }
+
+  static std::string Key(int64_t id) { return "key" + std::to_string(id); }
+
+ private:
+  int64_t zipf(std::mt19937_64& rng) {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan_;
+    if (uz < 1) {
+      return 0;
+    }
+    if (uz < 1 + std::pow(0.5, theta_)) {
+      return std::min<int64_t>(1, keys_ - 1);
+    }
+    int64_t rank = keys_ * std::pow(eta_ * u - eta_ + 1, alpha_);
+    return std::min(rank, keys_ - 1);
+  }
+
+  //! @brief FNV-1a of the rank, to scatter the hot keys.
+  int64_t scramble(int64_t rank) const {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < 8; ++i) {
+      h ^= (static_cast<uint64_t>(rank) >> (i * 8)) & 0xff;
+      h *= 1099511628211ULL;
+    }
+    return h % keys_;
+  }
+
+  const bool latest_;
+  const bool zipfian_;
+  const int64_t keys_;
+  std::atomic<int64_t> inserted_;
+  const double theta_;
+  double zetan_ = 0;
+  double alpha_ = 0;
+  double eta_ = 0;
+};
+
+
+//! @brief Result of one load thread.
+struct benchResult {
+  latencyHistogram latency[kOps];
+  uint64_t errors[kOps] = {};
+};
+
+
+//! @brief One load thread driving its own completion queue.
+//!
+//! @details Closed loop : keeps `window` requests in flight and sends a new
+//!          one as soon as one completes. Open loop : sends on a fixed
+//!          schedule at `rate` requests per second, and a request delayed
+//!          because `window` are in flight is timed from its scheduled send
+//!          time, so a stalled server shows in the latencies instead of
+//!          slowing the load down (coordinated omission).
+class benchWorker {
+ public:
+  benchWorker(std::shared_ptr<Channel> channel, keyGenerator* keys,
+              const std::string* values, int window, double rate,
+              ReadPolicy read_policy, routingTable* routing, uint64_t seed)
+      : stub_(kvMethods::NewStub(channel)), keys_(keys), values_(values),
+        window_(std::max(1, window)), rate_(rate), read_policy_(read_policy),
+        routing_(routing), rng_(seed) {}
+
+  //! @brief Run until `end`, recording the requests completed after
+  //!        `measure`.
+  void Run(Clock::time_point start, Clock::time_point measure,
+           Clock::time_point end) {
+    measure_ = measure;
+    const bool open_loop = rate_ > 0;
+    const auto interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(open_loop ? 1 / rate_ : 0));
+    Clock::time_point next_send = start;
+
+    if (!open_loop) {
+      for (int i = 0; i < window_; ++i) {
+        send(start);
+      }
+    }
+
+    while (true) {
+      Clock::time_point now = Clock::now();
+      if (open_loop && now < end) {
+        // Send everything due, as far as the window allows.
+        while (next_send <= now && inflight_ < window_) {
+          send(next_send);
+          next_send += interval;
+        }
+      }
+      if (now >= end && inflight_ == 0) {
+        break;
+      }
+
+      Clock::time_point wake = end;
+      if (open_loop && now < end && inflight_ < window_) {
+        wake = std::min(wake, next_send);
+      }
+      if (now >= end) {
+        wake = now + std::chrono::seconds(1);
+      }
+      void* tag;
+      bool ok;
+      // gRPC deadlines are on the system clock.
+      CompletionQueue::NextStatus status = cq_.AsyncNext(
+          &tag, &ok, std::chrono::system_clock::now() + (wake - now));
+      if (status == CompletionQueue::SHUTDOWN) {
+        break;
+      }
+      if (status == CompletionQueue::GOT_EVENT) {
+        complete(static_cast<asyncCall*>(tag));
+        if (!open_loop && Clock::now() < end) {
+          send(Clock::now());
+        }
+      }
+    }
+
+    cq_.Shutdown();
+    void* tag;
+    bool ok;
+    while (cq_.Next(&tag, &ok)) {
+      delete static_cast<asyncCall*>(tag);
+    }
+  }
+
+  const benchResult& Result() const { return result_; }
+
+ private:
+  struct asyncCall {
+    benchOp op;
+    Clock::time_point scheduled;
+    KVRequest request;
+    KVResponse response;
+    ClientContext context;
+    Status status;
+    std::unique_ptr<ClientAsyncResponseReader<KVResponse>> reader;
+    //!< Owning worker the call went to, in direct mode.
+    std::shared_ptr<kvMethods::Stub> worker;
+  };
+
+  //! @brief Get the stub to send the call to : its key's owner in direct
+  //!        mode, the target otherwise.
+  kvMethods::Stub* route(asyncCall* call) {
+    if (routing_ == nullptr ||
+        call->request.read_policy() != distributedKV::PRIMARY) {
+      return stub_.get();
+    }
+    uint64_t version;
+    call->worker = routing_->Owner(call->request.key(), &version);
+    if (call->worker == nullptr) {
+      return stub_.get();
+    }
+    call->request.set_routing_version(version);
+    return call->worker.get();
+  }
+
+  //! @brief Pick an operation by the mix flags and send it.
+  void send(Clock::time_point scheduled) {
+    static const int get_pct = absl::GetFlag(FLAGS_get_pct);
+    static const int put_pct = absl::GetFlag(FLAGS_put_pct);
+    static const int del_pct = absl::GetFlag(FLAGS_del_pct);
+    static const int value_size = absl::GetFlag(FLAGS_value_size);
+    static const int value_size_max =
+        std::max(value_size, absl::GetFlag(FLAGS_value_size_max));
+
+    int total = std::max(1, get_pct + put_pct + del_pct);
+    int roll = std::uniform_int_distribution<int>(0, total - 1)(rng_);
+    auto call = new asyncCall;
+    call->scheduled = scheduled;
+    call->op = roll < get_pct ? kGet : roll < get_pct + put_pct ? kPut : kDel;
+
+    if (call->op == kPut) {
+      int size = std::uniform_int_distribution<int>(value_size,
+                                                    value_size_max)(rng_);
+      call->request.set_key(keyGenerator::Key(keys_->NextWrite(rng_)));
+      call->request.set_value(values_->data(), size);
+      call->reader = route(call)->PrepareAsyncPut(&call->context,
+                                                  call->request, &cq_);
+    } else {
+      call->request.set_key(keyGenerator::Key(keys_->Next(rng_)));
+      if (call->op == kGet) {
+        call->request.set_read_policy(read_policy_);
+      }
+      kvMethods::Stub* stub = route(call);
+      call->reader = call->op == kGet
+          ? stub->PrepareAsyncGet(&call->context, call->request, &cq_)
+          : stub->PrepareAsyncDel(&call->context, call->request, &cq_);
+    }
+    call->reader->StartCall();
+    call->reader->Finish(&call->response, &call->status, call);
+    inflight_ += 1;
+  }
+
+  void complete(asyncCall* call) {
+    inflight_ -= 1;
+    grpc::StatusCode code = call->status.error_code();
+    if (call->worker != nullptr &&
+        (code == grpc::StatusCode::FAILED_PRECONDITION ||
+         code == grpc::StatusCode::UNAVAILABLE)) {
+      // Stale routing : the call counts as failed, later ones use the
+      // refreshed table.
+      routing_->Refresh(call->request.routing_version());
+    }
+    Clock::time_point now = Clock::now();
+    if (now >= measure_) {
+      uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          now - call->scheduled).count();
+      result_.latency[call->op].Record(ns);
+      if (!call->status.ok() || call->response.error()) {
+        result_.errors[call->op] += 1;
+      }
+    }
+    delete call;
+  }
+
+  std::unique_ptr<kvMethods::Stub> stub_;
+  keyGenerator* keys_;
+  const std::string* values_;
+  const int window_;
+  const double rate_;
+  const ReadPolicy read_policy_;
+  routingTable* routing_;
+  std::mt19937_64 rng_;
+  CompletionQueue cq_;
+  int inflight_ = 0;
+  Clock::time_point measure_;
+  benchResult result_;
+};
+
+
+//! @brief Write every key once through BulkLoad.
+//!
+//! @return true if the whole key space got loaded.
+bool preload(std::shared_ptr<Channel> channel, int64_t keys,
+             const std::string& values) {
+  std::unique_ptr<kvMethods::Stub> stub(kvMethods::NewStub(channel));
+  BulkLoadResponse response;
+  ClientContext context;
+  std::unique_ptr<grpc::ClientWriter<KVRequest>> writer(
+      stub->BulkLoad(&context, &response));
+  KVRequest request;
+  request.set_value(values.data(), absl::GetFlag(FLAGS_value_size));
+  for (int64_t i = 0; i < keys; ++i) {
+    request.set_key(keyGenerator::Key(i));
+    if (!writer->Write(request)) {
+      break;
+    }
+  }
+  writer->WritesDone();
+  Status status = writer->Finish();
+  if (!status.ok() || response.error()) {
+    std::cerr << "Preload failed: "
+              << (status.ok() ? response.message() : status.error_message())
+              << std::endl;
+    return false;
+  }
+  return response.count() == keys;
+}
+
+
+//! @brief Latency summary of one operation as a JSON object.
+std::string latencyJson(const latencyHistogram& latency, uint64_t errors,
+                        double seconds) {
+  return absl::StrFormat(
+      "{\"count\": %d, \"errors\": %d, \"throughput\": %.1f, "
+      "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+      "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+      latency.Count(), errors, latency.Count() / seconds,
+      latency.Mean() / 1e3, latency.Percentile(0.5) / 1e3,
+      latency.Percentile(0.9) / 1e3, latency.Percentile(0.99) / 1e3,
+      latency.Percentile(0.999) / 1e3, latency.Max() / 1e3);
+}
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  const std::string target = absl::GetFlag(FLAGS_target);
+  const int threads = std::max(1, absl::GetFlag(FLAGS_threads));
+  const int concurrency = std::max(threads, absl::GetFlag(FLAGS_concurrency));
+  const double qps = absl::GetFlag(FLAGS_qps);
+  const int64_t keys = std::max<int64_t>(1, absl::GetFlag(FLAGS_keys));
+  const std::string distribution = absl::GetFlag(FLAGS_distribution);
+  if (distribution != "uniform" && distribution != "zipfian" &&
+      distribution != "latest") {
+    std::cerr << "Unknown distribution: " << distribution << std::endl;
+    return 1;
+  }
+  const std::string read_policy = absl::GetFlag(FLAGS_read_policy);
+  ReadPolicy policy;
+  if (read_policy == "primary") {
+    policy = distributedKV::PRIMARY;
+  } else if (read_policy == "any") {
+    policy = distributedKV::ANY_REPLICA;
+  } else if (read_policy == "bounded") {
+    policy = distributedKV::BOUNDED_STALENESS;
+  } else if (read_policy == "least") {
+    policy = distributedKV::LEAST_LOADED;
+  } else {
+    std::cerr << "Unknown read policy: " << read_policy << std::endl;
+    return 1;
+  }
+
+  // Every channel gets its own connection.
+  std::vector<std::shared_ptr<Channel>> channels;
+  for (int i = 0; i < std::max(1, absl::GetFlag(FLAGS_channels)); ++i) {
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    channels.push_back(grpc::CreateCustomChannel(
+        target, grpc::InsecureChannelCredentials(), args));
+  }
+
+  std::mt19937_64 rng(std::random_device{}());
+  std::string values(std::max(absl::GetFlag(FLAGS_value_size),
+                              absl::GetFlag(FLAGS_value_size_max)), 'x');
+  for (char& c : values) {
+    c = 'a' + rng() % 26;
+  }
+  if (absl::GetFlag(FLAGS_preload) &&
+      !preload(channels[0], keys, values)) {
+    return 1;
+  }
+
+  std::unique_ptr<routingTable> routing;
+  if (absl::GetFlag(FLAGS_direct)) {
+    routing.reset(new routingTable(channels[0]));
+    if (!routing->Refresh()) {
+      std::cerr << "Cannot fetch the routing table from " << target
+                << std::endl;
+      return 1;
+    }
+  }
+
+  keyGenerator generator(distribution, keys, absl::GetFlag(FLAGS_zipf_theta));
+  std::vector<std::unique_ptr<benchWorker>> workers;
+  for (int i = 0; i < threads; ++i) {
+    int window = concurrency / threads + (i < concurrency % threads);
+    workers.emplace_back(new benchWorker(channels[i % channels.size()],
+                                         &generator, &values, window,
+                                         qps / threads, policy, routing.get(),
+                                         rng()));
+  }
+
+  const Clock::time_point start = Clock::now();
+  const Clock::time_point measure =
+      start + std::chrono::seconds(std::max(0, absl::GetFlag(FLAGS_warmup_s)));
+  const Clock::time_point end =
+      measure + std::chrono::seconds(std::max(1, absl::GetFlag(FLAGS_duration_s)));
+  std::vector<std::thread> pool;
+  for (auto& worker : workers) {
+    benchWorker* w = worker.get();
+    pool.emplace_back([w, start, measure, end] { w->Run(start, measure, end); });
+  }
+  for (std::thread& thread : pool) {
+    thread.join();
+  }
+  const double seconds =
+      std::chrono::duration<double>(end - measure).count();
+
+  // Merge the threads and report.
+  benchResult total;
+  latencyHistogram all;
+  uint64_t errors = 0;
+  for (auto& worker : workers) {
+    for (int op = 0; op < kOps; ++op) {
+      total.latency[op].Merge(worker->Result().latency[op]);
+      total.errors[op] += worker->Result().errors[op];
+    }
+  }
+  for (int op = 0; op < kOps; ++op) {
+    all.Merge(total.latency[op]);
+    errors += total.errors[op];
+  }
+
+  std::ostringstream report;
+  report << "{\n"
+         << absl::StrFormat(
+                "  \"config\": {\"target\": \"%s\", \"mode\": \"%s\", "
+                "\"qps\": %.1f, \"threads\": %d, \"channels\": %d, "
+                "\"concurrency\": %d, \"keys\": %d, \"distribution\": \"%s\", "
+                "\"read_policy\": \"%s\", \"direct\": %s, "
+                "\"value_size\": %d, "
+                "\"mix\": [%d, %d, %d], "
+                "\"duration_s\": %.1f},\n",
+                target, qps > 0 ? "open" : "closed", qps, threads,
+                channels.size(), concurrency, keys, distribution, read_policy,
+                routing != nullptr ? "true" : "false",
+                absl::GetFlag(FLAGS_value_size), absl::GetFlag(FLAGS_get_pct),
+                absl::GetFlag(FLAGS_put_pct), absl::GetFlag(FLAGS_del_pct),
+                seconds)
+         << "  \"all\": " << latencyJson(all, errors, seconds);
+  for (int op = 0; op < kOps; ++op) {
+    report << ",\n  \"" << kOpNames[op] << "\": "
+           << latencyJson(total.latency[op], total.errors[op], seconds);
+  }
+  report << "\n}\n";
+
+  const std::string out = absl::GetFlag(FLAGS_out);
+  if (out.empty()) {
+    std::cout << report.str();
+  } else {
+    std::ofstream(out) << report.str();
+  }
+  return 0;
+}
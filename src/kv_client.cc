@@ -16,9 +16,15 @@
  *
  */
 
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "absl/flags/flag.h"
@@ -32,8 +38,15 @@
 #include "distributedKV.grpc.pb.h"
 #endif
 
+#include "logger.h"
+#include "routing_table.h"
+
 // Default target (master)
 ABSL_FLAG(std::string, target, "localhost:50051", "Server address");
+ABSL_FLAG(int, chunk_kb, 256, "Size of the chunks `putf` sends, in KB");
+ABSL_FLAG(bool, direct, false,
+          "Send gets, puts and deletes straight to the owning worker, using "
+          "the master's routing table");
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -46,6 +59,13 @@ using distributedKV::HelloRequest;
 using distributedKV::kvMethods;
 using distributedKV::KVRequest;
 using distributedKV::KVResponse;
+using distributedKV::ReadPolicy;
+using distributedKV::MultiKVRequest;
+using distributedKV::MultiKVResponse;
+using distributedKV::BulkLoadResponse;
+using distributedKV::ScanRequest;
+using distributedKV::KVEntry;
+using distributedKV::ValueChunk;
 
 
 class GreeterClient {
@@ -86,32 +106,52 @@ class GreeterClient {
 
 //! @brief KV Client End ---> Master Server
 //! 
+//! @details In direct mode, single-key requests are routed by the cached
+//!          routing table and only fall back to the master when no worker
+//!          takes them.
 class kvMethodsClient {
  public:
-  kvMethodsClient(std::shared_ptr<Channel> channel)
-      : stub_(kvMethods::NewStub(channel)) {}
+  kvMethodsClient(std::shared_ptr<Channel> channel, bool direct = false)
+      : stub_(kvMethods::NewStub(channel)) {
+    if (direct) {
+      routing_.reset(new routingTable(channel));
+      if (!routing_->Refresh()) {
+        std::cout << "Cannot fetch the routing table, "
+                  << "going through the master." << std::endl;
+      }
+    }
+  }
 
   //! @brief Get the value from remoteDB with key.
   //! 
   //! @param key : to query.
+  //! @param policy : copy of the key to read, a bounded-staleness read sees
+  //!                 this client's last write of the key.
   //! @return KVResponse : the response
-  KVResponse Get(const std::string& key) {
+  KVResponse Get(const std::string& key,
+                 ReadPolicy policy = distributedKV::PRIMARY) {
     KVRequest request;
     request.set_key(key);
+    request.set_read_policy(policy);
+    auto written = last_seq_.find(key);
+    if (written != last_seq_.end()) {
+      request.set_min_seq(written->second);
+    }
 
     KVResponse response;
     
-    ClientContext context;
-    
     // actual rpc
-    Status status = stub_->Get(&context, request, &response);
+    Status status = route(&request, &response,
+                          [&](kvMethods::Stub* stub, ClientContext* context) {
+                            return stub->Get(context, request, &response);
+                          });
 
     if (status.ok()) {
-      std:: cout << "Message: " << response.message() << std::endl;
+      KV_LOG(kLogDebug) << "Message: " << response.message();
       return response;
     } else {
-      std::cout << "Code "<< status.error_code() << ": " 
-                << status.error_message() << std::endl;
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
       response.set_error(true);
       return response;
     }
@@ -130,17 +170,21 @@ class kvMethodsClient {
 
     KVResponse response;
     
-    ClientContext context;
-    
     // actual rpc
-    Status status = stub_->Put(&context, request, &response);
+    Status status = route(&request, &response,
+                          [&](kvMethods::Stub* stub, ClientContext* context) {
+                            return stub->Put(context, request, &response);
+                          });
 
     if (status.ok()) {
-      std:: cout << "Message: " << response.message() << std::endl;
+      KV_LOG(kLogDebug) << "Message: " << response.message();
+      if (!response.error()) {
+        last_seq_[key] = response.seq();
+      }
       return response;
     } else {
-      std::cout << "Code "<< status.error_code() << ": " 
-                << status.error_message() << std::endl;
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
       response.set_error(true);
       return response;
     }
@@ -156,26 +200,283 @@ class kvMethodsClient {
 
     KVResponse response;
     
+    // actual rpc
+    Status status = route(&request, &response,
+                          [&](kvMethods::Stub* stub, ClientContext* context) {
+                            return stub->Del(context, request, &response);
+                          });
+
+    if (status.ok()) {
+      KV_LOG(kLogDebug) << "Message: " << response.message();
+      if (!response.error() && response.seq() != 0) {
+        last_seq_[key] = response.seq();
+      }
+      return response;
+    } else {
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
+      response.set_error(true);
+      return response;
+    }
+  }
+
+  //! @brief Stream every `key value` line of a file to the remoteDB.
+  //! 
+  //! @param path : file to import.
+  //! @return BulkLoadResponse : the response with the imported count.
+  BulkLoadResponse BulkLoad(const std::string& path) {
+    BulkLoadResponse response;
+
+    std::ifstream file(path);
+    if (!file) {
+      std::cout << "Cannot open " << path << std::endl;
+      response.set_error(true);
+      return response;
+    }
+
     ClientContext context;
-    
+
+    // actual rpc
+    std::unique_ptr<grpc::ClientWriter<KVRequest>> writer(
+        stub_->BulkLoad(&context, &response));
+    KVRequest request;
+    std::string line;
+    while (std::getline(file, line)) {
+      std::istringstream iss(line);
+      std::string key;
+      std::string value;
+      if (!(iss >> key >> value)) {
+        continue;
+      }
+      request.set_key(key);
+      request.set_value(value);
+      if (!writer->Write(request)) {
+        break;
+      }
+    }
+    writer->WritesDone();
+    Status status = writer->Finish();
+
+    if (status.ok()) {
+      KV_LOG(kLogDebug) << "Message: " << response.message();
+      return response;
+    } else {
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
+      response.set_error(true);
+      return response;
+    }
+  }
+
+  //! @brief Put the content of a file as the value of key, sent in chunks :
+  //!        the file is never loaded whole.
+  //! 
+  //! @param key : to update.
+  //! @param path : file holding the value.
+  //! @return KVResponse : the response.
+  KVResponse PutFile(const std::string& key, const std::string& path) {
+    KVResponse response;
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      std::cout << "Cannot open " << path << std::endl;
+      response.set_error(true);
+      return response;
+    }
+
+    ClientContext context;
+
+    // actual rpc
+    std::unique_ptr<grpc::ClientWriter<ValueChunk>> writer(
+        stub_->PutStream(&context, &response));
+    const size_t chunk_size =
+        static_cast<size_t>(std::max(1, absl::GetFlag(FLAGS_chunk_kb))) << 10;
+    ValueChunk chunk;
+    chunk.set_key(key);
+    std::string buffer(chunk_size, '\0');
+    while (true) {
+      file.read(&buffer[0], chunk_size);
+      chunk.set_data(buffer.data(), file.gcount());
+      chunk.set_last(file.peek() == std::char_traits<char>::eof());
+      if (!writer->Write(chunk) || chunk.last()) {
+        break;
+      }
+      chunk.clear_key();
+    }
+    writer->WritesDone();
+    Status status = writer->Finish();
+
+    if (status.ok()) {
+      KV_LOG(kLogDebug) << "Message: " << response.message();
+      if (!response.error()) {
+        last_seq_[key] = response.seq();
+      }
+      return response;
+    } else {
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
+      response.set_error(true);
+      return response;
+    }
+  }
+
+  //! @brief Write the value of key to a file, received in chunks.
+  //! 
+  //! @param key : to query.
+  //! @param path : file to write.
+  //! @return int64_t : bytes written, -1 if the rpc failed.
+  int64_t GetFile(const std::string& key, const std::string& path) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      std::cout << "Cannot open " << path << std::endl;
+      return -1;
+    }
+
+    KVRequest request;
+    request.set_key(key);
+
+    ClientContext context;
+
+    // actual rpc
+    std::unique_ptr<grpc::ClientReader<ValueChunk>> reader(
+        stub_->GetStream(&context, request));
+    int64_t size = 0;
+    ValueChunk chunk;
+    while (reader->Read(&chunk)) {
+      file.write(chunk.data().data(), chunk.data().size());
+      size += chunk.data().size();
+    }
+    Status status = reader->Finish();
+
+    if (status.ok()) {
+      return size;
+    } else {
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
+      return -1;
+    }
+  }
+
+  //! @brief Print the entries of a key range in key order.
+  //! 
+  //! @param request : range, prefix and limit of the scan.
+  //! @return int64_t : number of entries printed, -1 if the rpc failed.
+  int64_t Scan(const ScanRequest& request) {
+    ClientContext context;
+
     // actual rpc
-    Status status = stub_->Del(&context, request, &response);
+    std::unique_ptr<grpc::ClientReader<KVEntry>> reader(
+        stub_->Scan(&context, request));
+    int64_t count = 0;
+    KVEntry entry;
+    while (reader->Read(&entry)) {
+      std::cout << "`" << entry.key() << "`-`" << entry.value() << "`"
+                << std::endl;
+      count += 1;
+    }
+    Status status = reader->Finish();
 
     if (status.ok()) {
-      std:: cout << "Message: " << response.message() << std::endl;
+      return count;
+    } else {
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
+      return -1;
+    }
+  }
+
+  //! @brief Get, Put or Delete many entries in one round trip.
+  //! 
+  //! @param method : `get`, `put` or `del`.
+  //! @param keys : to operate on.
+  //! @param values : new values, only for `put`.
+  //! @return MultiKVResponse : one response per key, in order.
+  MultiKVResponse Multi(const std::string& method,
+                        const std::vector<std::string>& keys,
+                        const std::vector<std::string>& values = {}) {
+    MultiKVRequest request;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      KVRequest* entry = request.add_requests();
+      entry->set_key(keys[i]);
+      if (i < values.size()) {
+        entry->set_value(values[i]);
+      }
+    }
+
+    MultiKVResponse response;
+
+    ClientContext context;
+
+    // actual rpc
+    Status status;
+    if (method == "get") {
+      status = stub_->MultiGet(&context, request, &response);
+    } else if (method == "put") {
+      status = stub_->MultiPut(&context, request, &response);
+    } else {
+      status = stub_->MultiDel(&context, request, &response);
+    }
+
+    if (status.ok()) {
+      KV_LOG(kLogDebug) << "Message: " << response.message();
       return response;
     } else {
-      std::cout << "Code "<< status.error_code() << ": " 
-                << status.error_message() << std::endl;
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
       response.set_error(true);
       return response;
     }
   }
 
  private:
+  using call = std::function<Status(kvMethods::Stub*, ClientContext*)>;
+
+  //! @brief Run a single-key call on the key's owner in direct mode, on the
+  //!        master otherwise. Reads from replicas are left to the master.
+  //! 
+  //! @details A `stale routing` or unreachable worker refreshes the routing
+  //!          table and the call is sent again, the master takes it if the
+  //!          new table does not help either.
+  Status route(KVRequest* request, KVResponse* response, const call& rpc) {
+    bool direct = routing_ != nullptr &&
+        request->read_policy() == distributedKV::PRIMARY;
+    for (int attempt = 0; direct && attempt < 2; ++attempt) {
+      uint64_t version;
+      std::shared_ptr<kvMethods::Stub> worker =
+          routing_->Owner(request->key(), &version);
+      if (worker == nullptr) {
+        break;
+      }
+      request->set_routing_version(version);
+      ClientContext context;
+      Status status = rpc(worker.get(), &context);
+      if (status.error_code() != grpc::StatusCode::FAILED_PRECONDITION &&
+          status.error_code() != grpc::StatusCode::UNAVAILABLE) {
+        return status;
+      }
+      response->Clear();
+      routing_->Refresh(version);
+    }
+    request->clear_routing_version();
+    ClientContext context;
+    return rpc(stub_.get(), &context);
+  }
+
   std::unique_ptr<kvMethods::Stub> stub_;
+  //!< Cached routing table, only in direct mode.
+  std::unique_ptr<routingTable> routing_;
+  //!< Seq of this client's last write of every key.
+  std::unordered_map<std::string, uint64_t> last_seq_;
 };
 
+//! @brief Show the server's reply message : why a call failed, or that
+//!        the key was not found.
+void printMessage(const std::string& message) {
+  if (!message.empty()) {
+    std::cout << "Message: " << message << std::endl;
+  }
+}
+
 //! @brief Ask user to retry.
 //! 
 //! @return true if user input `y` or `yes`.
@@ -192,6 +493,25 @@ bool pendingHandler() {
 }
 
 
+//! @brief Parse the name of a read policy.
+//! 
+//! @return false if the name is unknown.
+bool parseReadPolicy(const std::string& name, ReadPolicy* policy) {
+  if (name == "primary") {
+    *policy = distributedKV::PRIMARY;
+  } else if (name == "any") {
+    *policy = distributedKV::ANY_REPLICA;
+  } else if (name == "bounded") {
+    *policy = distributedKV::BOUNDED_STALENESS;
+  } else if (name == "least") {
+    *policy = distributedKV::LEAST_LOADED;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
 //! @brief Process the command from user input.
 //! 
 //! @param args : the command line arguments.
@@ -206,19 +526,46 @@ void processCommand(const std::vector<std::string>& args, kvMethodsClient& metho
     std::cout << "These are methods' examples:" << std::endl;
     std::cout << "get -k 16         Get the value from remoteDB with key=16." 
               << std::endl;
+    std::cout << "get -k 16 -r any  Read it from any copy : primary, any, "
+              << "bounded or least." << std::endl;
     std::cout << "del -k 32         Delete the entry on the remoteDB with key=32." 
               << std::endl;
     std::cout << "put -k 64  -v 8   Put the value=8 to the remoteDB with key=64." 
               << std::endl;
+    std::cout << "mget -k 16 32     Get the values of key=16 and key=32 at once." 
+              << std::endl;
+    std::cout << "mdel -k 16 32     Delete key=16 and key=32 at once." 
+              << std::endl;
+    std::cout << "mput -k 16 -v 1 -k 32 -v 2" << std::endl
+              << "                  Put key=16 and key=32 at once." 
+              << std::endl;
+    std::cout << "load -f data.txt  Import every `key value` line of data.txt." 
+              << std::endl;
+    std::cout << "putf -k 64 -f in.bin" << std::endl
+              << "                  Put the content of in.bin as the value "
+              << "of key=64, in chunks." << std::endl;
+    std::cout << "getf -k 64 -f out.bin" << std::endl
+              << "                  Write the value of key=64 to out.bin, "
+              << "in chunks." << std::endl;
+    std::cout << "scan -s a -e b -p a -l 10" << std::endl
+              << "                  List up to 10 entries in [a, b) starting "
+              << "with a, every flag is optional." << std::endl;
     std::cout << std::endl;
   } else if (method.compare("get") == 0) {    // GET
-    if (args.size() != 3) {                   // - failed request
+    ReadPolicy policy = distributedKV::PRIMARY;
+    bool valid = args.size() == 3 || (args.size() == 5 
+                                      && args[3].compare("-r") == 0);
+    if (valid && args.size() == 5) {
+      valid = parseReadPolicy(args[4], &policy);
+    }
+    if (!valid) {                             // - failed request
       std::cout << "pandaRDB: Incorrect parameters for `get`. See 'help'." 
                 << std::endl;
     } else {    
       if (args[1].compare("-k") == 0) {       // - successfully request
         key = args[2];
-        KVResponse response = methods.Get(key);
+        KVResponse response = methods.Get(key, policy);
+        printMessage(response.message());
         if (response.error()) {            // - failed response
           if (pendingHandler()) {
             processCommand(args, methods);
@@ -241,6 +588,7 @@ void processCommand(const std::vector<std::string>& args, kvMethodsClient& metho
       if (args[1].compare("-k") == 0) {       // - successfully request
         key = args[2];
         KVResponse response = methods.Del(key);
+        printMessage(response.message());
         if (response.error()) {            // - failed response
           if (pendingHandler()) {
             processCommand(args, methods);
@@ -265,6 +613,7 @@ void processCommand(const std::vector<std::string>& args, kvMethodsClient& metho
         key = args[2];
         value = args[4];
         KVResponse response = methods.Put(key, value);
+        printMessage(response.message());
         if (response.error()) {            // - failed response
           if (pendingHandler()) {
             processCommand(args, methods);
@@ -279,6 +628,129 @@ void processCommand(const std::vector<std::string>& args, kvMethodsClient& metho
                   << std::endl;
       }
     }
+  } else if (method.compare("mget") == 0
+             || method.compare("mdel") == 0) {  // MGET / MDEL
+    if (args.size() < 3 || args[1].compare("-k") != 0) {  // - failed request
+      std::cout << "pandaRDB: Incorrect parameters for `" << method 
+                << "`. See 'help'." << std::endl;
+    } else {                                  // - successfully request
+      std::vector<std::string> keys(args.begin() + 2, args.end());
+      MultiKVResponse response = methods.Multi(method.substr(1), keys);
+      printMessage(response.message());
+      if (response.error()) {              // - failed response
+        if (pendingHandler()) {
+          processCommand(args, methods);
+        }
+      } else {                                // - successfully response
+        for (int i = 0; i < response.responses_size(); ++i) {
+          std::cout << "pandaRDB: `" << keys[i] << "`-`" 
+                    << response.responses(i).value() << "` "
+                    << response.responses(i).message() << std::endl;
+        }
+      }
+    }
+  } else if (method.compare("mput") == 0) {   // MPUT
+    std::vector<std::string> keys;
+    std::vector<std::string> values;
+    bool valid = args.size() >= 5 && (args.size() - 1) % 4 == 0;
+    for (size_t i = 1; valid && i + 3 < args.size(); i += 4) {
+      valid = args[i].compare("-k") == 0 && args[i + 2].compare("-v") == 0;
+      keys.push_back(args[i + 1]);
+      values.push_back(args[i + 3]);
+    }
+    if (!valid) {                             // - failed request
+      std::cout << "pandaRDB: Incorrect parameters for `mput`. See 'help'." 
+                << std::endl;
+    } else {                                  // - successfully request
+      MultiKVResponse response = methods.Multi("put", keys, values);
+      printMessage(response.message());
+      if (response.error()) {              // - failed response
+        if (pendingHandler()) {
+          processCommand(args, methods);
+        }
+      } else {                                // - successfully response
+        std::cout << "pandaRDB: Successfully put " << keys.size() 
+                  << " entries." << std::endl;
+      }
+    }
+  } else if (method.compare("load") == 0) {   // LOAD
+    if (args.size() != 3 || args[1].compare("-f") != 0) {  // - failed request
+      std::cout << "pandaRDB: Incorrect parameters for `load`. See 'help'." 
+                << std::endl;
+    } else {                                  // - successfully request
+      BulkLoadResponse response = methods.BulkLoad(args[2]);
+      printMessage(response.message());
+      if (response.error()) {              // - failed response
+        if (pendingHandler()) {
+          processCommand(args, methods);
+        }
+      } else {                                // - successfully response
+        std::cout << "pandaRDB: Successfully imported " << response.count() 
+                  << " entries." << std::endl;
+      }
+    }
+  } else if (method.compare("putf") == 0) {   // PUTF
+    if (args.size() != 5 || args[1].compare("-k") != 0
+        || args[3].compare("-f") != 0) {      // - failed request
+      std::cout << "pandaRDB: Incorrect parameters for `putf`. See 'help'." 
+                << std::endl;
+    } else {                                  // - successfully request
+      KVResponse response = methods.PutFile(args[2], args[4]);
+      if (response.error()) {              // - failed response
+        printMessage(response.message());
+        if (pendingHandler()) {
+          processCommand(args, methods);
+        }
+      } else {                                // - successfully response
+        std::cout << "pandaRDB: " << response.message() << std::endl;
+      }
+    }
+  } else if (method.compare("getf") == 0) {   // GETF
+    if (args.size() != 5 || args[1].compare("-k") != 0
+        || args[3].compare("-f") != 0) {      // - failed request
+      std::cout << "pandaRDB: Incorrect parameters for `getf`. See 'help'." 
+                << std::endl;
+    } else {                                  // - successfully request
+      int64_t size = methods.GetFile(args[2], args[4]);
+      if (size < 0) {                         // - failed response
+        if (pendingHandler()) {
+          processCommand(args, methods);
+        }
+      } else {                                // - successfully response
+        std::cout << "pandaRDB: Successfully wrote " << size 
+                  << " bytes to `" << args[4] << "`." << std::endl;
+      }
+    }
+  } else if (method.compare("scan") == 0) {   // SCAN
+    ScanRequest request;
+    bool valid = args.size() % 2 == 1;
+    for (size_t i = 1; valid && i + 1 < args.size(); i += 2) {
+      if (args[i].compare("-s") == 0) {
+        request.set_start(args[i + 1]);
+      } else if (args[i].compare("-e") == 0) {
+        request.set_end(args[i + 1]);
+      } else if (args[i].compare("-p") == 0) {
+        request.set_prefix(args[i + 1]);
+      } else if (args[i].compare("-l") == 0) {
+        request.set_limit(std::atoll(args[i + 1].c_str()));
+      } else {
+        valid = false;
+      }
+    }
+    if (!valid) {                             // - failed request
+      std::cout << "pandaRDB: Incorrect parameters for `scan`. See 'help'." 
+                << std::endl;
+    } else {                                  // - successfully request
+      int64_t count = methods.Scan(request);
+      if (count < 0) {                        // - failed response
+        if (pendingHandler()) {
+          processCommand(args, methods);
+        }
+      } else {                                // - successfully response
+        std::cout << "pandaRDB: Successfully scanned " << count 
+                  << " entries." << std::endl;
+      }
+    }
   } else {
     std::cout << "pandaRDB: " << method << " is not a command. See 'help'." 
               << std::endl;
@@ -302,7 +774,8 @@ int main(int argc, char** argv) {
   // std::cout << "Greeter received: " << reply << std::endl;
 
   kvMethodsClient methods(
-      grpc::CreateChannel(target_str, grpc::InsecureChannelCredentials()));
+      grpc::CreateChannel(target_str, grpc::InsecureChannelCredentials()),
+      absl::GetFlag(FLAGS_direct));
 
   // Logo
   std::cout << "                                                " << std::endl;
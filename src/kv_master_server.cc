@@ -16,10 +16,26 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
@@ -28,6 +44,12 @@
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
+#include <grpcpp/generic/generic_stub.h>
+#include <grpcpp/impl/codegen/proto_utils.h>
+#include <grpcpp/support/message_allocator.h>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 
 #ifdef BAZEL_BUILD
 #include "examples/protos/distributedKV.grpc.pb.h"
@@ -36,12 +58,20 @@
 
 #endif
 
+#include "consistent_hash_ring.h"
+#include "logger.h"
+#include "metrics.h"
+
 using grpc::Channel;
 using grpc::ClientContext;
 
+using grpc::CallbackServerContext;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
+using grpc::ServerReadReactor;
+using grpc::ServerUnaryReactor;
+using grpc::ServerWriteReactor;
 using grpc::Status;
 
 using distributedKV::Greeter;
@@ -51,6 +81,15 @@ using distributedKV::HelloReply;
 using distributedKV::kvMethods;
 using distributedKV::KVRequest;
 using distributedKV::KVResponse;
+using distributedKV::MultiKVRequest;
+using distributedKV::MultiKVResponse;
+using distributedKV::BulkLoadResponse;
+using distributedKV::ScanRequest;
+using distributedKV::KVEntry;
+using distributedKV::ValueChunk;
+using distributedKV::RoutingRequest;
+using distributedKV::RoutingTable;
+using distributedKV::WorkerEndpoint;
 
 using distributedKV::workerRegister;
 using distributedKV::workerSetup;
@@ -59,6 +98,47 @@ using distributedKV::survivalList;
 // Default port (master)
 ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
 ABSL_FLAG(std::string, addr, "localhost", "Server address");
+ABSL_FLAG(std::string, log_level, "info",
+          "Lowest level logged : debug, info, warn or error");
+ABSL_FLAG(int, log_sample, 100,
+          "Log one in N per-request lines, 1 logs every request");
+ABSL_FLAG(uint16_t, metrics_port, 0,
+          "Port serving the metrics over HTTP at /metrics, 0 disables");
+ABSL_FLAG(int, worker_channels, 4,
+          "Number of long-lived channels (connections) kept open per worker");
+ABSL_FLAG(bool, raw_get, true,
+          "Relay the workers' Get replies as received, without parsing them");
+ABSL_FLAG(bool, message_arenas, true,
+          "Build the messages of Get, Put and Del on reused protobuf arenas");
+ABSL_FLAG(int, warmup_timeout_ms, 1000,
+          "Deadline for connecting to a worker when it registers");
+ABSL_FLAG(int, vnodes, 128,
+          "Number of virtual nodes per worker on the consistent-hash ring");
+ABSL_FLAG(int, replicas, 1,
+          "Number of workers every key is copied to besides its owner, "
+          "must match the workers'");
+ABSL_FLAG(int, heartbeat_interval_ms, 500,
+          "Interval the workers send heartbeats at, must match the workers'");
+ABSL_FLAG(double, phi_threshold, 8,
+          "Suspicion level (phi) at which a worker is removed");
+ABSL_FLAG(int, phi_min_std_ms, 100,
+          "Lower bound of the heartbeat interval deviation, in ms");
+ABSL_FLAG(int, phi_window, 100,
+          "Number of heartbeat intervals the suspicion is estimated from");
+ABSL_FLAG(int, lock_timeout_ms, 1000,
+          "How long a write waits for a locked key before it is cancelled");
+ABSL_FLAG(int, lock_stats_interval_s, 0,
+          "Print key lock stats every N seconds, 0 disables");
+ABSL_FLAG(int, read_cache_mb, 0,
+          "Size of the master's cache of Get replies in MB, 0 disables. "
+          "The routing table is not handed out while it is on");
+ABSL_FLAG(int, read_cache_shards, 16,
+          "Number of independently locked shards of the read cache");
+ABSL_FLAG(int, read_cache_stats_interval_s, 0,
+          "Print read cache stats every N seconds, 0 disables");
+ABSL_FLAG(int, bulk_window, 4096,
+          "Entries a bulk load may buffer towards workers before it stops "
+          "reading from the client");
 
 // Logic and data behind the server's behavior.
 class GreeterServiceImpl final : public Greeter::Service {
@@ -72,233 +152,2465 @@ class GreeterServiceImpl final : public Greeter::Service {
 
 //!< The list recording that which worker is active.
 std::unordered_set<uint16_t> survival_list;
+//!< Guard of survival_list.
+std::mutex survival_mu;
+//!< Bumped on every change of survival_list.
+uint64_t survival_version = 0;
+
+
+//!< Key ---> owning worker.
+consistentHashRing hash_ring;
+
+//! @brief Register Client End ---> Worker Server
+//! 
+//! @details Broadcast latest survival list to all worker.
+class workerRegisterClient {
+ public:
+  workerRegisterClient(std::shared_ptr<Channel> channel)
+      : stub_(workerRegister::NewStub(channel)) {}
+
+  //! @brief Push the survival list to the worker, without waiting for it.
+  void Broadcast(const survivalList& list) {
+    struct broadcastCall {
+      ClientContext context;
+      survivalList request;
+      google::protobuf::Empty response;
+    };
+    auto call = new broadcastCall;
+    call->request = list;
+    call->context.set_deadline(std::chrono::system_clock::now() +
+                               std::chrono::seconds(1));
+    stub_->async()->Broadcast(&call->context, &call->request, &call->response,
+                              [call](Status status) {
+                                if (!status.ok()) {
+                                  KV_LOG(kLogWarn)
+                                      << "Code " << status.error_code()
+                                      << ": " << status.error_message();
+                                }
+                                delete call;
+                              });
+  }
+
+ private:
+  std::unique_ptr<workerRegister::Stub> stub_;
+};
+
+
+//! @brief KV Client End ---> Worker Server
+//! 
+//! @details Asynchronous version of the client's Client End : the caller owns
+//!          the context, request and response until `done` runs on a gRPC
+//!          callback thread.
+class kvMethodsClient {
+ public:
+  kvMethodsClient(std::shared_ptr<Channel> channel)
+      : stub_(kvMethods::NewStub(channel)), generic_(channel) {}
+
+  //! @brief Get the value from remoteDB with key.
+  void Get(ClientContext* context, const KVRequest* request,
+           KVResponse* response, std::function<void(Status)> done) {
+    stub_->async()->Get(context, request, response, std::move(done));
+  }
+
+  //! @brief Get, the request and the reply left serialized.
+  void RawGet(ClientContext* context, const grpc::ByteBuffer* request,
+              grpc::ByteBuffer* response, std::function<void(Status)> done) {
+    generic_.UnaryCall(context, "/distributedKV.kvMethods/Get",
+                       grpc::StubOptions(), request, response,
+                       std::move(done));
+  }
+
+  //! @brief Put the new value to the remoteDB with key,
+  //!        can be `update` or `insert`.
+  void Put(ClientContext* context, const KVRequest* request,
+           KVResponse* response, std::function<void(Status)> done) {
+    stub_->async()->Put(context, request, response, std::move(done));
+  }
+
+  //! @brief Delete the entry on the remoteDB with key.
+  void Del(ClientContext* context, const KVRequest* request,
+           KVResponse* response, std::function<void(Status)> done) {
+    stub_->async()->Del(context, request, response, std::move(done));
+  }
+
+  //! @brief Batched Get, Put and Del.
+  void MultiGet(ClientContext* context, const MultiKVRequest* request,
+                MultiKVResponse* response, std::function<void(Status)> done) {
+    stub_->async()->MultiGet(context, request, response, std::move(done));
+  }
+
+  void MultiPut(ClientContext* context, const MultiKVRequest* request,
+                MultiKVResponse* response, std::function<void(Status)> done) {
+    stub_->async()->MultiPut(context, request, response, std::move(done));
+  }
+
+  void MultiDel(ClientContext* context, const MultiKVRequest* request,
+                MultiKVResponse* response, std::function<void(Status)> done) {
+    stub_->async()->MultiDel(context, request, response, std::move(done));
+  }
+
+  //! @brief Open a bulk load stream driven by `reactor`.
+  void BulkLoad(ClientContext* context, BulkLoadResponse* response,
+                grpc::ClientWriteReactor<KVRequest>* reactor) {
+    stub_->async()->BulkLoad(context, response, reactor);
+  }
+
+  //! @brief Open a scan stream driven by `reactor`.
+  void Scan(ClientContext* context, const ScanRequest* request,
+            grpc::ClientReadReactor<KVEntry>* reactor) {
+    stub_->async()->Scan(context, request, reactor);
+  }
+
+  //! @brief Open a stream of value chunks driven by `reactor`.
+  void PutStream(ClientContext* context, KVResponse* response,
+                 grpc::ClientWriteReactor<ValueChunk>* reactor) {
+    stub_->async()->PutStream(context, response, reactor);
+  }
+
+  //! @brief Open a stream reading a value in chunks, driven by `reactor`.
+  void GetStream(ClientContext* context, const KVRequest* request,
+                 grpc::ClientReadReactor<ValueChunk>* reactor) {
+    stub_->async()->GetStream(context, request, reactor);
+  }
+
+ private:
+  std::unique_ptr<kvMethods::Stub> stub_;
+  grpc::GenericStub generic_;
+};
+
+
+//! @brief Parse a serialized message, the buffer is left as is.
+template <typename T>
+bool parseMessage(const grpc::ByteBuffer& bytes, T* message) {
+  grpc::ByteBuffer view(bytes);
+  grpc::ProtoBufferReader reader(&view);
+  return message->ParseFromZeroCopyStream(&reader);
+}
+
+//! @brief Serialize a message into `bytes`.
+template <typename T>
+void serializeMessage(const T& message, grpc::ByteBuffer* bytes) {
+  bool own_buffer;
+  grpc::GenericSerialize<grpc::ProtoBufferWriter, T>(message, bytes,
+                                                     &own_buffer);
+}
+
+//! @brief Fields of a serialized KVResponse, but its value.
+struct replyHeader {
+  std::string message;
+  bool error = false;
+  bool stale = false;
+};
+
+//! @brief Read a serialized KVResponse, skipping over its value : the slices
+//!        holding the value are stepped over, not copied.
+//!
+//! @return false if the reply is malformed.
+bool peekReply(const grpc::ByteBuffer& bytes, replyHeader* header) {
+  using google::protobuf::internal::WireFormatLite;
+  grpc::ByteBuffer view(bytes);
+  grpc::ProtoBufferReader reader(&view);
+  google::protobuf::io::CodedInputStream input(&reader);
+  while (uint32_t tag = input.ReadTag()) {
+    uint64_t flag;
+    switch (WireFormatLite::GetTagFieldNumber(tag)) {
+      case KVResponse::kMessageFieldNumber:
+        if (!WireFormatLite::ReadString(&input, &header->message)) {
+          return false;
+        }
+        break;
+      case KVResponse::kErrorFieldNumber:
+        if (!input.ReadVarint64(&flag)) {
+          return false;
+        }
+        header->error = flag != 0;
+        break;
+      case KVResponse::kStaleFieldNumber:
+        if (!input.ReadVarint64(&flag)) {
+          return false;
+        }
+        header->stale = flag != 0;
+        break;
+      default:
+        if (!WireFormatLite::SkipField(&input, tag)) {
+          return false;
+        }
+    }
+  }
+  return input.ConsumedEntireMessage();
+}
+
+
+//! @brief Get the socket of a worker from its port.
+std::string getWorkerSocket(uint16_t port) {
+  return absl::GetFlag(FLAGS_addr) + ":" + std::to_string(port);
+}
+
+
+//! @brief Long-lived channels ---> Worker Servers
+//! 
+//! @details Keyed by worker endpoint. Each worker owns `worker_channels`
+//!          channels with local subchannel pools, so every channel keeps its
+//!          own HTTP/2 connection and forwarded requests are spread over them
+//!          instead of paying a TCP + HTTP/2 handshake per request.
+class workerChannelPool {
+ public:
+  //! @brief Open and warm up the channels of a (re)registered worker.
+  //! 
+  //! @param port : worker's port.
+  //! @return true if every channel got connected before the deadline.
+  bool Add(uint16_t port) {
+    const std::string socket = getWorkerSocket(port);
+    int count = std::max(1, absl::GetFlag(FLAGS_worker_channels));
+    auto deadline = std::chrono::system_clock::now() +
+        std::chrono::milliseconds(absl::GetFlag(FLAGS_warmup_timeout_ms));
+
+    auto entry = std::make_shared<workerChannels>();
+    entry->forward_latency = globalMetrics().Histogram(
+        "kv_master_forward_seconds",
+        "Latency of requests forwarded to a worker, as seen by the master",
+        metricsLabel("worker", std::to_string(port)));
+    bool connected = true;
+    for (int i = 0; i < count; ++i) {
+      grpc::ChannelArguments args;
+      args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+      std::shared_ptr<Channel> channel = grpc::CreateCustomChannel(
+          socket, grpc::InsecureChannelCredentials(), args);
+      // Warm up : finish the handshake now rather than on the first request.
+      connected = channel->WaitForConnected(deadline) && connected;
+      entry->clients.push_back(std::make_shared<kvMethodsClient>(channel));
+      if (entry->registry == nullptr) {
+        entry->registry = std::make_shared<workerRegisterClient>(channel);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mu_);
+    workers_[socket] = entry;
+    return connected;
+  }
+
+  //! @brief Drop the channels of a worker that left the cluster.
+  //! 
+  //! @details In-flight requests keep their client alive until they finish.
+  void Evict(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mu_);
+    workers_.erase(getWorkerSocket(port));
+  }
+
+  //! @brief Push the survival list to every worker but `except`.
+  void Broadcast(const survivalList& list, uint16_t except) {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& worker : workers_) {
+      if (worker.first != getWorkerSocket(except)) {
+        worker.second->registry->Broadcast(list);
+      }
+    }
+  }
+
+  //! @brief Reads in flight on the worker, -1 if it is not registered.
+  int Load(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = workers_.find(getWorkerSocket(port));
+    return it == workers_.end() ? -1 : it->second->inflight.load();
+  }
+
+  //! @brief Count reads going to, or coming back from, the worker.
+  void AddLoad(uint16_t port, int delta) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = workers_.find(getWorkerSocket(port));
+    if (it != workers_.end()) {
+      it->second->inflight += delta;
+    }
+  }
+
+  //! @brief Record the latency of a request forwarded to the worker.
+  void Forwarded(uint16_t port, std::chrono::steady_clock::time_point start) {
+    metricsHistogram* latency = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto it = workers_.find(getWorkerSocket(port));
+      if (it != workers_.end()) {
+        latency = it->second->forward_latency;
+      }
+    }
+    if (latency != nullptr) {
+      latency->ObserveSince(start);
+    }
+  }
+
+  //! @brief Pick one of the worker's channels : roll pooling.
+  //! 
+  //! @return nullptr if the worker is not registered.
+  std::shared_ptr<kvMethodsClient> Pick(uint16_t port) {
+    std::shared_ptr<workerChannels> entry;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto it = workers_.find(getWorkerSocket(port));
+      if (it == workers_.end()) {
+        return nullptr;
+      }
+      entry = it->second;
+    }
+    uint32_t n = entry->next.fetch_add(1, std::memory_order_relaxed);
+    return entry->clients[n % entry->clients.size()];
+  }
+
+ private:
+  struct workerChannels {
+    std::vector<std::shared_ptr<kvMethodsClient>> clients;
+    std::shared_ptr<workerRegisterClient> registry;
+    metricsHistogram* forward_latency = nullptr;
+    std::atomic<uint32_t> next{0};
+    std::atomic<int> inflight{0};
+  };
+
+  std::mutex mu_;
+  std::unordered_map<std::string, std::shared_ptr<workerChannels>> workers_;
+};
+
+//!< Channels to every registered worker.
+workerChannelPool worker_channels;
+
+
+//! @brief Phi-accrual failure detector over the worker heartbeats.
+//! 
+//! @details Keeps the last `phi_window` intervals between the heartbeats of
+//!          every worker. The suspicion of a silent worker is
+//!          phi = -log10(P(its next heartbeat comes even later)) under a
+//!          normal distribution fitted to them, so a worker with a jittery
+//!          link gets more slack than one with a steady beat. A detector
+//!          thread reports the workers whose phi crosses the threshold.
+class failureDetector {
+ public:
+  using Clock = std::chrono::steady_clock;
+  //! @brief Runs on the detector thread for a failed worker.
+  using Callback = std::function<void(uint16_t port)>;
+
+  ~failureDetector() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  //! @brief Start checking the workers.
+  void Start(Callback failed) {
+    failed_ = std::move(failed);
+    thread_ = std::thread(&failureDetector::Run, this);
+  }
+
+  //! @brief Watch a worker as if it just sent a heartbeat.
+  void Add(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mu_);
+    history& worker = workers_[port];
+    worker = history();
+    worker.last = Clock::now();
+    record(worker,
+           static_cast<double>(absl::GetFlag(FLAGS_heartbeat_interval_ms)));
+  }
+
+  void Remove(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mu_);
+    workers_.erase(port);
+  }
+
+  //! @brief A heartbeat came in from the worker.
+  void Heartbeat(uint16_t port) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = workers_.find(port);
+    if (it == workers_.end()) {
+      return;
+    }
+    Clock::time_point now = Clock::now();
+    record(it->second, std::chrono::duration<double, std::milli>(
+                           now - it->second.last).count());
+    it->second.last = now;
+  }
+
+ private:
+  struct history {
+    Clock::time_point last;
+    //!< Intervals between heartbeats, in ms.
+    std::deque<double> intervals;
+    double sum = 0;
+    double sum_sq = 0;
+  };
+
+  void record(history& worker, double interval) {
+    worker.intervals.push_back(interval);
+    worker.sum += interval;
+    worker.sum_sq += interval * interval;
+    if (worker.intervals.size() >
+        static_cast<size_t>(std::max(1, absl::GetFlag(FLAGS_phi_window)))) {
+      double oldest = worker.intervals.front();
+      worker.intervals.pop_front();
+      worker.sum -= oldest;
+      worker.sum_sq -= oldest * oldest;
+    }
+  }
+
+  //! @brief Suspicion of the worker, with the logistic approximation of
+  //!        the normal distribution.
+  static double phi(const history& worker, Clock::time_point now) {
+    double n = worker.intervals.size();
+    double mean = worker.sum / n;
+    double std_dev = std::max(
+        std::sqrt(std::max(0.0, worker.sum_sq / n - mean * mean)),
+        static_cast<double>(absl::GetFlag(FLAGS_phi_min_std_ms)));
+    double t = std::chrono::duration<double, std::milli>(
+        now - worker.last).count();
+    double y = (t - mean) / std_dev;
+    double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+    return t > mean ? -std::log10(e / (1 + e))
+                    : -std::log10(1 - 1 / (1 + e));
+  }
+
+  void Run() {
+    const auto period = std::chrono::milliseconds(
+        std::max(1, absl::GetFlag(FLAGS_heartbeat_interval_ms) / 2));
+    const double threshold = absl::GetFlag(FLAGS_phi_threshold);
+    std::unique_lock<std::mutex> lock(mu_);
+    while (!cv_.wait_for(lock, period, [this] { return stop_; })) {
+      std::vector<uint16_t> failed;
+      Clock::time_point now = Clock::now();
+      for (const auto& worker : workers_) {
+        if (phi(worker.second, now) > threshold) {
+          failed.push_back(worker.first);
+        }
+      }
+      lock.unlock();
+      for (uint16_t port : failed) {
+        failed_(port);
+      }
+      lock.lock();
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::unordered_map<uint16_t, history> workers_;
+  bool stop_ = false;
+  Callback failed_;
+  std::thread thread_;
+};
+
+//!< Heartbeats of every registered worker.
+failureDetector failure_detector;
+
+//! @brief Take a failed worker out of the cluster and tell the others.
+void removeWorker(uint16_t port) {
+  std::lock_guard<std::mutex> lock(survival_mu);
+  failure_detector.Remove(port);
+  if (survival_list.erase(port) == 0) {
+    return;
+  }
+  hash_ring.Remove(port);
+  worker_channels.Evict(port);
+  survival_version += 1;
+  KV_LOG(kLogWarn) << "Worker " << port << " failed, removed.";
+
+  survivalList update;
+  update.set_message("Worker left.");
+  update.set_version(survival_version);
+  update.add_left(port);
+  worker_channels.Broadcast(update, port);
+}
+
 
 //! @brief Register Server End <--- Worker Server
 //! 
 //! @details Get register request from a new setup worker.
 class workerRegisterServiceImpl final : public workerRegister::Service {
   Status Register(ServerContext* context, const workerSetup* request,
-                  survivalList* response) {
+                  survivalList* response) override {
     // Parse segment from request.
     const std::string& message = request->message();
     uint16_t port = request->port();
 
-    // Record this worker.
+    // Connect to this worker first, a restarted worker on the same port gets
+    // fresh channels. An unreachable worker is not recorded.
+    if (!worker_channels.Add(port)) {
+      worker_channels.Evict(port);
+      return Status(grpc::StatusCode::UNAVAILABLE, "Worker is not reachable");
+    }
+
+    // Record this worker and let it own its share of the keys.
+    std::lock_guard<std::mutex> lock(survival_mu);
     survival_list.insert(port); 
+    hash_ring.Add(port);
+    failure_detector.Add(port);
+    survival_version += 1;
 
     // Set the response.
     response->set_message("Register Successfully!");
+    response->set_version(survival_version);
     for (const auto& port : survival_list) {
       response->add_ports(port);
     }
 
+    // The other workers place their replicas on the ring too.
+    survivalList update;
+    update.set_message("Worker joined.");
+    update.set_version(survival_version);
+    update.add_joined(port);
+    worker_channels.Broadcast(update, port);
+
     return Status::OK;
   }
-};
 
+  //! @brief Feed the failure detector, and resync a worker that missed
+  //!        a change of the survival list.
+  Status Heartbeat(ServerContext* context, const workerSetup* request,
+                   survivalList* response) override {
+    uint16_t port = request->port();
+    std::lock_guard<std::mutex> lock(survival_mu);
+    if (survival_list.count(port) == 0) {
+      // Removed, or the master restarted.
+      return Status(grpc::StatusCode::NOT_FOUND, "Unknown worker");
+    }
+    failure_detector.Heartbeat(port);
 
-//! @brief Register Client End ---> Worker Server
-//! 
-//! @details Broadcast latest survival list to all worker.
-class workerRegisterClient {
-  // bool  
+    response->set_version(survival_version);
+    if (request->version() != survival_version) {
+      response->set_message("Survival list resync.");
+      for (const auto& port : survival_list) {
+        response->add_ports(port);
+      }
+    }
+    return Status::OK;
+  }
 };
 
 
-//! @brief KV Client End ---> Worker Server
+//! @brief Striped per-key write locks.
 //! 
-//! @details It's actually the same as client's Client End.
-class kvMethodsClient {
+//! @details Keys are spread over `kShards` independently locked shards. A
+//!          write on a locked key queues behind the holder instead of being
+//!          rejected, and is handed the lock when the holder releases it. A
+//!          waiter still queued at its deadline is failed by the reaper.
+class keyLockTable {
  public:
-  kvMethodsClient(std::shared_ptr<Channel> channel)
-      : stub_(kvMethods::NewStub(channel)) {}
+  //! @brief Runs once the lock is handed over (true) or timed out (false).
+  using Callback = std::function<void(bool acquired)>;
+  using Clock = std::chrono::steady_clock;
 
-  //! @brief Get the value from remoteDB with key.
-  //! 
-  //! @param key : to query.
-  //! @return KVResponse : the response
-  KVResponse Get(const std::string& key) {
-    KVRequest request;
-    request.set_key(key);
+  keyLockTable() : reaper_(&keyLockTable::Reap, this) {}
 
-    KVResponse response;
-    
-    ClientContext context;
-    
-    // actual rpc
-    Status status = stub_->Get(&context, request, &response);
+  ~keyLockTable() {
+    {
+      std::lock_guard<std::mutex> lock(reaper_mu_);
+      stop_ = true;
+    }
+    reaper_cv_.notify_one();
+    reaper_.join();
+  }
 
-    if (status.ok()) {
-      std:: cout << "Message: " << response.message() << std::endl;
-      return response;
-    } else {
-      std::cout << "Code "<< status.error_code() << ": " 
-                << status.error_message() << std::endl;
-      response.set_error(true);
-      return response;
+  //! @brief Lock the key.
+  //! 
+  //! @return true if the lock was free and is now held, `granted` is not
+  //!         called. false if the call was queued, `granted` runs later.
+  bool Lock(const std::string& key, Clock::time_point deadline,
+            Callback granted) {
+    shard& s = shardOf(key);
+    std::lock_guard<std::mutex> lock(s.mu);
+    auto inserted = s.keys.emplace(key, std::deque<waiter>());
+    if (inserted.second) {
+      acquired_->Add();
+      return true;
     }
+    contended_->Add();
+    inserted.first->second.push_back({deadline, std::move(granted)});
+    return false;
   }
 
-  //! @brief Put the new value to the remoteDB with key,
-  //!        can be `update` or `insert`.
+  //! @brief Lock every key in order, all or nothing.
   //! 
-  //! @param key : to update.
-  //! @param value : new value
-  //! @return KVResponse : The reponse loaded with new value.
-  KVResponse Put(const std::string& key, const std::string& value) {
-    KVRequest request;
-    request.set_key(key);
-    request.set_value(value);
+  //! @param keys : sorted and without duplicates, a fixed order keeps
+  //!               batches from deadlocking each other.
+  //! @param granted : always called, inline if nothing was contended.
+  void LockAll(std::vector<std::string> keys, Clock::time_point deadline,
+               Callback granted) {
+    auto batch = std::make_shared<batchLock>();
+    batch->keys = std::move(keys);
+    batch->deadline = deadline;
+    batch->granted = std::move(granted);
+    lockFrom(batch);
+  }
 
-    KVResponse response;
-    
-    ClientContext context;
-    
-    // actual rpc
-    Status status = stub_->Put(&context, request, &response);
+  //! @brief Release the key, the next live waiter inherits the lock.
+  void Unlock(const std::string& key) {
+    std::vector<Callback> expired;
+    Callback next;
+    {
+      shard& s = shardOf(key);
+      std::lock_guard<std::mutex> lock(s.mu);
+      auto it = s.keys.find(key);
+      if (it == s.keys.end()) {
+        return;
+      }
+      std::deque<waiter>& waiters = it->second;
+      Clock::time_point now = Clock::now();
+      while (!waiters.empty()) {
+        waiter w = std::move(waiters.front());
+        waiters.pop_front();
+        if (w.deadline < now) {
+          expired.push_back(std::move(w.granted));
+        } else {
+          next = std::move(w.granted);
+          break;
+        }
+      }
+      if (next) {
+        acquired_->Add();
+      } else {
+        s.keys.erase(it);
+      }
+    }
+    timeouts_->Add(expired.size());
+    for (Callback& callback : expired) {
+      callback(false);
+    }
+    if (next) {
+      next(true);
+    }
+  }
 
-    if (status.ok()) {
-      std:: cout << "Message: " << response.message() << std::endl;
-      return response;
-    } else {
-      std::cout << "Code "<< status.error_code() << ": " 
-                << status.error_message() << std::endl;
-      response.set_error(true);
-      return response;
+  //! @brief Release every key.
+  void UnlockAll(const std::vector<std::string>& keys) {
+    for (const std::string& key : keys) {
+      Unlock(key);
     }
   }
 
-  //! @brief Delete the entry on the remoteDB with key.
-  //! 
-  //! @param key : to delete.
-  //! @return KVResponse : the response
-  KVResponse Del(const std::string& key) {
-    KVRequest request;
-    request.set_key(key);
+  //! @brief Contention counters.
+  std::string Stats() const {
+    std::ostringstream out;
+    out << "acquired=" << acquired_->Value()
+        << " contended=" << contended_->Value()
+        << " timeouts=" << timeouts_->Value();
+    return out.str();
+  }
 
-    KVResponse response;
-    
-    ClientContext context;
-    
-    // actual rpc
-    Status status = stub_->Del(&context, request, &response);
+ private:
+  static constexpr int kShards = 64;
 
-    if (status.ok()) {
-      std:: cout << "Message: " << response.message() << std::endl;
-      return response;
-    } else {
-      std::cout << "Code "<< status.error_code() << ": " 
-                << status.error_message() << std::endl;
-      response.set_error(true);
-      return response;
+  struct waiter {
+    Clock::time_point deadline;
+    Callback granted;
+  };
+
+  //!< Locked keys and their queued waiters.
+  struct shard {
+    std::mutex mu;
+    std::unordered_map<std::string, std::deque<waiter>> keys;
+  };
+
+  struct batchLock {
+    std::vector<std::string> keys;
+    size_t next = 0;
+    Clock::time_point deadline;
+    Callback granted;
+  };
+
+  shard& shardOf(const std::string& key) {
+    return shards_[std::hash<std::string>()(key) % kShards];
+  }
+
+  //! @brief Lock the batch's keys from `next` on, resumed by the callback
+  //!        of the first contended key.
+  void lockFrom(std::shared_ptr<batchLock> batch) {
+    while (batch->next < batch->keys.size()) {
+      bool now = Lock(batch->keys[batch->next], batch->deadline,
+                      [this, batch](bool acquired) {
+                        if (!acquired) {
+                          std::vector<std::string> held(
+                              batch->keys.begin(),
+                              batch->keys.begin() + batch->next);
+                          UnlockAll(held);
+                          batch->granted(false);
+                          return;
+                        }
+                        batch->next += 1;
+                        lockFrom(batch);
+                      });
+      if (!now) {
+        return;
+      }
+      batch->next += 1;
     }
+    batch->granted(true);
   }
 
- private:
-  std::unique_ptr<kvMethods::Stub> stub_;
+  //! @brief Fail the waiters that passed their deadline.
+  void Reap() {
+    auto interval = std::chrono::seconds(
+        absl::GetFlag(FLAGS_lock_stats_interval_s));
+    Clock::time_point next_report = Clock::now() + interval;
+
+    std::unique_lock<std::mutex> lock(reaper_mu_);
+    while (!reaper_cv_.wait_for(lock, std::chrono::milliseconds(10),
+                                [this] { return stop_; })) {
+      Clock::time_point now = Clock::now();
+      std::vector<Callback> expired;
+      for (shard& s : shards_) {
+        std::lock_guard<std::mutex> shard_lock(s.mu);
+        for (auto& entry : s.keys) {
+          std::deque<waiter>& waiters = entry.second;
+          for (auto it = waiters.begin(); it != waiters.end();) {
+            if (it->deadline < now) {
+              expired.push_back(std::move(it->granted));
+              it = waiters.erase(it);
+            } else {
+              ++it;
+            }
+          }
+        }
+      }
+      timeouts_->Add(expired.size());
+      for (Callback& callback : expired) {
+        callback(false);
+      }
+
+      if (interval.count() > 0 && now >= next_report) {
+        KV_LOG(kLogInfo) << "Key locks: " << Stats();
+        next_report = now + interval;
+      }
+    }
+  }
+
+  shard shards_[kShards];
+
+  metricsCounter* acquired_ = globalMetrics().Counter(
+      "kv_master_key_locks_acquired_total", "Key locks granted");
+  metricsCounter* contended_ = globalMetrics().Counter(
+      "kv_master_key_locks_contended_total",
+      "Writes that queued for a held key lock");
+  metricsCounter* timeouts_ = globalMetrics().Counter(
+      "kv_master_key_locks_timeouts_total",
+      "Writes cancelled waiting for a key lock");
+
+  std::mutex reaper_mu_;
+  std::condition_variable reaper_cv_;
+  bool stop_ = false;
+  std::thread reaper_;
 };
 
 
-//! @brief KV Server End <--- Client
+//! @brief Sharded cache of Get replies, CLOCK eviction.
 //! 
-//! @details Will forward the request ---> Worker
-class kvMethodsMasterServiceImpl final : public kvMethods::Service {
-  //!< The pointer point to the next worker : impl for load balancing
-  int next_worker = 0;
-  //!< Key Lock
-  std::unordered_set<std::string> locks;
+//! @details Holds the owners' replies to Gets, found or not, up to
+//!          `capacity` bytes split evenly over the shards. A hit sets the
+//!          entry's reference bit, the clock hand clears it on its way and
+//!          evicts the entries it finds unreferenced : fresh entries get no
+//!          reference bit, so one-off keys leave before hot ones.
+//! 
+//!          Writes passing through the master invalidate their keys and
+//!          bump their shard's epoch. A reply only enters the cache if its
+//!          shard's epoch did not move since the Get was sent, so a reply
+//!          racing a write never brings the old value back. Writes that skip
+//!          the master (direct clients) would not be seen : the master does
+//!          not hand out the routing table while the cache is enabled.
+class readCache {
+ public:
+  using Clock = std::chrono::steady_clock;
 
-  //! @brief Get the Worker Port object : roll pooling
-  uint16_t getWorkerPort() {
-    int cnt = (next_worker++) % survival_list.size();
-    for (const auto& port: survival_list) {
-      if (cnt == 0) {
-        return port;
-      }
-      cnt -= 1;
+  readCache(size_t capacity, int shards) {
+    if (capacity == 0) {
+      return;
+    }
+    shards = std::max(1, shards);
+    for (int i = 0; i < shards; ++i) {
+      shards_.emplace_back(new shard);
+      shards_.back()->capacity = capacity / shards;
+    }
+    if (absl::GetFlag(FLAGS_read_cache_stats_interval_s) > 0) {
+      reporter_ = std::thread(&readCache::Report, this);
     }
-    return 0;
   }
 
-  //! @brief Get the Worker Socket object
-  std::string getWorkerSocket() {
-    uint16_t port = getWorkerPort();
-    std::string socket = absl::GetFlag(FLAGS_addr) + ":" + std::to_string(port);
-    return socket;
+  ~readCache() {
+    {
+      std::lock_guard<std::mutex> lock(reporter_mu_);
+      stop_ = true;
+    }
+    reporter_cv_.notify_one();
+    if (reporter_.joinable()) {
+      reporter_.join();
+    }
   }
 
-  Status Get(ServerContext* context, const KVRequest* reqeust,
-            KVResponse* response) {
-    // Parse segment from request.
-    const std::string& key = reqeust->key();
-    const std::string& value = reqeust->value();
+  bool Enabled() const { return !shards_.empty(); }
 
-    // Forward the request to worker server
-    kvMethodsClient methods = kvMethodsClient(
-      grpc::CreateChannel(getWorkerSocket(), grpc::InsecureChannelCredentials()));
-    *response = methods.Get(key);
+  //! @brief Look the key up.
+  //! 
+  //! @return true on a hit, the cached reply is copied to `response`.
+  bool Lookup(const std::string& key, KVResponse* response) {
+    if (!Enabled()) {
+      return false;
+    }
+    shard& s = shardOf(key);
+    {
+      std::lock_guard<std::mutex> lock(s.mu);
+      auto it = s.index.find(key);
+      if (it != s.index.end()) {
+        entry& e = s.slots[it->second];
+        e.referenced = true;
+        response->set_value(e.value);
+        response->set_message(e.message);
+        hits_->Add();
+        return true;
+      }
+    }
+    misses_->Add();
+    return false;
+  }
 
-    return Status::OK;
+  //! @brief Epoch of the key's shard, to take before sending a Get.
+  uint64_t Epoch(const std::string& key) {
+    if (!Enabled()) {
+      return 0;
+    }
+    shard& s = shardOf(key);
+    std::lock_guard<std::mutex> lock(s.mu);
+    return s.epoch;
   }
 
-  Status Put(ServerContext* context, const KVRequest* reqeust,
-            KVResponse* response) {
-    // Parse segment from request.
-    const std::string& key = reqeust->key();
-    const std::string& value = reqeust->value();
+  //! @brief Cache the owner's reply to a Get, unless a write invalidated
+  //!        the shard since `epoch` was taken.
+  void Insert(const std::string& key, const KVResponse& response,
+              uint64_t epoch) {
+    if (!Enabled()) {
+      return;
+    }
+    shard& s = shardOf(key);
+    size_t bytes = kOverhead + key.size() + response.value().size() +
+        response.message().size();
+    std::lock_guard<std::mutex> lock(s.mu);
+    if (s.epoch != epoch || bytes > s.capacity) {
+      return;
+    }
+    auto it = s.index.find(key);
+    if (it != s.index.end()) {
+      remove(s, it->second);
+    }
+    evict(s, bytes);
+    s.index.emplace(key, s.slots.size());
+    s.slots.push_back({key, response.value(), response.message(), bytes,
+                       false});
+    s.bytes += bytes;
+    bytes_->Add(bytes);
+    inserts_->Add();
+  }
 
-    // Check if the key is locked.
-    if (locks.count(key) != 0) {
-      return Status::CANCELLED;
-    } 
-    // Get the lock.
-    locks.insert(key);
+  //! @brief Drop the key, the write of it is done or failed.
+  void Invalidate(const std::string& key) {
+    if (!Enabled()) {
+      return;
+    }
+    shard& s = shardOf(key);
+    std::lock_guard<std::mutex> lock(s.mu);
+    s.epoch += 1;
+    auto it = s.index.find(key);
+    if (it != s.index.end()) {
+      remove(s, it->second);
+    }
+  }
 
-    // Forward the request to worker server
-    kvMethodsClient methods = kvMethodsClient(
-      grpc::CreateChannel(getWorkerSocket(), grpc::InsecureChannelCredentials()));
-    *response = methods.Put(key, value);
+  void InvalidateAll(const std::vector<std::string>& keys) {
+    for (const std::string& key : keys) {
+      Invalidate(key);
+    }
+  }
 
-    // Release the lock.
-    locks.erase(key);
+  //! @brief Drop everything.
+  void Clear() {
+    for (auto& s : shards_) {
+      std::lock_guard<std::mutex> lock(s->mu);
+      s->epoch += 1;
+      s->index.clear();
+      s->slots.clear();
+      bytes_->Add(-static_cast<int64_t>(s->bytes));
+      s->bytes = 0;
+      s->hand = 0;
+    }
+  }
 
-    return Status::OK;
+  //! @brief Hit rate and occupancy.
+  std::string Stats() const {
+    uint64_t hits = hits_->Value();
+    uint64_t misses = misses_->Value();
+    size_t bytes = 0;
+    size_t entries = 0;
+    for (const auto& s : shards_) {
+      std::lock_guard<std::mutex> lock(s->mu);
+      bytes += s->bytes;
+      entries += s->slots.size();
+    }
+    std::ostringstream out;
+    out << "hits=" << hits << " misses=" << misses << " hit_rate="
+        << (hits + misses == 0 ? 0.0 : 100.0 * hits / (hits + misses))
+        << "% inserts=" << inserts_->Value()
+        << " evictions=" << evictions_->Value()
+        << " entries=" << entries << " bytes=" << bytes;
+    return out.str();
   }
 
-  Status Del(ServerContext* context, const KVRequest* reqeust,
-            KVResponse* response) {
-    // Parse segment from request.
-    const std::string& key = reqeust->key();
-    const std::string& value = reqeust->value();
+ private:
+  //!< Bookkeeping bytes charged per entry besides its strings.
+  static constexpr size_t kOverhead = 64;
 
-    // Check if the key is locked.
-    if (locks.count(key) != 0) {
-      return Status::CANCELLED;
-    } 
-    // Get the lock.
-    locks.insert(key);
+  struct entry {
+    std::string key;
+    std::string value;
+    std::string message;
+    size_t bytes;
+    bool referenced;
+  };
 
-    // Forward the request to worker server
-    kvMethodsClient methods = kvMethodsClient(
-      grpc::CreateChannel(getWorkerSocket(), grpc::InsecureChannelCredentials()));
-    *response = methods.Del(key);
+  struct shard {
+    mutable std::mutex mu;
+    //!< Key ---> its slot.
+    std::unordered_map<std::string, size_t> index;
+    std::vector<entry> slots;
+    size_t hand = 0;
+    size_t bytes = 0;
+    size_t capacity = 0;
+    uint64_t epoch = 0;
+  };
 
-    // Release the lock.
-    locks.erase(key);
+  shard& shardOf(const std::string& key) {
+    return *shards_[std::hash<std::string>()(key) % shards_.size()];
+  }
 
-    return Status::OK;
+  //! @brief Free the slot, the last slot moves into it. Called with the
+  //!        shard's lock held.
+  void remove(shard& s, size_t i) {
+    s.bytes -= s.slots[i].bytes;
+    bytes_->Add(-static_cast<int64_t>(s.slots[i].bytes));
+    s.index.erase(s.slots[i].key);
+    if (i + 1 != s.slots.size()) {
+      s.slots[i] = std::move(s.slots.back());
+      s.index[s.slots[i].key] = i;
+    }
+    s.slots.pop_back();
+  }
+
+  //! @brief Run the clock hand until `bytes` more fit. Called with the
+  //!        shard's lock held.
+  void evict(shard& s, size_t bytes) {
+    while (s.bytes + bytes > s.capacity && !s.slots.empty()) {
+      if (s.hand >= s.slots.size()) {
+        s.hand = 0;
+      }
+      entry& e = s.slots[s.hand];
+      if (e.referenced) {
+        e.referenced = false;
+        s.hand += 1;
+        continue;
+      }
+      remove(s, s.hand);
+      evictions_->Add();
+    }
+  }
+
+  void Report() {
+    auto interval = std::chrono::seconds(
+        absl::GetFlag(FLAGS_read_cache_stats_interval_s));
+    std::unique_lock<std::mutex> lock(reporter_mu_);
+    while (!reporter_cv_.wait_for(lock, interval, [this] { return stop_; })) {
+      KV_LOG(kLogInfo) << "Read cache: " << Stats();
+    }
   }
+
+  std::vector<std::unique_ptr<shard>> shards_;
+
+  metricsCounter* hits_ = globalMetrics().Counter(
+      "kv_master_cache_hits_total", "Gets answered by the read cache");
+  metricsCounter* misses_ = globalMetrics().Counter(
+      "kv_master_cache_misses_total", "Gets the read cache could not answer");
+  metricsCounter* inserts_ = globalMetrics().Counter(
+      "kv_master_cache_inserts_total", "Replies put in the read cache");
+  metricsCounter* evictions_ = globalMetrics().Counter(
+      "kv_master_cache_evictions_total", "Entries evicted by the clock hand");
+  metricsGauge* bytes_ = globalMetrics().Gauge(
+      "kv_master_cache_bytes", "Bytes held by the read cache");
+
+  std::mutex reporter_mu_;
+  std::condition_variable reporter_cv_;
+  bool stop_ = false;
+  std::thread reporter_;
 };
 
 
-//! @brief Server Runtime.
+class bulkLoadReactor;
+
+//! @brief Bulk Load Client End ---> Worker Server
 //! 
-//! @param port : working port
-void RunServer(uint16_t port) {
+//! @details The partition of a bulk load owned by one worker, written to it
+//!          as one client stream. Deletes itself when the stream is done.
+class bulkLoadPartition : public grpc::ClientWriteReactor<KVRequest> {
+ public:
+  bulkLoadPartition(bulkLoadReactor* parent, uint16_t port,
+                    kvMethodsClient& methods, CallbackServerContext* context)
+      : parent_(parent), port_(port),
+        context_(ClientContext::FromCallbackServerContext(*context)) {
+    methods.BulkLoad(context_.get(), &response_, this);
+    StartCall();
+  }
+
+  //! @brief Queue an entry towards the worker.
+  void Write(KVRequest&& entry);
+
+  //! @brief No more entries : half-close once the queue is drained.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mu_);
+    closing_ = true;
+    if (!writing_ && !failed_) {
+      StartWritesDone();
+    }
+  }
+
+  void OnWriteDone(bool ok) override;
+  void OnDone(const Status& status) override;
+
+ private:
+  bulkLoadReactor* parent_;
+  uint16_t port_;
+  std::unique_ptr<ClientContext> context_;
+  BulkLoadResponse response_;
+
+  std::mutex mu_;
+  std::deque<KVRequest> queue_;
+  //!< The entry being written.
+  KVRequest current_;
+  bool writing_ = false;
+  bool closing_ = false;
+  bool failed_ = false;
+  //!< Entries dropped after the stream failed.
+  int dropped_ = 0;
+};
+
+
+//! @brief Bulk Load Server End <--- Client
+//! 
+//! @details Partitions the client stream by owning worker. Reading from the
+//!          client stops while `bulk_window` entries are still queued
+//!          towards the workers and resumes as they drain.
+class bulkLoadReactor : public ServerReadReactor<KVRequest> {
+ public:
+  bulkLoadReactor(CallbackServerContext* context, BulkLoadResponse* response,
+                  readCache* cache)
+      : context_(context), response_(response), cache_(cache),
+        window_(std::max(1, absl::GetFlag(FLAGS_bulk_window))) {
+    StartRead(&entry_);
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok) {
+      // The client is done : close every partition.
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        reading_ = false;
+        for (const auto& partition : partitions_) {
+          if (partition.second != nullptr) {
+            partition.second->Close();
+          }
+        }
+      }
+      maybeFinish();
+      return;
+    }
+
+    bool read_next = true;
+    {
+      // Partitions are written under the lock : a partition is only
+      // deleted after PartitionDone took it out of the map.
+      std::lock_guard<std::mutex> lock(mu_);
+      bulkLoadPartition* partition = partitionOf(entry_.key());
+      cache_->Invalidate(entry_.key());
+      if (partition != nullptr) {
+        queued_ += 1;
+        partition->Write(std::move(entry_));
+      }
+      if (queued_ >= window_) {
+        paused_ = true;
+        read_next = false;
+      }
+    }
+    if (read_next) {
+      StartRead(&entry_);
+    }
+  }
+
+  void OnDone() override { delete this; }
+
+  //! @brief Entries left the window, resume reading when half drained.
+  void Drained(int entries) {
+    bool resume = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      queued_ -= entries;
+      if (paused_ && queued_ <= window_ / 2) {
+        paused_ = false;
+        resume = true;
+      }
+    }
+    if (resume) {
+      StartRead(&entry_);
+    }
+  }
+
+  //! @brief A partition's stream finished, it is deleted right after.
+  void PartitionDone(uint16_t port, const Status& status,
+                     const BulkLoadResponse& reply) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      partitions_[port] = nullptr;
+      count_ += reply.count();
+      if (!status.ok() || reply.error()) {
+        error_ = status.ok() ? reply.message() : status.error_message();
+      }
+      open_ -= 1;
+    }
+    maybeFinish();
+  }
+
+ private:
+  //! @brief Get the partition of the key's owner, opening it on first use.
+  //!        Called with the lock held.
+  //! 
+  //! @return nullptr if no worker owns the key or its stream failed.
+  bulkLoadPartition* partitionOf(const std::string& key) {
+    uint16_t port = hash_ring.Owner(key);
+    auto it = partitions_.find(port);
+    if (it != partitions_.end()) {
+      return it->second;
+    }
+    std::shared_ptr<kvMethodsClient> methods =
+        port == 0 ? nullptr : worker_channels.Pick(port);
+    if (methods == nullptr) {
+      error_ = "No worker available";
+      return nullptr;
+    }
+    open_ += 1;
+    bulkLoadPartition* partition =
+        new bulkLoadPartition(this, port, *methods, context_);
+    partitions_.emplace(port, partition);
+    return partition;
+  }
+
+  //! @brief Reply once the client is done and every partition finished.
+  void maybeFinish() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (reading_ || open_ > 0 || finished_) {
+        return;
+      }
+      finished_ = true;
+      // Gets racing the stream may have cached values it overwrote.
+      cache_->Clear();
+      response_->set_count(count_);
+      response_->set_error(!error_.empty());
+      response_->set_message(error_.empty() ? "Bulk load done!" : error_);
+    }
+    Finish(Status::OK);
+  }
+
+  CallbackServerContext* context_;
+  BulkLoadResponse* response_;
+  readCache* cache_;
+  const int window_;
+  KVRequest entry_;
+
+  std::mutex mu_;
+  std::unordered_map<uint16_t, bulkLoadPartition*> partitions_;
+  bool reading_ = true;
+  bool paused_ = false;
+  bool finished_ = false;
+  int queued_ = 0;
+  int open_ = 0;
+  int64_t count_ = 0;
+  std::string error_;
+};
+
+void bulkLoadPartition::Write(KVRequest&& entry) {
+  // Called with the parent's lock held : a failed stream only counts the
+  // entry out, the parent is told when it leaves OnReadDone.
+  std::lock_guard<std::mutex> lock(mu_);
+  if (failed_) {
+    dropped_ += 1;
+    return;
+  }
+  if (writing_) {
+    queue_.push_back(std::move(entry));
+    return;
+  }
+  writing_ = true;
+  current_ = std::move(entry);
+  StartWrite(&current_);
+}
+
+void bulkLoadPartition::OnWriteDone(bool ok) {
+  int drained = 1;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!ok) {
+      // The stream broke, OnDone brings the status : drop the backlog.
+      failed_ = true;
+      writing_ = false;
+      drained += queue_.size();
+      queue_.clear();
+    } else if (!queue_.empty()) {
+      current_ = std::move(queue_.front());
+      queue_.pop_front();
+      StartWrite(&current_);
+    } else {
+      writing_ = false;
+      if (closing_) {
+        StartWritesDone();
+      }
+    }
+  }
+  parent_->Drained(drained);
+}
+
+void bulkLoadPartition::OnDone(const Status& status) {
+  int dropped;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    dropped = dropped_;
+  }
+  if (dropped > 0) {
+    parent_->Drained(dropped);
+  }
+  parent_->PartitionDone(port_, status, response_);
+  delete this;
+}
+
+
+class scanReactor;
+
+//! @brief Scan Client End ---> Worker Server
+//! 
+//! @details One worker's sorted stream of a scan. Reads one entry at a time,
+//!          the next read starts once the parent consumed the last one.
+//!          Deletes itself when the stream is done.
+class scanSource : public grpc::ClientReadReactor<KVEntry> {
+ public:
+  scanSource(scanReactor* parent, int index, kvMethodsClient& methods,
+             CallbackServerContext* context, const ScanRequest& request)
+      : parent_(parent), index_(index), request_(request),
+        context_(ClientContext::FromCallbackServerContext(*context)) {
+    methods.Scan(context_.get(), &request_, this);
+    StartRead(&entry_);
+    StartCall();
+  }
+
+  //! @brief Read the next entry.
+  void Next() { StartRead(&entry_); }
+
+  //! @brief Stop the worker's stream, OnDone follows.
+  void Cancel() { context_->TryCancel(); }
+
+  void OnReadDone(bool ok) override;
+  void OnDone(const Status& status) override;
+
+ private:
+  scanReactor* parent_;
+  int index_;
+  ScanRequest request_;
+  std::unique_ptr<ClientContext> context_;
+  KVEntry entry_;
+};
+
+
+//! @brief Scan Server End <--- Client
+//! 
+//! @details Merges the sorted streams of every worker in key order. Only the
+//!          head entry of each worker is buffered and the next one is read
+//!          once it was written to the client, so a slow client holds back
+//!          the workers instead of filling the master's memory.
+class scanReactor : public ServerWriteReactor<KVEntry> {
+ public:
+  scanReactor(CallbackServerContext* context, const ScanRequest* request)
+      : limit_(request->limit()) {
+    std::vector<uint16_t> ports;
+    {
+      std::lock_guard<std::mutex> lock(survival_mu);
+      ports.assign(survival_list.begin(), survival_list.end());
+    }
+    std::vector<std::shared_ptr<kvMethodsClient>> clients;
+    for (uint16_t port : ports) {
+      std::shared_ptr<kvMethodsClient> methods = worker_channels.Pick(port);
+      if (methods != nullptr) {
+        clients.push_back(methods);
+      }
+    }
+    if (clients.empty() || clients.size() != ports.size()) {
+      Finish(Status(grpc::StatusCode::UNAVAILABLE, "No worker available"));
+      return;
+    }
+
+    // Sources may call back before the last one is opened.
+    std::lock_guard<std::mutex> lock(mu_);
+    slots_.resize(clients.size());
+    for (size_t i = 0; i < clients.size(); ++i) {
+      slots_[i].source =
+          new scanSource(this, i, *clients[i], context, *request);
+    }
+  }
+
+  void OnWriteDone(bool ok) override {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      writing_ = false;
+      if (!ok) {
+        // The client went away.
+        stopLocked();
+      } else if (++count_ == limit_) {
+        stopLocked();
+      }
+    }
+    pump();
+  }
+
+  void OnDone() override { delete this; }
+
+  //! @brief A worker's next entry arrived, or its stream ran out.
+  void SourceRead(int index, bool ok, KVEntry* entry) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      slot& source = slots_[index];
+      if (stopping_) {
+        // Cancelled : drop it and let the stream end.
+        source.exhausted = true;
+      } else if (ok) {
+        source.head.Swap(entry);
+        source.has_head = true;
+      } else {
+        source.exhausted = true;
+      }
+    }
+    pump();
+  }
+
+  //! @brief A worker's stream finished, its source is deleted right after.
+  void SourceDone(int index, const Status& status) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      slot& source = slots_[index];
+      source.source = nullptr;
+      source.exhausted = true;
+      if (!status.ok() && !stopping_) {
+        KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                         << status.error_message();
+        status_ = status;
+        stopLocked();
+      }
+    }
+    pump();
+  }
+
+ private:
+  struct slot {
+    scanSource* source = nullptr;
+    KVEntry head;
+    bool has_head = false;
+    bool exhausted = false;
+  };
+
+  //! @brief Cancel every worker stream. Called with the lock held.
+  void stopLocked() {
+    stopping_ = true;
+    for (slot& source : slots_) {
+      source.has_head = false;
+      if (source.source != nullptr) {
+        source.source->Cancel();
+      }
+    }
+  }
+
+  //! @brief Write the smallest head once every live worker has one, and
+  //!        finish when every stream is done.
+  void pump() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (writing_ || finished_) {
+        return;
+      }
+      while (!stopping_) {
+        slot* next = nullptr;
+        for (slot& source : slots_) {
+          if (source.has_head) {
+            if (next == nullptr || source.head.key() < next->head.key()) {
+              next = &source;
+            }
+          } else if (!source.exhausted) {
+            // Still reading : its next key may be the smallest.
+            return;
+          }
+        }
+        if (next == nullptr) {
+          break;
+        }
+
+        next->has_head = false;
+        if (!next->exhausted) {
+          next->source->Next();
+        }
+        // A key seen twice (e.g. copied while moving) is written once.
+        if (written_ && next->head.key() == out_.key()) {
+          continue;
+        }
+        out_.Swap(&next->head);
+        written_ = true;
+        writing_ = true;
+        StartWrite(&out_);
+        return;
+      }
+      if (!allDoneLocked()) {
+        return;
+      }
+      finished_ = true;
+    }
+    Finish(status_);
+  }
+
+  //! @brief Called with the lock held.
+  bool allDoneLocked() const {
+    for (const slot& source : slots_) {
+      if (source.source != nullptr) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const int64_t limit_;
+
+  std::mutex mu_;
+  std::vector<slot> slots_;
+  //!< The entry being written.
+  KVEntry out_;
+  bool written_ = false;
+  bool writing_ = false;
+  bool stopping_ = false;
+  bool finished_ = false;
+  int64_t count_ = 0;
+  Status status_;
+};
+
+void scanSource::OnReadDone(bool ok) {
+  parent_->SourceRead(index_, ok, &entry_);
+}
+
+void scanSource::OnDone(const Status& status) {
+  parent_->SourceDone(index_, status);
+  delete this;
+}
+
+
+class putStreamReactor;
+
+//! @brief Put Stream Client End ---> Worker Server
+//! 
+//! @details The owner's side of a PutStream relay : the chunk being written
+//!          and at most one more are held. Deletes itself when the stream is
+//!          done.
+class putStreamSink : public grpc::ClientWriteReactor<ValueChunk> {
+ public:
+  putStreamSink(putStreamReactor* parent, kvMethodsClient& methods,
+                CallbackServerContext* context)
+      : parent_(parent),
+        context_(ClientContext::FromCallbackServerContext(*context)) {
+    methods.PutStream(context_.get(), &response_, this);
+    StartCall();
+  }
+
+  //! @brief Take the chunk (swapped out of `chunk`) towards the worker.
+  //! 
+  //! @return false if no more fits : wait for the parent's `Drained`.
+  bool Write(ValueChunk* chunk) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (failed_) {
+      // OnDone brings the status.
+      return true;
+    }
+    if (writing_) {
+      next_.Swap(chunk);
+      has_next_ = true;
+      return false;
+    }
+    writing_ = true;
+    current_.Swap(chunk);
+    StartWrite(&current_);
+    return true;
+  }
+
+  //! @brief No more chunks : half-close once they are written.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mu_);
+    closing_ = true;
+    if (!writing_ && !failed_) {
+      StartWritesDone();
+    }
+  }
+
+  //! @brief Drop the stream, the worker stores nothing. OnDone follows.
+  void Cancel() { context_->TryCancel(); }
+
+  void OnWriteDone(bool ok) override;
+  void OnDone(const Status& status) override;
+
+ private:
+  putStreamReactor* parent_;
+  std::unique_ptr<ClientContext> context_;
+  KVResponse response_;
+
+  std::mutex mu_;
+  //!< The chunk being written, and the one after it.
+  ValueChunk current_;
+  ValueChunk next_;
+  bool writing_ = false;
+  bool has_next_ = false;
+  bool closing_ = false;
+  bool failed_ = false;
+};
+
+
+//! @brief Put Stream Server End <--- Client
+//! 
+//! @details Relays the chunks of a large value to the key's owner as they
+//!          come : the next chunk is read from the client once the previous
+//!          one is on its way, so the master never holds the whole value.
+//!          The key locks are not taken, the owner switches the value over
+//!          in one write once its last chunk is in.
+class putStreamReactor : public ServerReadReactor<ValueChunk> {
+ public:
+  putStreamReactor(CallbackServerContext* context, KVResponse* response,
+                   readCache* cache)
+      : context_(context), response_(response), cache_(cache) {
+    StartRead(&chunk_);
+  }
+
+  void OnReadDone(bool ok) override {
+    Status failed;
+    bool read_next = false;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (finished_) {
+        return;
+      }
+      if (!ok) {
+        if (sink_ == nullptr) {
+          finished_ = true;
+          failed = Status(grpc::StatusCode::INVALID_ARGUMENT, "Empty stream");
+        } else if (context_->IsCancelled()) {
+          // A stream cut short must not be stored.
+          sink_->Cancel();
+          return;
+        } else {
+          sink_->Close();
+          return;
+        }
+      } else if (sink_ == nullptr) {
+        key_ = chunk_.key();
+        uint16_t port = hash_ring.Owner(key_);
+        std::shared_ptr<kvMethodsClient> methods =
+            port == 0 ? nullptr : worker_channels.Pick(port);
+        if (methods == nullptr) {
+          finished_ = true;
+          failed = Status(grpc::StatusCode::UNAVAILABLE, "No worker available");
+        } else {
+          sink_ = new putStreamSink(this, *methods, context_);
+        }
+      }
+      if (!finished_) {
+        read_next = sink_->Write(&chunk_);
+        paused_ = !read_next;
+      }
+    }
+    if (!failed.ok()) {
+      Finish(failed);
+    } else if (read_next) {
+      StartRead(&chunk_);
+    }
+  }
+
+  void OnDone() override { delete this; }
+
+  //! @brief The sink has room again.
+  void Drained() {
+    bool resume;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      resume = paused_ && !finished_;
+      paused_ = false;
+    }
+    if (resume) {
+      StartRead(&chunk_);
+    }
+  }
+
+  //! @brief The owner's stream finished, the sink is deleted right after.
+  void SinkDone(const Status& status, KVResponse* reply) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      sink_ = nullptr;
+      if (finished_) {
+        return;
+      }
+      finished_ = true;
+      // Gets racing the stream may have cached the value it replaced.
+      cache_->Invalidate(key_);
+      response_->Swap(reply);
+    }
+    if (status.ok()) {
+      KV_LOG_SAMPLED(kLogInfo) << "Message: " << response_->message();
+    } else {
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
+    }
+    Finish(status);
+  }
+
+ private:
+  CallbackServerContext* context_;
+  KVResponse* response_;
+  readCache* cache_;
+  ValueChunk chunk_;
+
+  std::mutex mu_;
+  std::string key_;
+  putStreamSink* sink_ = nullptr;
+  bool paused_ = false;
+  bool finished_ = false;
+};
+
+void putStreamSink::OnWriteDone(bool ok) {
+  bool drained = false;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!ok) {
+      // The stream broke, OnDone brings the status.
+      failed_ = true;
+      writing_ = false;
+      has_next_ = false;
+    } else if (has_next_) {
+      current_.Swap(&next_);
+      has_next_ = false;
+      StartWrite(&current_);
+      drained = true;
+    } else {
+      writing_ = false;
+      if (closing_) {
+        StartWritesDone();
+      }
+    }
+  }
+  if (drained) {
+    parent_->Drained();
+  }
+}
+
+void putStreamSink::OnDone(const Status& status) {
+  parent_->SinkDone(status, &response_);
+  delete this;
+}
+
+
+class getStreamReactor;
+
+//! @brief Get Stream Client End ---> Worker Server
+//! 
+//! @details Reads one chunk at a time, the next read starts once the parent
+//!          took the last one. Deletes itself when the stream is done.
+class getStreamSource : public grpc::ClientReadReactor<ValueChunk> {
+ public:
+  getStreamSource(getStreamReactor* parent, kvMethodsClient& methods,
+                  CallbackServerContext* context, const KVRequest& request)
+      : parent_(parent), request_(request),
+        context_(ClientContext::FromCallbackServerContext(*context)) {
+    methods.GetStream(context_.get(), &request_, this);
+    StartRead(&chunk_);
+    StartCall();
+  }
+
+  //! @brief Read the next chunk.
+  void Next() { StartRead(&chunk_); }
+
+  //! @brief Stop the worker's stream, OnDone follows.
+  void Cancel() { context_->TryCancel(); }
+
+  void OnReadDone(bool ok) override;
+  void OnDone(const Status& status) override;
+
+ private:
+  getStreamReactor* parent_;
+  KVRequest request_;
+  std::unique_ptr<ClientContext> context_;
+  ValueChunk chunk_;
+};
+
+
+//! @brief Get Stream Server End <--- Client
+//! 
+//! @details Relays the owner's chunks of a value to the client : one chunk
+//!          is written while the next one is read, so the first bytes go
+//!          out before the owner read the rest and a slow client holds back
+//!          the owner instead of filling the master's memory.
+class getStreamReactor : public ServerWriteReactor<ValueChunk> {
+ public:
+  getStreamReactor(CallbackServerContext* context, const KVRequest* request) {
+    uint16_t port = hash_ring.Owner(request->key());
+    std::shared_ptr<kvMethodsClient> methods =
+        port == 0 ? nullptr : worker_channels.Pick(port);
+    if (methods == nullptr) {
+      Finish(Status(grpc::StatusCode::UNAVAILABLE, "No worker available"));
+      return;
+    }
+    // The source may call back before it is stored.
+    std::lock_guard<std::mutex> lock(mu_);
+    source_ = new getStreamSource(this, *methods, context, *request);
+  }
+
+  void OnWriteDone(bool ok) override {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      writing_ = false;
+      if (!ok) {
+        // The client went away.
+        stopping_ = true;
+        has_pending_ = false;
+        if (source_ != nullptr) {
+          source_->Cancel();
+        }
+      }
+    }
+    pump();
+  }
+
+  void OnDone() override { delete this; }
+
+  //! @brief The owner's next chunk arrived, or its stream ran out.
+  void SourceRead(bool ok, ValueChunk* chunk) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (ok && !stopping_) {
+        pending_.Swap(chunk);
+        has_pending_ = true;
+      } else {
+        exhausted_ = true;
+      }
+    }
+    pump();
+  }
+
+  //! @brief The owner's stream finished, the source is deleted right after.
+  void SourceDone(const Status& status) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      source_ = nullptr;
+      exhausted_ = true;
+      if (!status.ok() && !stopping_) {
+        KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                         << status.error_message();
+        status_ = status;
+      }
+    }
+    pump();
+  }
+
+ private:
+  //! @brief Write the pending chunk and read the next one meanwhile, and
+  //!        finish once the owner's stream is done.
+  void pump() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (writing_ || finished_) {
+        return;
+      }
+      if (has_pending_) {
+        out_.Swap(&pending_);
+        has_pending_ = false;
+        writing_ = true;
+        if (!exhausted_) {
+          source_->Next();
+        }
+        StartWrite(&out_);
+        return;
+      }
+      if (source_ != nullptr) {
+        return;
+      }
+      finished_ = true;
+    }
+    Finish(status_);
+  }
+
+  std::mutex mu_;
+  getStreamSource* source_ = nullptr;
+  //!< Read from the owner, not written yet.
+  ValueChunk pending_;
+  bool has_pending_ = false;
+  //!< Being written to the client.
+  ValueChunk out_;
+  bool writing_ = false;
+  bool exhausted_ = false;
+  bool stopping_ = false;
+  bool finished_ = false;
+  Status status_;
+};
+
+void getStreamSource::OnReadDone(bool ok) {
+  parent_->SourceRead(ok, &chunk_);
+}
+
+void getStreamSource::OnDone(const Status& status) {
+  parent_->SourceDone(status);
+  delete this;
+}
+
+//! @brief Builds the request and the reply of a unary call on a protobuf
+//!        arena.
+//!
+//! @details The arena's first block lives in the holder, and released
+//!          holders are kept and reused with their arena reset : the
+//!          client's request and the worker's reply, parsed straight into
+//!          the reply sent back, take no heap allocation unless they outgrow
+//!          the block.
+template <typename RequestT, typename ResponseT>
+class arenaMessageAllocator
+    : public grpc::MessageAllocator<RequestT, ResponseT> {
+ public:
+  enum : size_t { kBlock = 8 << 10, kKeep = 1024 };
+
+  ~arenaMessageAllocator() override {
+    for (holder* h : free_) {
+      delete h;
+    }
+  }
+
+  grpc::MessageHolder<RequestT, ResponseT>* AllocateMessages() override {
+    holder* h = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (!free_.empty()) {
+        h = free_.back();
+        free_.pop_back();
+      }
+    }
+    if (h == nullptr) {
+      h = new holder(this);
+    }
+    h->Build();
+    return h;
+  }
+
+ private:
+  class holder : public grpc::MessageHolder<RequestT, ResponseT> {
+   public:
+    explicit holder(arenaMessageAllocator* owner)
+        : owner_(owner), arena_(Options(block_)) {}
+
+    void Build() {
+      this->set_request(
+          google::protobuf::Arena::CreateMessage<RequestT>(&arena_));
+      this->set_response(
+          google::protobuf::Arena::CreateMessage<ResponseT>(&arena_));
+    }
+
+    void Release() override {
+      arena_.Reset();
+      owner_->Recycle(this);
+    }
+
+   private:
+    static google::protobuf::ArenaOptions Options(char* block) {
+      google::protobuf::ArenaOptions options;
+      options.initial_block = block;
+      options.initial_block_size = kBlock;
+      return options;
+    }
+
+    arenaMessageAllocator* owner_;
+    alignas(8) char block_[kBlock];
+    google::protobuf::Arena arena_;
+  };
+
+  void Recycle(holder* h) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (free_.size() < kKeep) {
+        free_.push_back(h);
+        return;
+      }
+    }
+    delete h;
+  }
+
+  std::mutex mu_;
+  std::vector<holder*> free_;
+};
+
+//! @brief KV Server End <--- Client
+//! 
+//! @details Will forward the request ---> Worker. Callback service : a
+//!          forwarded request holds no thread while the worker is working,
+//!          the reactor is finished from the worker call's callback.
+class kvMethodsMasterServiceImpl : public kvMethods::CallbackService {
+ public:
+  //! @brief Build the messages of Get, Put and Del on arenas.
+  virtual void UseArenas() {
+    SetMessageAllocatorFor_Get(&arenas_);
+    SetMessageAllocatorFor_Put(&arenas_);
+    SetMessageAllocatorFor_Del(&arenas_);
+  }
+
+ protected:
+  //!< Messages of the single-key calls.
+  arenaMessageAllocator<KVRequest, KVResponse> arenas_;
+
+  //! @brief Get without parsing the value : the request is parsed for its
+  //!        key and policy and forwarded as received, the worker's reply is
+  //!        sent back as received. Only the reply's header is read, so a
+  //!        large value is never copied by the master.
+  ServerUnaryReactor* RawGet(CallbackServerContext* context,
+                             const grpc::ByteBuffer* request,
+                             grpc::ByteBuffer* response) {
+    ServerUnaryReactor* reactor = context->DefaultReactor();
+    std::unique_ptr<rawGetCall> call(
+        new rawGetCall{context, reactor, request, KVRequest(), response});
+    if (!parseMessage(*request, &call->request)) {
+      reactor->Finish(Status(grpc::StatusCode::INVALID_ARGUMENT,
+                             "Malformed request"));
+      return reactor;
+    }
+    KVResponse cached;
+    if (cache.Lookup(call->request.key(), &cached)) {
+      serializeMessage(cached, response);
+      reactor->Finish(Status::OK);
+      return reactor;
+    }
+    uint16_t port = readPort(call->request);
+    forwardRawGet(call.release(), port);
+    return reactor;
+  }
+
+ private:
+  //!< Key Lock
+  keyLockTable locks;
+  //!< Replies of hot keys
+  readCache cache{
+      static_cast<size_t>(std::max(0, absl::GetFlag(FLAGS_read_cache_mb)))
+          << 20,
+      absl::GetFlag(FLAGS_read_cache_shards)};
+
+  //! @brief Deadline of a write waiting for a locked key.
+  static keyLockTable::Clock::time_point lockDeadline() {
+    return keyLockTable::Clock::now() +
+        std::chrono::milliseconds(absl::GetFlag(FLAGS_lock_timeout_ms));
+  }
+
+  //! @brief Get the Worker Port object : the key's owner on the hash ring
+  uint16_t getWorkerPort(const std::string& key) {
+    return hash_ring.Owner(key);
+  }
+
+  //! @brief Context of a forwarded call, inherits the client's deadline and
+  //!        cancellation. Deleted by `relay`.
+  static ClientContext* forwardContext(CallbackServerContext* context) {
+    return ClientContext::FromCallbackServerContext(*context).release();
+  }
+
+  //! @brief Hand the worker's reply (already in `response`) to the client.
+  static void relay(ServerUnaryReactor* reactor, KVResponse* response,
+                    ClientContext* forward, const Status& status) {
+    delete forward;
+    if (status.ok()) {
+      KV_LOG_SAMPLED(kLogInfo) << "Message: " << response->message();
+    } else {
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
+      response->set_error(true);
+    }
+    reactor->Finish(Status::OK);
+  }
+
+  ServerUnaryReactor* Get(CallbackServerContext* context,
+                          const KVRequest* request,
+                          KVResponse* response) override {
+    ServerUnaryReactor* reactor = context->DefaultReactor();
+    if (cache.Lookup(request->key(), response)) {
+      reactor->Finish(Status::OK);
+      return reactor;
+    }
+    forwardGet(context, request, response, reactor, readPort(*request));
+    return reactor;
+  }
+
+  //! @brief Pick the copy of the key a Get is read from, by its policy.
+  uint16_t readPort(const KVRequest& request) {
+    if (request.read_policy() == distributedKV::PRIMARY) {
+      return getWorkerPort(request.key());
+    }
+    std::vector<uint16_t> nodes = hash_ring.GetNodes(
+        request.key(), 1 + std::max(0, absl::GetFlag(FLAGS_replicas)));
+    if (nodes.empty()) {
+      return 0;
+    }
+    if (request.read_policy() == distributedKV::LEAST_LOADED) {
+      // Ties go to the owner, the first node.
+      uint16_t best = nodes[0];
+      int best_load = worker_channels.Load(best);
+      for (size_t i = 1; i < nodes.size(); ++i) {
+        int load = worker_channels.Load(nodes[i]);
+        if (load >= 0 && (best_load < 0 || load < best_load)) {
+          best = nodes[i];
+          best_load = load;
+        }
+      }
+      return best;
+    }
+    thread_local std::mt19937 rng(std::random_device{}());
+    return nodes[std::uniform_int_distribution<size_t>(
+        0, nodes.size() - 1)(rng)];
+  }
+
+  //! @brief Forward a Get to a copy of the key. A replica that is behind
+  //!        or unreachable hands the read over to the owner, whose replies
+  //!        are cached.
+  void forwardGet(CallbackServerContext* context, const KVRequest* request,
+                  KVResponse* response, ServerUnaryReactor* reactor,
+                  uint16_t port) {
+    uint16_t owner = getWorkerPort(request->key());
+    std::shared_ptr<kvMethodsClient> methods =
+        port == 0 ? nullptr : worker_channels.Pick(port);
+    if (methods == nullptr && port != owner) {
+      forwardGet(context, request, response, reactor, owner);
+      return;
+    }
+    if (methods == nullptr) {
+      reactor->Finish(
+          Status(grpc::StatusCode::UNAVAILABLE, "No worker available"));
+      return;
+    }
+
+    // Forward the request to worker server
+    ClientContext* forward = forwardContext(context);
+    uint64_t epoch = cache.Epoch(request->key());
+    auto start = std::chrono::steady_clock::now();
+    worker_channels.AddLoad(port, 1);
+    methods->Get(forward, request, response,
+                 [this, context, request, response, reactor, forward, port,
+                  owner, epoch, start](Status status) {
+                   worker_channels.AddLoad(port, -1);
+                   worker_channels.Forwarded(port, start);
+                   if (port != owner && (!status.ok() || response->stale())) {
+                     delete forward;
+                     response->Clear();
+                     forwardGet(context, request, response, reactor, owner);
+                     return;
+                   }
+                   if (port == owner && status.ok() && !response->error()) {
+                     cache.Insert(request->key(), *response, epoch);
+                   }
+                   relay(reactor, response, forward, status);
+                 });
+  }
+
+  //! @brief A Get served on serialized messages.
+  struct rawGetCall {
+    CallbackServerContext* context;
+    ServerUnaryReactor* reactor;
+    //!< The client's request, as received and parsed for routing.
+    const grpc::ByteBuffer* bytes;
+    KVRequest request;
+    grpc::ByteBuffer* response;
+  };
+
+  //! @brief `forwardGet` on serialized messages. Deletes the call when it
+  //!        is finished.
+  void forwardRawGet(rawGetCall* call, uint16_t port) {
+    const std::string& key = call->request.key();
+    uint16_t owner = getWorkerPort(key);
+    std::shared_ptr<kvMethodsClient> methods =
+        port == 0 ? nullptr : worker_channels.Pick(port);
+    if (methods == nullptr && port != owner) {
+      forwardRawGet(call, owner);
+      return;
+    }
+    if (methods == nullptr) {
+      call->reactor->Finish(
+          Status(grpc::StatusCode::UNAVAILABLE, "No worker available"));
+      delete call;
+      return;
+    }
+
+    ClientContext* forward = forwardContext(call->context);
+    uint64_t epoch = cache.Epoch(key);
+    auto start = std::chrono::steady_clock::now();
+    worker_channels.AddLoad(port, 1);
+    methods->RawGet(
+        forward, call->bytes, call->response,
+        [this, call, forward, port, owner, epoch, start](Status status) {
+          worker_channels.AddLoad(port, -1);
+          worker_channels.Forwarded(port, start);
+          delete forward;
+          replyHeader header;
+          bool parsed = status.ok() && peekReply(*call->response, &header);
+          if (port != owner && (!parsed || header.stale)) {
+            call->response->Clear();
+            forwardRawGet(call, owner);
+            return;
+          }
+          if (parsed) {
+            KV_LOG_SAMPLED(kLogInfo) << "Message: " << header.message;
+            // The cache keeps its own copy of the value.
+            KVResponse reply;
+            if (port == owner && !header.error && cache.Enabled() &&
+                parseMessage(*call->response, &reply)) {
+              cache.Insert(call->request.key(), reply, epoch);
+            }
+          } else {
+            KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                             << status.error_message();
+            KVResponse failed;
+            failed.set_error(true);
+            serializeMessage(failed, call->response);
+          }
+          call->reactor->Finish(Status::OK);
+          delete call;
+        });
+  }
+
+  ServerUnaryReactor* Put(CallbackServerContext* context,
+                          const KVRequest* request,
+                          KVResponse* response) override {
+    return forwardWrite(context, request, response, &kvMethodsClient::Put);
+  }
+
+  ServerUnaryReactor* Del(CallbackServerContext* context,
+                          const KVRequest* request,
+                          KVResponse* response) override {
+    return forwardWrite(context, request, response, &kvMethodsClient::Del);
+  }
+
+  using unaryMethod = void (kvMethodsClient::*)(
+      ClientContext*, const KVRequest*, KVResponse*,
+      std::function<void(Status)>);
+
+  //! @brief Forward a write under its key lock, waiting for the lock if
+  //!        another write holds it.
+  ServerUnaryReactor* forwardWrite(CallbackServerContext* context,
+                                   const KVRequest* request,
+                                   KVResponse* response, unaryMethod method) {
+    ServerUnaryReactor* reactor = context->DefaultReactor();
+    auto locked = [this, context, request, response, reactor,
+                   method](bool acquired) {
+      if (!acquired) {
+        reactor->Finish(Status(grpc::StatusCode::CANCELLED,
+                               "Timed out waiting for the key lock"));
+        return;
+      }
+      const std::string& key = request->key();
+
+      // Forward the request to worker server
+      uint16_t port = getWorkerPort(key);
+      std::shared_ptr<kvMethodsClient> methods =
+          port == 0 ? nullptr : worker_channels.Pick(port);
+      if (methods == nullptr) {
+        locks.Unlock(key);
+        reactor->Finish(
+            Status(grpc::StatusCode::UNAVAILABLE, "No worker available"));
+        return;
+      }
+      ClientContext* forward = forwardContext(context);
+      auto start = std::chrono::steady_clock::now();
+      ((*methods).*method)(forward, request, response,
+                           [this, key, reactor, response, forward, port,
+                            start](Status status) {
+                             worker_channels.Forwarded(port, start);
+                             // Release the lock.
+                             cache.Invalidate(key);
+                             locks.Unlock(key);
+                             relay(reactor, response, forward, status);
+                           });
+    };
+
+    // Get the lock, or queue for it.
+    if (locks.Lock(request->key(), lockDeadline(), locked)) {
+      locked(true);
+    }
+    return reactor;
+  }
+
+  ServerReadReactor<KVRequest>* BulkLoad(
+      CallbackServerContext* context, BulkLoadResponse* response) override {
+    return new bulkLoadReactor(context, response, &cache);
+  }
+
+  ServerWriteReactor<KVEntry>* Scan(CallbackServerContext* context,
+                                    const ScanRequest* request) override {
+    return new scanReactor(context, request);
+  }
+
+  ServerReadReactor<ValueChunk>* PutStream(CallbackServerContext* context,
+                                           KVResponse* response) override {
+    return new putStreamReactor(context, response, &cache);
+  }
+
+  ServerWriteReactor<ValueChunk>* GetStream(
+      CallbackServerContext* context, const KVRequest* request) override {
+    return new getStreamReactor(context, request);
+  }
+
+  //! @brief Hand out the routing table : the workers and the ring layout, so
+  //!        smart clients can find the owner of a key themselves.
+  ServerUnaryReactor* Routing(CallbackServerContext* context,
+                              const RoutingRequest* request,
+                              RoutingTable* response) override {
+    ServerUnaryReactor* reactor = context->DefaultReactor();
+    if (cache.Enabled()) {
+      // Direct writes would leave stale replies in the cache : the clients
+      // stay on the master.
+      reactor->Finish(Status(grpc::StatusCode::FAILED_PRECONDITION,
+                             "Routing is off while the read cache is on"));
+      return reactor;
+    }
+    {
+      std::lock_guard<std::mutex> lock(survival_mu);
+      response->set_version(survival_version);
+      for (uint16_t port : survival_list) {
+        WorkerEndpoint* worker = response->add_workers();
+        worker->set_port(port);
+        worker->set_address(getWorkerSocket(port));
+      }
+    }
+    response->set_vnodes(absl::GetFlag(FLAGS_vnodes));
+    response->set_replicas(absl::GetFlag(FLAGS_replicas));
+    reactor->Finish(Status::OK);
+    return reactor;
+  }
+
+  ServerUnaryReactor* MultiGet(CallbackServerContext* context,
+                               const MultiKVRequest* request,
+                               MultiKVResponse* response) override {
+    return forwardBatch(context, request, response,
+                        &kvMethodsClient::MultiGet, false);
+  }
+
+  ServerUnaryReactor* MultiPut(CallbackServerContext* context,
+                               const MultiKVRequest* request,
+                               MultiKVResponse* response) override {
+    return forwardBatch(context, request, response,
+                        &kvMethodsClient::MultiPut, true);
+  }
+
+  ServerUnaryReactor* MultiDel(CallbackServerContext* context,
+                               const MultiKVRequest* request,
+                               MultiKVResponse* response) override {
+    return forwardBatch(context, request, response,
+                        &kvMethodsClient::MultiDel, true);
+  }
+
+  using batchMethod = void (kvMethodsClient::*)(
+      ClientContext*, const MultiKVRequest*, MultiKVResponse*,
+      std::function<void(Status)>);
+
+  //! @brief A batch split into one sub-batch per owning worker.
+  struct batchCall {
+    ServerUnaryReactor* reactor;
+    MultiKVResponse* response;
+    //!< Keys locked by a write batch.
+    std::vector<std::string> locked;
+    //!< Sub-batch i carries requests[indices[i][k]] of the batch.
+    std::vector<std::vector<int>> indices;
+    std::vector<MultiKVRequest> requests;
+    std::vector<MultiKVResponse> responses;
+    std::vector<Status> statuses;
+    std::vector<std::unique_ptr<ClientContext>> contexts;
+    std::atomic<int> pending{0};
+  };
+
+  //! @brief Split a batch by owning worker, forward the sub-batches in
+  //!        parallel and merge the replies back in request order.
+  ServerUnaryReactor* forwardBatch(CallbackServerContext* context,
+                                   const MultiKVRequest* request,
+                                   MultiKVResponse* response,
+                                   batchMethod method, bool write) {
+    ServerUnaryReactor* reactor = context->DefaultReactor();
+    auto call = std::make_shared<batchCall>();
+    call->reactor = reactor;
+    call->response = response;
+    if (!write) {
+      dispatchBatch(call, context, request, method);
+      return reactor;
+    }
+
+    // Lock every key of a write batch, all or nothing.
+    for (const KVRequest& entry : request->requests()) {
+      call->locked.push_back(entry.key());
+    }
+    std::sort(call->locked.begin(), call->locked.end());
+    call->locked.erase(std::unique(call->locked.begin(), call->locked.end()),
+                       call->locked.end());
+    locks.LockAll(call->locked, lockDeadline(),
+                  [this, call, context, request, method](bool acquired) {
+                    if (!acquired) {
+                      call->locked.clear();
+                      call->reactor->Finish(
+                          Status(grpc::StatusCode::CANCELLED,
+                                 "Timed out waiting for the key locks"));
+                      return;
+                    }
+                    dispatchBatch(call, context, request, method);
+                  });
+    return reactor;
+  }
+
+  //! @brief Forward a (locked) batch to the owners of its keys.
+  void dispatchBatch(std::shared_ptr<batchCall> call,
+                     CallbackServerContext* context,
+                     const MultiKVRequest* request, batchMethod method) {
+    ServerUnaryReactor* reactor = call->reactor;
+
+    // Group the requests by owning worker.
+    std::unordered_map<uint16_t, int> sub_batch;
+    std::vector<std::shared_ptr<kvMethodsClient>> clients;
+    std::vector<uint16_t> ports;
+    for (int i = 0; i < request->requests_size(); ++i) {
+      const KVRequest& entry = request->requests(i);
+      uint16_t port = getWorkerPort(entry.key());
+      std::shared_ptr<kvMethodsClient> methods =
+          port == 0 ? nullptr : worker_channels.Pick(port);
+      if (methods == nullptr) {
+        locks.UnlockAll(call->locked);
+        reactor->Finish(
+            Status(grpc::StatusCode::UNAVAILABLE, "No worker available"));
+        return;
+      }
+      auto inserted = sub_batch.emplace(port, call->indices.size());
+      if (inserted.second) {
+        call->indices.emplace_back();
+        call->requests.emplace_back();
+        clients.push_back(methods);
+        ports.push_back(port);
+      }
+      int j = inserted.first->second;
+      call->indices[j].push_back(i);
+      *call->requests[j].add_requests() = entry;
+    }
+
+    if (call->requests.empty()) {
+      reactor->Finish(Status::OK);
+      return;
+    }
+
+    // Forward the sub-batches in parallel, the last reply merges them.
+    int n = call->requests.size();
+    call->responses.resize(n);
+    call->statuses.resize(n);
+    call->pending = n;
+    for (int j = 0; j < n; ++j) {
+      call->contexts.emplace_back(
+          ClientContext::FromCallbackServerContext(*context));
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int j = 0; j < n; ++j) {
+      uint16_t port = ports[j];
+      ((*clients[j]).*method)(
+          call->contexts[j].get(), &call->requests[j], &call->responses[j],
+          [this, call, j, port, start](Status status) {
+            worker_channels.Forwarded(port, start);
+            call->statuses[j] = status;
+            if (call->pending.fetch_sub(1) == 1) {
+              mergeBatch(*call);
+              cache.InvalidateAll(call->locked);
+              locks.UnlockAll(call->locked);
+              call->reactor->Finish(Status::OK);
+            }
+          });
+    }
+  }
+
+  //! @brief Put the sub-batch replies back in request order.
+  static void mergeBatch(batchCall& call) {
+    int total = 0;
+    for (const auto& indices : call.indices) {
+      total += indices.size();
+    }
+    MultiKVResponse* response = call.response;
+    for (int i = 0; i < total; ++i) {
+      response->add_responses();
+    }
+
+    for (size_t j = 0; j < call.indices.size(); ++j) {
+      const Status& status = call.statuses[j];
+      MultiKVResponse& sub = call.responses[j];
+      if (!status.ok()) {
+        KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                         << status.error_message();
+      }
+      if (sub.error() || !status.ok()) {
+        response->set_error(true);
+        response->set_message(status.ok() ? sub.message()
+                                          : status.error_message());
+      }
+      for (size_t k = 0; k < call.indices[j].size(); ++k) {
+        KVResponse* entry = response->mutable_responses(call.indices[j][k]);
+        if (status.ok() && static_cast<int>(k) < sub.responses_size()) {
+          entry->Swap(sub.mutable_responses(k));
+        } else {
+          entry->set_message(status.error_message());
+          entry->set_error(true);
+        }
+      }
+    }
+    if (!response->error()) {
+      response->set_message("Batch done!");
+    }
+  }
+};
+
+//! @brief The master's service with Get served on serialized messages, see
+//!        `RawGet`.
+class kvMethodsRawGetServiceImpl final
+    : public kvMethods::WithRawCallbackMethod_Get<kvMethodsMasterServiceImpl> {
+ public:
+  //! @brief As the parsed service, but Get : its messages are the
+  //!        serialized ones.
+  void UseArenas() override {
+    SetMessageAllocatorFor_Put(&arenas_);
+    SetMessageAllocatorFor_Del(&arenas_);
+  }
+
+ private:
+  ServerUnaryReactor* Get(CallbackServerContext* context,
+                          const grpc::ByteBuffer* request,
+                          grpc::ByteBuffer* response) override {
+    return RawGet(context, request, response);
+  }
+};
+
+
+//! @brief Server Runtime.
+//! 
+//! @param port : working port
+void RunServer(uint16_t port) {
   std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
   GreeterServiceImpl greeter_service;
-  kvMethodsMasterServiceImpl kvMethods_service;
+  std::unique_ptr<kvMethodsMasterServiceImpl> kvMethods_service(
+      absl::GetFlag(FLAGS_raw_get) ? new kvMethodsRawGetServiceImpl
+                                   : new kvMethodsMasterServiceImpl);
   workerRegisterServiceImpl workerRegister_service;
+  if (absl::GetFlag(FLAGS_message_arenas)) {
+    kvMethods_service->UseArenas();
+  }
 
   grpc::EnableDefaultHealthCheckService(true);
   grpc::reflection::InitProtoReflectionServerBuilderPlugin();
@@ -308,11 +2620,40 @@ void RunServer(uint16_t port) {
   // Register "service" as the instance through which we'll communicate with
   // clients. In this case it corresponds to an *synchronous* service.
   builder.RegisterService(&greeter_service);
-  builder.RegisterService(&kvMethods_service);
+  builder.RegisterService(kvMethods_service.get());
   builder.RegisterService(&workerRegister_service);
+
+  // Time every RPC and serve the metrics on their own port.
+  std::unique_ptr<metricsHttpServer> metrics_server;
+  const uint16_t metrics_port = absl::GetFlag(FLAGS_metrics_port);
+  if (metrics_port != 0) {
+    std::vector<std::unique_ptr<
+        grpc::experimental::ServerInterceptorFactoryInterface>> creators;
+    creators.emplace_back(new rpcMetricsFactory);
+    builder.experimental().SetInterceptorCreators(std::move(creators));
+
+    globalMetrics().AddCollector([](std::ostream& out) {
+      std::lock_guard<std::mutex> lock(survival_mu);
+      out << "# TYPE kv_master_workers gauge\n"
+          << "kv_master_workers " << survival_list.size() << "\n"
+          << "# TYPE kv_master_membership_version gauge\n"
+          << "kv_master_membership_version " << survival_version << "\n";
+    });
+    metrics_server.reset(new metricsHttpServer(&globalMetrics()));
+    if (metrics_server->Start(metrics_port)) {
+      KV_LOG(kLogInfo) << "Metrics on 0.0.0.0:" << metrics_port
+                       << "/metrics";
+    } else {
+      KV_LOG(kLogError) << "Cannot serve metrics on port " << metrics_port;
+    }
+  }
+
   // Finally assemble the server.
   std::unique_ptr<Server> server(builder.BuildAndStart());
-  std::cout << "Server listening on " << server_address << std::endl;
+  KV_LOG(kLogInfo) << "Server listening on " << server_address;
+
+  // Drop the workers that stop sending heartbeats.
+  failure_detector.Start(removeWorker);
 
   // Wait for the server to shutdown. Note that some other thread must be
   // responsible for shutting down the server for this call to ever return.
@@ -322,6 +2663,15 @@ void RunServer(uint16_t port) {
 
 int main(int argc, char** argv) {
   absl::ParseCommandLine(argc, argv);
+  logLevel level;
+  if (!parseLogLevel(absl::GetFlag(FLAGS_log_level), &level)) {
+    std::cerr << "Unknown log level: " << absl::GetFlag(FLAGS_log_level)
+              << std::endl;
+    return 1;
+  }
+  globalLogger().SetLevel(level);
+  globalLogger().SetSampleEvery(absl::GetFlag(FLAGS_log_sample));
+  hash_ring.SetVirtualNodes(absl::GetFlag(FLAGS_vnodes));
   RunServer(absl::GetFlag(FLAGS_port));
 
   return 0;
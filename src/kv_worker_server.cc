@@ -16,11 +16,29 @@
  *
  */
 
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <random>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
@@ -36,16 +54,32 @@
 #include "distributedKV.grpc.pb.h"
 
 #include <cassert>
+#include "leveldb/cache.h"
 #include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/filter_policy.h"
 
 #endif
 
+#include "consistent_hash_ring.h"
+#include "leveldb_engine.h"
+#include "logger.h"
+#include "memory_engine.h"
+#include "metrics.h"
+#include "row_cache.h"
+#include "storage_engine.h"
+#include "uring_env.h"
+
 using grpc::Channel;
 using grpc::ClientContext;
 
 using grpc::Server;
 using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
+using grpc::ServerReader;
+using grpc::ServerReaderWriter;
+using grpc::ServerWriter;
 using grpc::Status;
 
 using distributedKV::Greeter;
@@ -55,6 +89,13 @@ using distributedKV::HelloRequest;
 using distributedKV::kvMethods;
 using distributedKV::KVRequest;
 using distributedKV::KVResponse;
+using distributedKV::MultiKVRequest;
+using distributedKV::MultiKVResponse;
+using distributedKV::BulkLoadResponse;
+using distributedKV::ScanRequest;
+using distributedKV::KVEntry;
+using distributedKV::ValueChunk;
+using distributedKV::ChunkManifest;
 
 using distributedKV::workerRegister;
 using distributedKV::workerSetup;
@@ -66,6 +107,64 @@ using distributedKV::updateResponse;
 
 // Default port (master)
 ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+ABSL_FLAG(std::string, master, "localhost:50051", "Master server address");
+ABSL_FLAG(std::string, log_level, "info",
+          "Lowest level logged : debug, info, warn or error");
+ABSL_FLAG(uint16_t, metrics_port, 0,
+          "Port serving the metrics over HTTP at /metrics, 0 disables");
+ABSL_FLAG(std::string, addr, "localhost", "Address of the other workers");
+ABSL_FLAG(int, async_cqs, 0,
+          "Completion queues, one polling thread each, serving Get, Put and "
+          "Del ; 0 uses one per core");
+ABSL_FLAG(int, async_slots, 64,
+          "Calls of each method every completion queue requests ahead");
+ABSL_FLAG(int, write_threads, 32,
+          "Threads running Puts and Dels, which wait on commits and acks");
+ABSL_FLAG(bool, pin_threads, true,
+          "Pin every polling thread to a core");
+ABSL_FLAG(int, heartbeat_interval_ms, 500,
+          "Interval of the heartbeats sent to the master");
+ABSL_FLAG(int, vnodes, 128,
+          "Number of virtual nodes per worker on the consistent-hash ring, "
+          "must match the master's");
+
+// Replication
+ABSL_FLAG(int, replicas, 1,
+          "Number of workers every write is copied to besides its owner");
+ABSL_FLAG(int, ack_quorum, 1,
+          "Replica acks a write waits for, capped by the available replicas");
+ABSL_FLAG(int, replication_timeout_ms, 1000,
+          "How long a write waits for its quorum before it is rolled back");
+
+// Storage tuning
+ABSL_FLAG(std::string, engine, "leveldb",
+          "Storage engine : leveldb, or memory for diskless cache-tier "
+          "workers");
+ABSL_FLAG(std::string, db_dir, "/tmp/testdb",
+          "Parent directory of the per-port LevelDB instances");
+ABSL_FLAG(int, block_cache_mb, 8, "LevelDB block cache size in MB");
+ABSL_FLAG(int, bloom_bits, 10,
+          "Bloom filter bits per key, 0 disables the filter");
+ABSL_FLAG(int, write_buffer_mb, 4, "LevelDB memtable size in MB");
+ABSL_FLAG(int, row_cache_mb, 32,
+          "Size of the row cache in front of the storage engine in MB, 0 "
+          "to disable");
+ABSL_FLAG(std::string, compression, "snappy",
+          "Block compression : snappy, zstd or none");
+ABSL_FLAG(bool, sync_writes, false, "fsync the LevelDB log on every write");
+ABSL_FLAG(bool, io_uring, false,
+          "Write the LevelDB files through io_uring, falls back to POSIX "
+          "I/O where the kernel does not allow it");
+ABSL_FLAG(int, commit_max_batch_kb, 1024,
+          "Max size of a group commit in KB");
+ABSL_FLAG(int, commit_max_delay_us, 100,
+          "How long a group commit waits for more writers, 0 commits at once");
+ABSL_FLAG(int, commit_stats_interval_s, 0,
+          "Print group commit stats every N seconds, 0 disables");
+ABSL_FLAG(int, bulk_batch_kb, 4096,
+          "Size of the write batches a bulk load is ingested in, in KB");
+ABSL_FLAG(int, stream_chunk_kb, 256,
+          "Size of the chunks a plain value is streamed out in, in KB");
 
 //! @brief Greeter Server End
 //! 
@@ -80,6 +179,35 @@ class GreeterServiceImpl final : public Greeter::Service {
 
 // The list recording that which worker is active.
 std::unordered_set<uint16_t> survival_list;
+// Guard of survival_list.
+std::mutex survival_mu;
+// Version of survival_list on the master.
+uint64_t survival_version = 0;
+
+//!< Key ---> owner and replicas.
+consistentHashRing hash_ring;
+
+//! @brief Apply a survival list sent by the master : the whole list, or a
+//!        change on top of the previous version. A change that does not
+//!        follow the version we have is dropped, the next heartbeat brings
+//!        the whole list.
+void updateSurvivalList(const survivalList& list) {
+  std::lock_guard<std::mutex> lock(survival_mu);
+  if (list.ports_size() > 0) {
+    survival_list.clear();
+    survival_list.insert(list.ports().begin(), list.ports().end());
+  } else if (list.version() == survival_version + 1) {
+    survival_list.insert(list.joined().begin(), list.joined().end());
+    for (int port : list.left()) {
+      survival_list.erase(port);
+    }
+  } else {
+    return;
+  }
+  survival_version = list.version();
+  hash_ring.Reset(std::vector<uint16_t>(survival_list.begin(),
+                                        survival_list.end()));
+}
 
 //! @brief Register Client End
 //! 
@@ -101,69 +229,1704 @@ class workerRegisterClient {
     Status status = stub_->Register(&context, request, &response);
 
     if (status.ok()) {
-      std:: cout << "Message: " << response.message() << std::endl;
-      int surList_size = response.ports_size();
-      for (int i = 0; i < surList_size; ++i) {
-        survival_list.insert(response.ports(i));
-      }
+      KV_LOG(kLogInfo) << "Message: " << response.message();
+      updateSurvivalList(response);
       return true;
     } else {
-      std::cout << "Code "<< status.error_code() << ": " 
-                << status.error_message() << std::endl;
+      KV_LOG(kLogWarn) << "Code " << status.error_code() << ": "
+                       << status.error_message();
       return false;
     }
   }
 
+  //! @brief Tell the master we are alive.
+  //! 
+  //! @return the status, NOT_FOUND if the master does not know us.
+  Status Heartbeat(int port) {
+    workerSetup request;
+    request.set_port(port);
+    {
+      std::lock_guard<std::mutex> lock(survival_mu);
+      request.set_version(survival_version);
+    }
+
+    survivalList response;
+
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() +
+        std::chrono::milliseconds(absl::GetFlag(FLAGS_heartbeat_interval_ms)));
+
+    // actual rpc
+    Status status = stub_->Heartbeat(&context, request, &response);
+    if (status.ok() && response.ports_size() > 0) {
+      KV_LOG(kLogInfo) << "Message: " << response.message();
+      updateSurvivalList(response);
+    }
+    return status;
+  }
+
  private:
   std::unique_ptr<workerRegister::Stub> stub_;
 };
 
-//! @brief Spreader Client End
+//! @brief Heartbeats ---> Master Server
+//! 
+//! @details Registers with the master, then reports every
+//!          `heartbeat_interval_ms`. Registers again whenever the master
+//!          no longer knows this worker (it was declared failed, or the
+//!          master restarted).
+class heartbeatSender {
+ public:
+  heartbeatSender(std::shared_ptr<Channel> channel, uint16_t port)
+      : client_(channel), port_(port),
+        thread_(&heartbeatSender::Run, this) {}
+
+  ~heartbeatSender() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+ private:
+  void Run() {
+    const auto interval = std::chrono::milliseconds(
+        std::max(1, absl::GetFlag(FLAGS_heartbeat_interval_ms)));
+    bool registered = false;
+    std::unique_lock<std::mutex> lock(mu_);
+    do {
+      lock.unlock();
+      if (!registered) {
+        registered = client_.Register("Hi i am worker.", port_);
+        if (!registered) {
+          KV_LOG(kLogWarn) << "Failed to register to "
+                           << absl::GetFlag(FLAGS_master);
+        }
+      } else if (client_.Heartbeat(port_).error_code() ==
+                 grpc::StatusCode::NOT_FOUND) {
+        registered = false;
+      }
+      lock.lock();
+    } while (!cv_.wait_for(lock, interval, [this] { return stop_; }));
+  }
+
+  workerRegisterClient client_;
+  uint16_t port_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+//! @brief Register Server End <--- Master Server
 //! 
+//! @details Gets the changes of the survival list.
+class workerRegisterServiceImpl final : public workerRegister::Service {
+  Status Broadcast(ServerContext* context, const survivalList* request,
+                   google::protobuf::Empty* response) override {
+    KV_LOG(kLogInfo) << "Message: " << request->message();
+    updateSurvivalList(*request);
+    return Status::OK;
+  }
+};
+
+//! @brief Group commit stage in front of the storage engine.
+//! 
+//! @details Writes queued within `max_delay` of the first waiting one are
+//!          coalesced, up to `max_bytes`, into one atomic engine write (a
+//!          single LevelDB log write, and fsync when `sync` is set). Every
+//!          caller of the group is completed with the same status
+//!          afterwards. The row cache is kept in step around every write.
+class groupCommitter {
+ public:
+  using Callback = std::function<void(const leveldb::Status&)>;
+
+  groupCommitter(storageEngine* db, rowCache* cache, bool sync,
+                 size_t max_bytes, std::chrono::microseconds max_delay,
+                 std::chrono::seconds stats_interval)
+      : db_(db), cache_(cache), sync_(sync), max_bytes_(max_bytes),
+        max_delay_(max_delay), stats_interval_(stats_interval),
+        thread_(&groupCommitter::Run, this) {}
+
+  //! @brief Commit the writes still queued and stop.
+  ~groupCommitter() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  //! @brief Queue a write.
+  //! 
+  //! @param batch : kept alive by the caller until `done` runs.
+  //! @param done : runs on the commit thread once the group is written.
+  void Submit(const storageBatch* batch, Callback done) {
+    size_t bytes = batch->ApproximateSize();
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (queue_.empty()) {
+        first_arrival_ = std::chrono::steady_clock::now();
+      }
+      queue_.push_back({batch, bytes, std::move(done)});
+      queued_bytes_ += bytes;
+    }
+    cv_.notify_one();
+  }
+
+  //! @brief Queue a write and wait for its group to be committed.
+  leveldb::Status Write(const storageBatch* batch) {
+    std::promise<leveldb::Status> done;
+    Submit(batch, [&done](const leveldb::Status& status) {
+      done.set_value(status);
+    });
+    return done.get_future().get();
+  }
+
+  //! @brief Commits so far, writes per commit as a power-of-two histogram.
+  std::string Stats() const {
+    std::ostringstream out;
+    out << "commits=" << commits_->Value() << " writes=" << writes_->Value()
+        << " bytes=" << bytes_->Value() << " writes_per_commit:";
+    for (int i = 0; i < kBuckets; ++i) {
+      out << " [" << (1 << i) << ","
+          << (i + 1 == kBuckets ? std::string("inf")
+                                : std::to_string(1 << (i + 1)))
+          << ")=" << size_buckets_[i];
+    }
+    return out.str();
+  }
+
+ private:
+  struct pendingWrite {
+    const storageBatch* batch;
+    size_t bytes;
+    Callback done;
+  };
+
+  static constexpr int kBuckets = 11;
+
+  void Run() {
+    std::vector<pendingWrite> group;
+    std::vector<const storageBatch*> batches;
+    auto next_report = std::chrono::steady_clock::now() + stats_interval_;
+
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+      cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      // Keep the window open for more writers.
+      cv_.wait_until(lock, first_arrival_ + max_delay_, [this] {
+        return stop_ || queued_bytes_ >= max_bytes_;
+      });
+
+      // Take one group, writes left behind are already late.
+      size_t bytes = 0;
+      while (!queue_.empty() &&
+             (group.empty() || bytes + queue_.front().bytes <= max_bytes_)) {
+        bytes += queue_.front().bytes;
+        queued_bytes_ -= queue_.front().bytes;
+        group.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+      }
+      lock.unlock();
+
+      // Readers go to the engine while the group is written.
+      batches.clear();
+      for (const pendingWrite& write : group) {
+        cache_->Invalidate(*write.batch);
+        batches.push_back(write.batch);
+      }
+      auto start = std::chrono::steady_clock::now();
+      leveldb::Status status = db_->Write(batches, sync_);
+      commit_latency_->ObserveSince(start);
+      if (status.ok()) {
+        for (const pendingWrite& write : group) {
+          cache_->Apply(*write.batch);
+        }
+      }
+      record(group.size(), bytes);
+      for (pendingWrite& write : group) {
+        write.done(status);
+      }
+      group.clear();
+
+      if (stats_interval_.count() > 0 &&
+          std::chrono::steady_clock::now() >= next_report) {
+        KV_LOG(kLogInfo) << "Group commit: " << Stats();
+        next_report = std::chrono::steady_clock::now() + stats_interval_;
+      }
+      lock.lock();
+    }
+  }
+
+  void record(size_t writes, size_t bytes) {
+    commits_->Add();
+    writes_->Add(writes);
+    bytes_->Add(bytes);
+    int bucket = 0;
+    while (bucket + 1 < kBuckets && (size_t{1} << (bucket + 1)) <= writes) {
+      ++bucket;
+    }
+    size_buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  storageEngine* db_;
+  rowCache* cache_;
+  const bool sync_;
+  const size_t max_bytes_;
+  const std::chrono::microseconds max_delay_;
+  const std::chrono::seconds stats_interval_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<pendingWrite> queue_;
+  size_t queued_bytes_ = 0;
+  std::chrono::steady_clock::time_point first_arrival_;
+  bool stop_ = false;
+
+  metricsCounter* commits_ = globalMetrics().Counter(
+      "kv_worker_commits_total", "Group commits written to the engine");
+  metricsCounter* writes_ = globalMetrics().Counter(
+      "kv_worker_commit_writes_total", "Writes carried by the group commits");
+  metricsCounter* bytes_ = globalMetrics().Counter(
+      "kv_worker_commit_bytes_total", "Bytes carried by the group commits");
+  metricsHistogram* commit_latency_ = globalMetrics().Histogram(
+      "kv_worker_commit_seconds", "Time the engine took to write a group");
+  std::atomic<uint64_t> size_buckets_[kBuckets] = {};
+
+  std::thread thread_;
+};
+
+//! @brief Get the socket of a worker from its port.
+std::string getWorkerSocket(uint16_t port) {
+  return absl::GetFlag(FLAGS_addr) + ":" + std::to_string(port);
+}
+
+//! @brief Stage an update into a write batch.
+void applyUpdate(const updateNotice& notice, storageBatch* batch) {
+  if (notice.method() == "del") {
+    batch->Delete(notice.key());
+  } else {
+    batch->Put(notice.key(), notice.value());
+  }
+}
+
+//! @brief Keys starting with a NUL byte are the worker's own : the chunks of
+//!        the values streamed in with PutStream and their manifests.
+//!        Clients cannot use them.
+bool reservedKey(const leveldb::Slice& key) {
+  return !key.empty() && key[0] == '\0';
+}
+
+//! @brief Where the manifest of a chunked value is stored.
+std::string manifestKey(const std::string& key) {
+  return std::string("\0m", 2) + key;
+}
+
+//! @brief Where a chunk of a value is stored : the key, length-prefixed,
+//!        then the value's generation and the chunk index, as fixed-width
+//!        hex so that the stored key stays valid UTF-8 in updateNotice.
+std::string chunkKey(const std::string& key, uint64_t generation,
+                     uint64_t index) {
+  return std::string("\0c", 2) +
+      absl::StrFormat("%08x%s%016x%016x", key.size(), key, generation, index);
+}
+
+//! @brief The client key a stored key belongs to : the key the copies of
+//!        a chunk or a manifest are placed by on the hash ring.
+std::string placementKey(const std::string& stored) {
+  if (!reservedKey(stored) || stored.size() < 2) {
+    return stored;
+  }
+  if (stored[1] == 'm') {
+    return stored.substr(2);
+  }
+  if (stored[1] == 'c' && stored.size() >= 10) {
+    size_t size = std::strtoul(stored.substr(2, 8).c_str(), nullptr, 16);
+    return stored.substr(10, size);
+  }
+  return stored;
+}
+
+//! @brief Spreader Client End ---> Replica Worker
+//! 
+//! @details One long-lived Replicate stream to a replica. Updates are
+//!          pipelined : Send only puts the update on the stream, and the
+//!          replica's acks, which come back in order, are matched by sequence
+//!          number on a reader thread. A broken stream fails its pending
+//!          updates and is reopened by the next Send.
 class workerSpreaderClient {
  public:
+  using Callback = std::function<void(bool)>;
+
   workerSpreaderClient(std::shared_ptr<Channel> channel)
       : stub_(workerSpreader::NewStub(channel)) {}
 
-  std::string Spread(const bool rollBackFlag, const std::string method,
-                     const std::string& key, const std::string& value) {
-    updateNotice request;
-    request.set_rollbackflag(rollBackFlag);
-    request.set_method(method);
-    request.set_key(key);
-    request.set_value(value);
+  ~workerSpreaderClient() {
+    std::lock_guard<std::mutex> write_lock(write_mu_);
+    close();
+  }
 
-    updateResponse response;
+  //! @brief Stream an update to the replica.
+  //! 
+  //! @param done : runs with true once the replica applied the update, with
+  //!               false if the stream broke first.
+  void Send(updateNotice notice, Callback done) {
+    std::lock_guard<std::mutex> write_lock(write_mu_);
+    std::unique_lock<std::mutex> lock(mu_);
+    if (stream_ == nullptr || broken_) {
+      lock.unlock();
+      close();
+      open();
+      lock.lock();
+    }
+    notice.set_seq(++seq_);
+    pending_.emplace_back(notice.seq(), std::move(done));
+    lock.unlock();
 
-    ClientContext context;
+    // A failed write ends the stream : the reader fails the pending updates.
+    stream_->Write(notice);
+  }
 
-    // actual rpc
-    Status status = stub_->Spread(&context, request, &response);
+ private:
+  //! @brief Called with write_mu_ held.
+  void open() {
+    context_.reset(new ClientContext);
+    stream_ = stub_->Replicate(context_.get());
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      broken_ = false;
+    }
+    reader_ = std::thread(&workerSpreaderClient::readAcks, this,
+                          stream_.get());
+  }
 
-    return "null";
+  //! @brief Called with write_mu_ held.
+  void close() {
+    if (stream_ == nullptr) {
+      return;
+    }
+    context_->TryCancel();
+    reader_.join();
+    stream_->Finish();
+    stream_.reset();
+  }
+
+  void readAcks(grpc::ClientReaderWriter<updateNotice, updateResponse>* stream) {
+    updateResponse ack;
+    while (stream->Read(&ack)) {
+      Callback done;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (!pending_.empty() && pending_.front().first == ack.seq()) {
+          done = std::move(pending_.front().second);
+          pending_.pop_front();
+        }
+      }
+      if (done) {
+        done(!ack.error());
+      }
+    }
+
+    std::deque<std::pair<uint64_t, Callback>> failed;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      broken_ = true;
+      failed.swap(pending_);
+    }
+    for (auto& update : failed) {
+      update.second(false);
+    }
   }
 
- private:
   std::unique_ptr<workerSpreader::Stub> stub_;
+
+  //!< Serializes the writers, and the reopening of the stream.
+  std::mutex write_mu_;
+  std::unique_ptr<ClientContext> context_;
+  std::unique_ptr<grpc::ClientReaderWriter<updateNotice, updateResponse>>
+      stream_;
+  std::thread reader_;
+  uint64_t seq_ = 0;
+
+  std::mutex mu_;
+  //!< Updates waiting for their ack, in sequence order.
+  std::deque<std::pair<uint64_t, Callback>> pending_;
+  bool broken_ = false;
 };
 
-// Spreader Server End
+//! @brief Replication streams of this worker, one per replica it feeds.
+class replicator {
+ public:
+  void Send(uint16_t port, const updateNotice& notice,
+            workerSpreaderClient::Callback done) {
+    workerSpreaderClient* link;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      std::unique_ptr<workerSpreaderClient>& entry = links_[port];
+      if (entry == nullptr) {
+        entry.reset(new workerSpreaderClient(grpc::CreateChannel(
+            getWorkerSocket(port), grpc::InsecureChannelCredentials())));
+      }
+      link = entry.get();
+    }
+    link->Send(notice, std::move(done));
+  }
+
+ private:
+  std::mutex mu_;
+  std::unordered_map<uint16_t, std::unique_ptr<workerSpreaderClient>> links_;
+};
+
+//! @brief Latest write of every owner this worker applied as its replica.
+class replicaProgress {
+ public:
+  void Applied(uint16_t origin, uint64_t seq) {
+    std::lock_guard<std::mutex> lock(mu_);
+    uint64_t& applied = applied_[origin];
+    applied = std::max(applied, seq);
+  }
+
+  uint64_t Get(uint16_t origin) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = applied_.find(origin);
+    return it == applied_.end() ? 0 : it->second;
+  }
+
+ private:
+  mutable std::mutex mu_;
+  std::unordered_map<uint16_t, uint64_t> applied_;
+};
+
+//! @brief Spreader Server End <--- Owner Worker
+//! 
+//! @details Applies the updates of the keys this worker is a replica of.
 class workerSpreaderServiceImpl final : public workerSpreader::Service {
+ public:
+  workerSpreaderServiceImpl(groupCommitter* committer,
+                            replicaProgress* progress)
+      : committer_(committer), progress_(progress) {}
+
+ private:
+  Status Spread(ServerContext* context, const updateNotice* request,
+                updateResponse* response) override {
+    storageBatch batch;
+    applyUpdate(*request, &batch);
+    leveldb::Status status = committer_->Write(&batch);
+    if (status.ok()) {
+      progress_->Applied(request->origin(), request->commit_seq());
+    }
+    response->set_seq(request->seq());
+    response->set_error(!status.ok());
+    response->set_message(status.ok() ? "Spread successfully!"
+                                      : status.ToString());
+    return Status::OK;
+  }
+
+  //! @brief Apply a stream of updates, acking each once it is committed.
+  //! 
+  //! @details Updates are submitted to the group committer as they arrive
+  //!          and acked in order from its callbacks by a writer thread, so
+  //!          the owner never waits for one update before sending the next.
+  Status Replicate(ServerContext* context,
+                   ServerReaderWriter<updateResponse, updateNotice>* stream)
+      override {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<updateResponse> acks;
+    int outstanding = 0;
+    bool reading = true;
+
+    std::thread writer([&] {
+      std::unique_lock<std::mutex> lock(mu);
+      bool ok = true;
+      while (true) {
+        cv.wait(lock, [&] {
+          return !acks.empty() || (!reading && outstanding == 0);
+        });
+        if (acks.empty()) {
+          return;
+        }
+        updateResponse ack = std::move(acks.front());
+        acks.pop_front();
+        outstanding -= 1;
+        lock.unlock();
+        ok = ok && stream->Write(ack);
+        lock.lock();
+      }
+    });
+
+    updateNotice notice;
+    while (stream->Read(&notice)) {
+      if (notice.rollbackflag()) {
+        KV_LOG(kLogInfo) << "Rollback: " << notice.key();
+      }
+      auto batch = new storageBatch;
+      applyUpdate(notice, batch);
+      uint64_t seq = notice.seq();
+      uint16_t origin = notice.origin();
+      uint64_t commit_seq = notice.commit_seq();
+      {
+        std::lock_guard<std::mutex> lock(mu);
+        outstanding += 1;
+      }
+      committer_->Submit(batch, [&, batch, seq, origin,
+                                 commit_seq](const leveldb::Status& status) {
+        delete batch;
+        if (status.ok()) {
+          progress_->Applied(origin, commit_seq);
+        }
+        updateResponse ack;
+        ack.set_seq(seq);
+        ack.set_error(!status.ok());
+        if (!status.ok()) {
+          ack.set_message(status.ToString());
+        }
+        // Notify under the lock : the handler returns as soon as the last
+        // ack is out.
+        std::lock_guard<std::mutex> lock(mu);
+        acks.push_back(std::move(ack));
+        cv.notify_one();
+      });
+    }
 
+    // Ack what is still being committed before closing the stream.
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      reading = false;
+    }
+    cv.notify_one();
+    writer.join();
+    return Status::OK;
+  }
+
+  groupCommitter* committer_;
+  replicaProgress* progress_;
 };
 
+//!< kvMethods with Get, Put and Del taken over by the kvAsyncEngine.
+using kvMethodsAsyncBase = kvMethods::WithAsyncMethod_Get<
+    kvMethods::WithAsyncMethod_Put<kvMethods::WithAsyncMethod_Del<
+        kvMethods::Service>>>;
+
 //! @brief KV Server End <--- Master Server
 //! 
-class kvMethodsServiceImpl final : public kvMethods::Service {
-  // Status Get()
+//! @details Serves the keys this worker owns from its own storage engine,
+//!          writes are copied to the keys' replicas. Get, Put and Del are
+//!          called by the kvAsyncEngine, the other methods by gRPC's sync
+//!          server.
+class kvMethodsServiceImpl final : public kvMethodsAsyncBase {
+ public:
+  kvMethodsServiceImpl(storageEngine* db, rowCache* cache,
+                       groupCommitter* committer, replicator* replicas,
+                       replicaProgress* progress, uint16_t port)
+      : db_(db), cache_(cache), committer_(committer), replicas_(replicas),
+        progress_(progress), port_(port),
+        // Start past the seqs of an earlier run on this port.
+        write_seq_(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count()) {}
+
+ private:
+  //! @brief A request routed by the client itself must reach the key's
+  //!        owner, else the client's routing table is out of date.
+  bool misrouted(const KVRequest& request) const {
+    return request.routing_version() != 0 &&
+        hash_ring.Owner(request.key()) != port_;
+  }
+
+  static Status staleRouting() {
+    return Status(grpc::StatusCode::FAILED_PRECONDITION, "stale routing");
+  }
+
+  static Status reservedKeyError() {
+    return Status(grpc::StatusCode::INVALID_ARGUMENT,
+                  "keys starting with a NUL byte are reserved");
+  }
+
+  //! @brief Read the manifest of the key's chunked value.
+  //!
+  //! @return NotFound if the key has no chunked value.
+  leveldb::Status readManifest(const storageReadOptions& options,
+                               const std::string& key,
+                               ChunkManifest* manifest) {
+    std::string bytes;
+    leveldb::Status status = db_->Get(options, manifestKey(key), &bytes);
+    if (status.ok() && !manifest->ParseFromString(bytes)) {
+      return leveldb::Status::Corruption("Bad chunk manifest of", key);
+    }
+    return status;
+  }
+
+  //! @brief Queue the deletes of the key's chunked value, if any. Called
+  //!        with the key's manifest stripe held.
+  //!
+  //! @return NotFound if the key has no chunked value.
+  leveldb::Status dropChunks(const storageReadOptions& options,
+                             const std::string& key,
+                             std::vector<updateNotice>* updates) {
+    ChunkManifest manifest;
+    leveldb::Status status = readManifest(options, key, &manifest);
+    if (!status.ok()) {
+      return status;
+    }
+    updates->emplace_back();
+    updates->back().set_method("del");
+    updates->back().set_key(manifestKey(key));
+    for (uint64_t i = 0; i < manifest.chunks(); ++i) {
+      updates->emplace_back();
+      updates->back().set_method("del");
+      updates->back().set_key(chunkKey(key, manifest.generation(), i));
+    }
+    return status;
+  }
+
+  //! @brief `replicatedWrite` of plain puts that replace the chunked
+  //!        values of their keys, if any : the chunks are dropped in the
+  //!        same write.
+  //!
+  //! @param updates : the puts, as they were passed once done.
+  leveldb::Status putWrite(std::vector<updateNotice>& updates,
+                           uint64_t* seq) {
+    std::vector<std::string> keys;
+    keys.reserve(updates.size());
+    for (const updateNotice& update : updates) {
+      keys.push_back(update.key());
+    }
+    std::vector<std::unique_lock<std::mutex>> locked = lockManifests(keys);
+    const size_t puts = updates.size();
+    leveldb::Status status;
+    for (size_t i = 0; i < puts && status.ok(); ++i) {
+      status = dropChunks(storageReadOptions(), keys[i], &updates);
+      if (status.IsNotFound()) {
+        status = leveldb::Status::OK();
+      }
+    }
+    if (status.ok()) {
+      status = replicatedWrite(updates, seq);
+    }
+    updates.erase(updates.begin() + puts, updates.end());
+    return status;
+  }
+
+ public:
+  Status Get(ServerContext* context, const KVRequest* request,
+             KVResponse* response) override {
+    if (reservedKey(request->key())) {
+      return reservedKeyError();
+    }
+    if (request->read_policy() == distributedKV::PRIMARY &&
+        misrouted(*request)) {
+      return staleRouting();
+    }
+    // A replica serves a bounded-staleness read once it applied min_seq.
+    if (request->read_policy() == distributedKV::BOUNDED_STALENESS) {
+      uint16_t owner = hash_ring.Owner(request->key());
+      if (owner != port_ && progress_->Get(owner) < request->min_seq()) {
+        response->set_message("Replica is behind.");
+        response->set_stale(true);
+        return Status::OK;
+      }
+    }
+
+    // Hot rows come from the row cache, misses load it.
+    leveldb::Status status;
+    if (!cache_->Lookup(request->key(), response->mutable_value())) {
+      uint64_t epoch = cache_->Epoch(request->key());
+      status = db_->Get(storageReadOptions(), request->key(),
+                        response->mutable_value());
+      if (status.ok()) {
+        cache_->Fill(request->key(), response->value(), epoch);
+      }
+    }
+
+    if (status.IsNotFound()) {
+      // The bloom filter keeps this cheap for keys that do not exist.
+      ChunkManifest manifest;
+      if (readManifest(storageReadOptions(), request->key(), &manifest)
+              .ok()) {
+        response->set_message("Value of " + std::to_string(manifest.size()) +
+                              " bytes is chunked, read it with GetStream.");
+        response->set_error(true);
+        return Status::OK;
+      }
+    }
+
+    if (status.ok()) {
+      response->set_message("Get successfully!");
+    } else if (status.IsNotFound()) {
+      response->set_message("Key not found.");
+    } else {
+      response->set_message(status.ToString());
+      response->set_error(true);
+    }
+    return Status::OK;
+  }
+
+  Status Put(ServerContext* context, const KVRequest* request,
+             KVResponse* response) override {
+    if (reservedKey(request->key())) {
+      return reservedKeyError();
+    }
+    if (misrouted(*request)) {
+      return staleRouting();
+    }
+    std::vector<updateNotice> updates(1);
+    updates[0].set_method("put");
+    updates[0].set_key(request->key());
+    updates[0].set_value(request->value());
+    uint64_t seq;
+    leveldb::Status status = putWrite(updates, &seq);
+
+    if (status.ok()) {
+      // The written value is echoed back, moved out of the notice.
+      response->set_message("Put successfully!");
+      response->set_value(std::move(*updates[0].mutable_value()));
+      response->set_seq(seq);
+    } else {
+      response->set_message(status.ToString());
+      response->set_error(true);
+    }
+    return Status::OK;
+  }
+
+  Status Del(ServerContext* context, const KVRequest* request,
+             KVResponse* response) override {
+    if (reservedKey(request->key())) {
+      return reservedKeyError();
+    }
+    if (misrouted(*request)) {
+      return staleRouting();
+    }
+    // Reply with the deleted value, a chunked one is dropped with it.
+    std::vector<std::unique_lock<std::mutex>> locked =
+        lockManifests({request->key()});
+    std::vector<updateNotice> updates;
+    leveldb::Status status =
+        db_->Get(storageReadOptions(), request->key(),
+                 response->mutable_value());
+    if (status.ok()) {
+      updates.emplace_back();
+      updates.back().set_method("del");
+      updates.back().set_key(request->key());
+    }
+    if (status.ok() || status.IsNotFound()) {
+      leveldb::Status chunked =
+          dropChunks(storageReadOptions(), request->key(), &updates);
+      // Found if either is, failed if either failed.
+      if (!chunked.IsNotFound() && (status.IsNotFound() || !chunked.ok())) {
+        status = chunked;
+      }
+    }
+    if (status.IsNotFound()) {
+      response->set_message("Key not found.");
+      return Status::OK;
+    }
+    uint64_t seq = 0;
+    if (status.ok()) {
+      status = replicatedWrite(updates, &seq);
+    }
+
+    if (status.ok()) {
+      response->set_message("Delete successfully!");
+      response->set_seq(seq);
+    } else {
+      response->set_message(status.ToString());
+      response->set_error(true);
+    }
+    return Status::OK;
+  }
+
+ private:
+  //! @brief Read every key under a single snapshot.
+  Status MultiGet(ServerContext* context, const MultiKVRequest* request,
+                  MultiKVResponse* response) override {
+    for (const KVRequest& entry : request->requests()) {
+      if (reservedKey(entry.key())) {
+        return reservedKeyError();
+      }
+    }
+    storageReadOptions options;
+    options.snapshot = db_->GetSnapshot();
+
+    for (const KVRequest& entry : request->requests()) {
+      KVResponse* reply = response->add_responses();
+      leveldb::Status status =
+          db_->Get(options, entry.key(), reply->mutable_value());
+      ChunkManifest manifest;
+      if (status.ok()) {
+        reply->set_message("Get successfully!");
+      } else if (status.IsNotFound() &&
+                 readManifest(options, entry.key(), &manifest).ok()) {
+        reply->set_message("Value of " + std::to_string(manifest.size()) +
+                           " bytes is chunked, read it with GetStream.");
+        reply->set_error(true);
+      } else if (status.IsNotFound()) {
+        reply->set_message("Key not found.");
+      } else {
+        reply->set_message(status.ToString());
+        reply->set_error(true);
+        response->set_error(true);
+      }
+    }
+
+    db_->ReleaseSnapshot(options.snapshot);
+    response->set_message(response->error() ? "Batch failed." : "Batch done!");
+    return Status::OK;
+  }
+
+  //! @brief Apply every put as one atomic write.
+  Status MultiPut(ServerContext* context, const MultiKVRequest* request,
+                  MultiKVResponse* response) override {
+    for (const KVRequest& entry : request->requests()) {
+      if (reservedKey(entry.key())) {
+        return reservedKeyError();
+      }
+    }
+    std::vector<updateNotice> updates(request->requests_size());
+    for (int i = 0; i < request->requests_size(); ++i) {
+      updates[i].set_method("put");
+      updates[i].set_key(request->requests(i).key());
+      updates[i].set_value(request->requests(i).value());
+    }
+    uint64_t seq;
+    leveldb::Status status = putWrite(updates, &seq);
+
+    for (updateNotice& update : updates) {
+      KVResponse* reply = response->add_responses();
+      if (status.ok()) {
+        reply->set_message("Put successfully!");
+        reply->set_value(std::move(*update.mutable_value()));
+        reply->set_seq(seq);
+      } else {
+        reply->set_message(status.ToString());
+        reply->set_error(true);
+      }
+    }
+    response->set_error(!status.ok());
+    response->set_message(status.ok() ? "Batch done!" : status.ToString());
+    return Status::OK;
+  }
+
+  //! @brief Read the old values under a snapshot, then delete the found keys
+  //!        as one atomic write.
+  Status MultiDel(ServerContext* context, const MultiKVRequest* request,
+                  MultiKVResponse* response) override {
+    std::vector<std::string> keys;
+    for (const KVRequest& entry : request->requests()) {
+      if (reservedKey(entry.key())) {
+        return reservedKeyError();
+      }
+      keys.push_back(entry.key());
+    }
+    std::vector<std::unique_lock<std::mutex>> locked = lockManifests(keys);
+    storageReadOptions options;
+    options.snapshot = db_->GetSnapshot();
+
+    std::vector<updateNotice> updates;
+    leveldb::Status status;
+    for (const KVRequest& entry : request->requests()) {
+      KVResponse* reply = response->add_responses();
+      leveldb::Status found =
+          db_->Get(options, entry.key(), reply->mutable_value());
+      if (found.ok()) {
+        updates.emplace_back();
+        updates.back().set_method("del");
+        updates.back().set_key(entry.key());
+      }
+      if (found.ok() || found.IsNotFound()) {
+        leveldb::Status chunked = dropChunks(options, entry.key(), &updates);
+        if (!chunked.IsNotFound() && (found.IsNotFound() || !chunked.ok())) {
+          found = chunked;
+        }
+      }
+      if (found.IsNotFound()) {
+        reply->set_message("Key not found.");
+      } else if (!found.ok() && status.ok()) {
+        status = found;
+      }
+    }
+    db_->ReleaseSnapshot(options.snapshot);
+    uint64_t seq = 0;
+    if (status.ok()) {
+      status = replicatedWrite(updates, &seq);
+    }
+
+    for (KVResponse& reply : *response->mutable_responses()) {
+      if (!status.ok()) {
+        reply.set_message(status.ToString());
+        reply.set_error(true);
+      } else if (reply.message().empty()) {
+        reply.set_message("Delete successfully!");
+        reply.set_seq(seq);
+      }
+    }
+    response->set_error(!status.ok());
+    response->set_message(status.ok() ? "Batch done!" : status.ToString());
+    return Status::OK;
+  }
+
+  //! @brief Ingest a stream of entries in large write batches.
+  Status BulkLoad(ServerContext* context, ServerReader<KVRequest>* reader,
+                  BulkLoadResponse* response) override {
+    const size_t batch_bytes =
+        static_cast<size_t>(absl::GetFlag(FLAGS_bulk_batch_kb)) << 10;
+    std::vector<updateNotice> updates;
+    size_t bytes = 0;
+    leveldb::Status status;
+    int64_t count = 0;
+
+    KVRequest entry;
+    while (reader->Read(&entry)) {
+      if (reservedKey(entry.key())) {
+        status = leveldb::Status::InvalidArgument("Reserved key");
+        break;
+      }
+      bytes += entry.key().size() + entry.value().size();
+      updates.emplace_back();
+      updates.back().set_method("put");
+      updates.back().set_key(std::move(*entry.mutable_key()));
+      updates.back().set_value(std::move(*entry.mutable_value()));
+      if (bytes >= batch_bytes) {
+        status = putWrite(updates, nullptr);
+        if (!status.ok()) {
+          break;
+        }
+        count += updates.size();
+        updates.clear();
+        bytes = 0;
+      }
+    }
+    if (status.ok() && !updates.empty()) {
+      status = putWrite(updates, nullptr);
+      if (status.ok()) {
+        count += updates.size();
+      }
+    }
+
+    response->set_count(count);
+    response->set_error(!status.ok());
+    response->set_message(status.ok() ? "Bulk load done!" : status.ToString());
+    return Status::OK;
+  }
+
+  //! @brief Stream the owned keys of a range in key order from a snapshot.
+  //! 
+  //! @details Each Write blocks until the stream has room, so a slow reader
+  //!          holds back the iterator instead of piling entries up here.
+  Status Scan(ServerContext* context, const ScanRequest* request,
+              ServerWriter<KVEntry>* writer) override {
+    const std::string& prefix = request->prefix();
+    const std::string& end = request->end();
+    // Start past the reserved keys, chunked values are not listed.
+    std::string start = std::max({request->start(), prefix,
+                                  std::string("\1", 1)});
+
+    storageReadOptions options;
+    options.snapshot = db_->GetSnapshot();
+    options.fill_cache = false;
+    std::unique_ptr<storageIterator> it(db_->NewIterator(options));
+
+    int64_t count = 0;
+    KVEntry entry;
+    for (it->Seek(start); it->Valid(); it->Next()) {
+      leveldb::Slice key = it->key();
+      if (!end.empty() && key.compare(end) >= 0) {
+        break;
+      }
+      if (!key.starts_with(prefix)) {
+        break;
+      }
+      if (context->IsCancelled()) {
+        break;
+      }
+      // Replicated keys are streamed by their owner.
+      if (hash_ring.Owner(key.ToString()) != port_) {
+        continue;
+      }
+      entry.set_key(key.data(), key.size());
+      entry.set_value(it->value().data(), it->value().size());
+      if (!writer->Write(entry)) {
+        break;
+      }
+      if (++count == request->limit()) {
+        break;
+      }
+    }
+
+    leveldb::Status status = it->status();
+    it.reset();
+    db_->ReleaseSnapshot(options.snapshot);
+    if (!status.ok()) {
+      return Status(grpc::StatusCode::INTERNAL, status.ToString());
+    }
+    return Status::OK;
+  }
+
+  //! @brief Store a value sent in chunks.
+  //!
+  //! @details Every chunk is written, and copied to the replicas, as it
+  //!          arrives, under a new generation of the key : one chunk at a
+  //!          time is held here. Once the last one is in, a single write
+  //!          points the manifest at the new generation and drops the plain
+  //!          entry and the previous chunks, so readers see the old value
+  //!          or the new one. A stream that ends without its last chunk
+  //!          leaves nothing behind.
+  Status PutStream(ServerContext* context, ServerReader<ValueChunk>* reader,
+                   KVResponse* response) override {
+    ValueChunk chunk;
+    if (!reader->Read(&chunk)) {
+      return Status(grpc::StatusCode::INVALID_ARGUMENT, "Empty stream");
+    }
+    const std::string key = chunk.key();
+    if (reservedKey(key)) {
+      return reservedKeyError();
+    }
+
+    thread_local std::mt19937_64 rng(std::random_device{}());
+    const uint64_t generation = rng();
+    uint64_t chunks = 0;
+    uint64_t size = 0;
+    bool last = false;
+    leveldb::Status status;
+    do {
+      last = chunk.last();
+      if (chunk.data().empty()) {
+        continue;
+      }
+      std::vector<updateNotice> updates(1);
+      updates[0].set_method("put");
+      updates[0].set_key(chunkKey(key, generation, chunks));
+      size += chunk.data().size();
+      updates[0].set_value(std::move(*chunk.mutable_data()));
+      status = replicatedWrite(updates, nullptr);
+      if (!status.ok()) {
+        break;
+      }
+      chunks += 1;
+    } while (!last && reader->Read(&chunk));
+
+    if (status.ok() && !last) {
+      status = leveldb::Status::InvalidArgument(
+          "Stream ended before its last chunk");
+    }
+    uint64_t seq = 0;
+    if (status.ok()) {
+      std::vector<std::unique_lock<std::mutex>> locked = lockManifests({key});
+      ChunkManifest manifest;
+      manifest.set_generation(generation);
+      manifest.set_chunks(chunks);
+      manifest.set_size(size);
+      std::vector<updateNotice> updates(2);
+      updates[0].set_method("put");
+      updates[0].set_key(manifestKey(key));
+      manifest.SerializeToString(updates[0].mutable_value());
+      updates[1].set_method("del");
+      updates[1].set_key(key);
+      leveldb::Status previous =
+          dropChunks(storageReadOptions(), key, &updates);
+      // The old manifest is replaced, not deleted.
+      if (previous.ok()) {
+        updates.erase(updates.begin() + 2);
+      }
+      status = replicatedWrite(updates, &seq);
+    }
+
+    if (!status.ok()) {
+      std::vector<updateNotice> updates(chunks);
+      for (uint64_t i = 0; i < chunks; ++i) {
+        updates[i].set_method("del");
+        updates[i].set_key(chunkKey(key, generation, i));
+      }
+      replicatedWrite(updates, nullptr);
+      response->set_message(status.ToString());
+      response->set_error(true);
+      return Status::OK;
+    }
+    response->set_message("Put " + std::to_string(size) + " bytes in " +
+                          std::to_string(chunks) + " chunks successfully!");
+    response->set_seq(seq);
+    return Status::OK;
+  }
+
+  //! @brief Stream a value out in chunks from a snapshot. A chunked value
+  //!        is read one chunk at a time, each sent before the next is read.
+  Status GetStream(ServerContext* context, const KVRequest* request,
+                   ServerWriter<ValueChunk>* writer) override {
+    if (reservedKey(request->key())) {
+      return reservedKeyError();
+    }
+    if (misrouted(*request)) {
+      return staleRouting();
+    }
+    const std::string& key = request->key();
+    storageReadOptions options;
+    options.snapshot = db_->GetSnapshot();
+    options.fill_cache = false;
+
+    ValueChunk chunk;
+    chunk.set_key(key);
+    std::string value;
+    leveldb::Status status = db_->Get(options, key, &value);
+    if (status.ok()) {
+      // A plain value is cut up here.
+      const size_t step = static_cast<size_t>(std::max(
+          1, absl::GetFlag(FLAGS_stream_chunk_kb))) << 10;
+      chunk.set_size(value.size());
+      size_t offset = 0;
+      do {
+        chunk.set_data(value.substr(offset, step));
+        offset += step;
+        chunk.set_last(offset >= value.size());
+        if (!writer->Write(chunk)) {
+          break;
+        }
+        chunk.clear_key();
+        chunk.clear_size();
+      } while (offset < value.size());
+    } else if (status.IsNotFound()) {
+      ChunkManifest manifest;
+      status = readManifest(options, key, &manifest);
+      if (status.ok()) {
+        chunk.set_size(manifest.size());
+      }
+      for (uint64_t i = 0; status.ok() && i < manifest.chunks(); ++i) {
+        status = db_->Get(options, chunkKey(key, manifest.generation(), i),
+                          chunk.mutable_data());
+        if (status.IsNotFound()) {
+          status = leveldb::Status::Corruption("Missing chunk of", key);
+        }
+        chunk.set_last(i + 1 == manifest.chunks());
+        if (!status.ok() || !writer->Write(chunk)) {
+          break;
+        }
+        chunk.clear_key();
+        chunk.clear_size();
+      }
+    }
+    db_->ReleaseSnapshot(options.snapshot);
+
+    if (status.IsNotFound()) {
+      return Status(grpc::StatusCode::NOT_FOUND, "Key not found.");
+    }
+    if (!status.ok()) {
+      return Status(grpc::StatusCode::INTERNAL, status.ToString());
+    }
+    return Status::OK;
+  }
+
+  //! @brief Progress of the updates of one write on the replicas.
+  struct replicationRound {
+    std::mutex mu;
+    std::condition_variable cv;
+    //!< Per update : acks, failures, and acks it needs.
+    std::vector<int> acks;
+    std::vector<int> fails;
+    std::vector<int> needed;
+    std::vector<int> copies;
+    size_t reached = 0;
+    bool failed = false;
+  };
+
+  //! @brief Get the workers holding a copy of the key, but this one.
+  std::vector<uint16_t> replicasOf(const std::string& key) const {
+    std::vector<uint16_t> nodes = hash_ring.GetNodes(
+        key, 1 + std::max(0, absl::GetFlag(FLAGS_replicas)));
+    nodes.erase(std::remove(nodes.begin(), nodes.end(), port_), nodes.end());
+    nodes.resize(std::min<size_t>(nodes.size(),
+                                  std::max(0, absl::GetFlag(FLAGS_replicas))));
+    return nodes;
+  }
+
+  //! @brief Apply the updates here and on the keys' replicas.
+  //! 
+  //! @details The updates are streamed to the replicas while they commit
+  //!          locally. Unless every update is acked by `ack_quorum` replicas
+  //!          before the deadline, the old values are restored here and on
+  //!          the replicas with `rollBackFlag` updates. The key stripes keep
+  //!          other writes of these keys out meanwhile, also those of smart
+  //!          clients that skip the master's key locks.
+  //! 
+  //! @param seq : set to the seq the write got, if not null.
+  leveldb::Status replicatedWrite(std::vector<updateNotice>& updates,
+                                  uint64_t* seq) {
+    std::vector<std::unique_lock<std::mutex>> locked = lockStripes(updates);
+    const int quorum = std::max(0, absl::GetFlag(FLAGS_ack_quorum));
+    const size_t n = updates.size();
+    std::vector<std::vector<uint16_t>> placement(n);
+    auto round = std::make_shared<replicationRound>();
+    round->acks.resize(n);
+    round->fails.resize(n);
+    round->needed.resize(n);
+    round->copies.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      placement[i] = replicasOf(placementKey(updates[i].key()));
+      round->copies[i] = placement[i].size();
+      round->needed[i] = std::min<int>(quorum, placement[i].size());
+      if (round->needed[i] == 0) {
+        round->reached += 1;
+      }
+    }
+
+    storageBatch batch;
+    for (const updateNotice& update : updates) {
+      applyUpdate(update, &batch);
+    }
+    if (round->reached == n) {
+      // No quorum to wait for : send the copies along, if any.
+      sequence(updates, seq, [&] {
+        for (size_t i = 0; i < n; ++i) {
+          for (uint16_t port : placement[i]) {
+            replicas_->Send(port, updates[i], [](bool) {});
+          }
+        }
+      });
+      return committer_->Write(&batch);
+    }
+
+    // Remember the old values to roll back to.
+    std::vector<updateNotice> rollbacks(n);
+    storageReadOptions options;
+    options.snapshot = db_->GetSnapshot();
+    for (size_t i = 0; i < n; ++i) {
+      updateNotice& rollback = rollbacks[i];
+      rollback.set_rollbackflag(true);
+      rollback.set_key(updates[i].key());
+      leveldb::Status found =
+          db_->Get(options, updates[i].key(), rollback.mutable_value());
+      rollback.set_method(found.ok() ? "put" : "del");
+    }
+    db_->ReleaseSnapshot(options.snapshot);
+
+    sequence(updates, seq, [&] {
+      for (size_t i = 0; i < n; ++i) {
+        rollbacks[i].set_origin(port_);
+        rollbacks[i].set_commit_seq(updates[i].commit_seq());
+        for (uint16_t port : placement[i]) {
+          replicas_->Send(port, updates[i], [round, i](bool ok) {
+            std::lock_guard<std::mutex> lock(round->mu);
+            if (ok && ++round->acks[i] == round->needed[i]) {
+              round->reached += 1;
+            } else if (!ok && ++round->fails[i] >
+                                  round->copies[i] - round->needed[i]) {
+              round->failed = true;
+            }
+            round->cv.notify_one();
+          });
+        }
+      }
+    });
+    leveldb::Status status = committer_->Write(&batch);
+
+    bool reached;
+    auto start = std::chrono::steady_clock::now();
+    {
+      std::unique_lock<std::mutex> lock(round->mu);
+      auto deadline = std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(
+              absl::GetFlag(FLAGS_replication_timeout_ms));
+      reached = round->cv.wait_until(lock, deadline, [&] {
+        return round->failed || round->reached == n;
+      }) && !round->failed;
+    }
+    quorum_wait_->ObserveSince(start);
+    if (status.ok() && reached) {
+      return status;
+    }
+
+    // Roll back every copy.
+    rollbacks_->Add();
+    KV_LOG(kLogWarn) << "Rolling back " << n << " updates.";
+    storageBatch undo;
+    for (size_t i = 0; i < n; ++i) {
+      applyUpdate(rollbacks[i], &undo);
+      for (uint16_t port : placement[i]) {
+        replicas_->Send(port, rollbacks[i], [](bool) {});
+      }
+    }
+    committer_->Write(&undo);
+    return status.ok()
+        ? leveldb::Status::IOError("Replication quorum not reached")
+        : status;
+  }
+
+  //! @brief Give the write the next seq and send it out.
+  //! 
+  //! @details Seqs are handed out in the order the updates go on the
+  //!          streams, so a replica that applied a seq applied every
+  //!          earlier one of this owner.
+  template <typename Send>
+  void sequence(std::vector<updateNotice>& updates, uint64_t* seq,
+                Send send) {
+    std::lock_guard<std::mutex> lock(send_mu_);
+    uint64_t next = ++write_seq_;
+    for (updateNotice& update : updates) {
+      update.set_origin(port_);
+      update.set_commit_seq(next);
+    }
+    if (seq != nullptr) {
+      *seq = next;
+    }
+    send();
+  }
+
+  //! @brief Lock the manifest stripes of the keys, in stripe order : a
+  //!        chunked value is switched over or dropped by one writer at a
+  //!        time.
+  std::vector<std::unique_lock<std::mutex>> lockManifests(
+      const std::vector<std::string>& keys) {
+    std::vector<size_t> indices;
+    indices.reserve(keys.size());
+    for (const std::string& key : keys) {
+      indices.push_back(std::hash<std::string>()(key) %
+                        manifest_stripes_.size());
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+    std::vector<std::unique_lock<std::mutex>> locked;
+    locked.reserve(indices.size());
+    for (size_t i : indices) {
+      locked.emplace_back(manifest_stripes_[i]);
+    }
+    return locked;
+  }
+
+  //! @brief Lock the stripes of the updated keys, in stripe order.
+  std::vector<std::unique_lock<std::mutex>> lockStripes(
+      const std::vector<updateNotice>& updates) {
+    std::vector<size_t> indices;
+    indices.reserve(updates.size());
+    for (const updateNotice& update : updates) {
+      indices.push_back(std::hash<std::string>()(update.key()) %
+                        stripes_.size());
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+    std::vector<std::unique_lock<std::mutex>> locked;
+    locked.reserve(indices.size());
+    for (size_t i : indices) {
+      locked.emplace_back(stripes_[i]);
+    }
+    return locked;
+  }
+
+  storageEngine* db_;
+  rowCache* cache_;
+  groupCommitter* committer_;
+  replicator* replicas_;
+  replicaProgress* progress_;
+  //!< This worker's port, its name on the ring.
+  uint16_t port_;
+
+  //!< Per-key write locks, striped.
+  std::array<std::mutex, 64> stripes_;
+  //!< Guard of the chunked values, by key.
+  std::array<std::mutex, 64> manifest_stripes_;
+  metricsHistogram* quorum_wait_ = globalMetrics().Histogram(
+      "kv_worker_quorum_wait_seconds",
+      "Time a write waited for its replica acks after committing locally");
+  metricsCounter* rollbacks_ = globalMetrics().Counter(
+      "kv_worker_rollbacks_total", "Writes rolled back for lack of a quorum");
+  std::mutex send_mu_;
+  uint64_t write_seq_;
+};
+
+//! @brief Completion-queue engine serving Get, Put and Del.
+//!
+//! @details One completion queue per polling thread, each thread pinned to
+//!          a core. Every queue keeps `slots` calls of each method requested
+//!          ahead; the calls are allocated once and re-armed when they
+//!          finish, so serving a request allocates no call state. Gets run
+//!          on the polling thread. Puts and Dels block on the group commit
+//!          and the replicas' acks, they are handed to the write threads to
+//!          keep the queues polled.
+class kvAsyncEngine {
+ public:
+  kvAsyncEngine(kvMethodsServiceImpl* service, int queues, int slots,
+                int write_threads, bool pin)
+      : service_(service),
+        queues_(queues > 0 ? queues
+                           : std::max(1u, std::thread::hardware_concurrency())),
+        slots_(std::max(1, slots)),
+        write_threads_(std::max(1, write_threads)), pin_(pin) {}
+
+  ~kvAsyncEngine() { Shutdown(); }
+
+  //! @brief Serve the queued writes and stop polling, once the server is
+  //!        shut down and before it is destroyed.
+  void Shutdown() {
+    {
+      std::lock_guard<std::mutex> lock(writes_mu_);
+      if (stopping_) {
+        return;
+      }
+      stopping_ = true;
+    }
+    retiring_.store(true, std::memory_order_release);
+    writes_cv_.notify_all();
+    for (std::thread& thread : writers_) {
+      thread.join();
+    }
+    for (auto& cq : cqs_) {
+      cq->Shutdown();
+    }
+    for (std::thread& thread : pollers_) {
+      thread.join();
+    }
+  }
+
+  //! @brief Add the completion queues, before the server is built.
+  void AddCompletionQueues(ServerBuilder* builder) {
+    for (int i = 0; i < queues_; ++i) {
+      cqs_.push_back(builder->AddCompletionQueue());
+    }
+  }
+
+  //! @brief Request the first calls and start polling, once the server is
+  //!        built.
+  void Start() {
+    const int cores = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < queues_; ++i) {
+      ServerCompletionQueue* cq = cqs_[i].get();
+      for (int s = 0; s < slots_; ++s) {
+        for (method m : {kGet, kPut, kDel}) {
+          calls_.emplace_back(new call(this, cq, m));
+          calls_.back()->Request();
+        }
+      }
+    }
+    for (int i = 0; i < write_threads_; ++i) {
+      writers_.emplace_back(&kvAsyncEngine::Write, this);
+    }
+    for (int i = 0; i < queues_; ++i) {
+      pollers_.emplace_back(&kvAsyncEngine::Poll, this, cqs_[i].get());
+      if (pin_) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % cores, &cpus);
+        pthread_setaffinity_np(pollers_.back().native_handle(),
+                               sizeof(cpus), &cpus);
+      }
+    }
+  }
+
+ private:
+  enum method { kGet, kPut, kDel };
+
+  //! @brief One call slot : requested, served, finished, then requested
+  //!        again with its messages cleared.
+  class call {
+   public:
+    call(kvAsyncEngine* engine, ServerCompletionQueue* cq, method m)
+        : engine_(engine), cq_(cq), method_(m) {}
+
+    ~call() {
+      if (rpc_ != nullptr) {
+        rpc_->~rpcState();
+      }
+    }
+
+    //! @brief Ask gRPC for the next call of the method.
+    void Request() {
+      if (rpc_ != nullptr) {
+        rpc_->~rpcState();
+      }
+      // The context and responder cannot be reset, they are rebuilt in
+      // place.
+      rpc_ = new (&storage_) rpcState;
+      request_.Clear();
+      response_.Clear();
+      finishing_ = false;
+      kvMethodsServiceImpl* service = engine_->service_;
+      switch (method_) {
+        case kGet:
+          service->RequestGet(&rpc_->context, &request_, &rpc_->responder,
+                              cq_, cq_, this);
+          break;
+        case kPut:
+          service->RequestPut(&rpc_->context, &request_, &rpc_->responder,
+                              cq_, cq_, this);
+          break;
+        case kDel:
+          service->RequestDel(&rpc_->context, &request_, &rpc_->responder,
+                              cq_, cq_, this);
+          break;
+      }
+    }
+
+    //! @brief Handle the completion of the pending step.
+    //!
+    //! @return false if the queue is shutting down and the slot retires.
+    bool Proceed(bool ok) {
+      if (!ok && !finishing_) {
+        return false;
+      }
+      if (finishing_) {
+        if (engine_->retiring_.load(std::memory_order_acquire)) {
+          return false;
+        }
+        Request();
+        return true;
+      }
+      if (method_ == kGet) {
+        Serve();
+      } else {
+        engine_->Post(this);
+      }
+      return true;
+    }
+
+    //! @brief Run the method and send the reply.
+    void Serve() {
+      kvMethodsServiceImpl* service = engine_->service_;
+      Status status;
+      switch (method_) {
+        case kGet:
+          status = service->Get(&rpc_->context, &request_, &response_);
+          break;
+        case kPut:
+          status = service->Put(&rpc_->context, &request_, &response_);
+          break;
+        case kDel:
+          status = service->Del(&rpc_->context, &request_, &response_);
+          break;
+      }
+      finishing_ = true;
+      if (status.ok()) {
+        rpc_->responder.Finish(response_, status, this);
+      } else {
+        rpc_->responder.FinishWithError(status, this);
+      }
+    }
+
+   private:
+    struct rpcState {
+      ServerContext context;
+      grpc::ServerAsyncResponseWriter<KVResponse> responder{&context};
+    };
+
+    kvAsyncEngine* engine_;
+    ServerCompletionQueue* cq_;
+    const method method_;
+    typename std::aligned_storage<sizeof(rpcState),
+                                  alignof(rpcState)>::type storage_;
+    rpcState* rpc_ = nullptr;
+    KVRequest request_;
+    KVResponse response_;
+    bool finishing_ = false;
+  };
+
+  void Poll(ServerCompletionQueue* cq) {
+    void* tag;
+    bool ok;
+    while (cq->Next(&tag, &ok)) {
+      static_cast<call*>(tag)->Proceed(ok);
+    }
+  }
+
+  //! @brief Queue a write for the write threads.
+  void Post(call* write) {
+    {
+      std::lock_guard<std::mutex> lock(writes_mu_);
+      writes_.push_back(write);
+    }
+    writes_cv_.notify_one();
+  }
+
+  void Write() {
+    std::unique_lock<std::mutex> lock(writes_mu_);
+    while (true) {
+      writes_cv_.wait(lock, [this] { return stopping_ || !writes_.empty(); });
+      if (writes_.empty()) {
+        return;
+      }
+      call* write = writes_.front();
+      writes_.pop_front();
+      lock.unlock();
+      write->Serve();
+      lock.lock();
+    }
+  }
+
+  kvMethodsServiceImpl* service_;
+  const int queues_;
+  const int slots_;
+  const int write_threads_;
+  const bool pin_;
+
+  std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
+  std::vector<std::unique_ptr<call>> calls_;
+  std::vector<std::thread> pollers_;
+
+  std::mutex writes_mu_;
+  std::condition_variable writes_cv_;
+  std::deque<call*> writes_;
+  bool stopping_ = false;
+  std::vector<std::thread> writers_;
+  //!< Set on shutdown, finished calls are no longer requested again.
+  std::atomic<bool> retiring_{false};
 };
 
+//! @brief Build the LevelDB options from the storage flags.
+//! 
+//! @details `block_cache` and `filter_policy` are handed over to the
+//!          leveldbEngine opened with them.
+leveldb::Options storageOptions() {
+  leveldb::Options options;
+  options.create_if_missing = true;
+  options.write_buffer_size =
+      static_cast<size_t>(absl::GetFlag(FLAGS_write_buffer_mb)) << 20;
+  options.block_cache = leveldb::NewLRUCache(
+      static_cast<size_t>(absl::GetFlag(FLAGS_block_cache_mb)) << 20);
+  if (absl::GetFlag(FLAGS_bloom_bits) > 0) {
+    options.filter_policy =
+        leveldb::NewBloomFilterPolicy(absl::GetFlag(FLAGS_bloom_bits));
+  }
+
+  const std::string compression = absl::GetFlag(FLAGS_compression);
+  if (compression == "none") {
+    options.compression = leveldb::kNoCompression;
+  } else if (compression == "zstd") {
+    options.compression = leveldb::kZstdCompression;
+  } else {
+    options.compression = leveldb::kSnappyCompression;
+  }
+
+  if (absl::GetFlag(FLAGS_io_uring)) {
+    leveldb::Env* env = uringEnv::Get();
+    if (env != nullptr) {
+      options.env = env;
+    } else {
+      KV_LOG(kLogWarn) << "io_uring is not available, using POSIX file I/O";
+    }
+  }
+  return options;
+}
+
 //! @brief Server Runtime.
 //! 
 //! @param port : working port
-void RunServer(uint16_t port) {
+//! @param db : storage engine backing the kv service
+//! @param cache : row cache in front of the engine
+//! @param committer : write path of the engine
+void RunServer(uint16_t port, storageEngine* db, rowCache* cache,
+               groupCommitter* committer) {
   std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
   GreeterServiceImpl service;
+  replicator replicas;
+  replicaProgress progress;
+  kvMethodsServiceImpl kvMethods_service(db, cache, committer, &replicas,
+                                         &progress, port);
+  workerSpreaderServiceImpl workerSpreader_service(committer, &progress);
+  workerRegisterServiceImpl workerRegister_service;
 
   grpc::EnableDefaultHealthCheckService(true);
   grpc::reflection::InitProtoReflectionServerBuilderPlugin();
@@ -173,17 +1936,90 @@ void RunServer(uint16_t port) {
   // Register "service" as the instance through which we'll communicate with
   // clients. In this case it corresponds to an *synchronous* service.
   builder.RegisterService(&service);
+  builder.RegisterService(&kvMethods_service);
+  builder.RegisterService(&workerSpreader_service);
+  builder.RegisterService(&workerRegister_service);
+  kvAsyncEngine engine(&kvMethods_service, absl::GetFlag(FLAGS_async_cqs),
+                       absl::GetFlag(FLAGS_async_slots),
+                       absl::GetFlag(FLAGS_write_threads),
+                       absl::GetFlag(FLAGS_pin_threads));
+  engine.AddCompletionQueues(&builder);
+
+  // Time every RPC and serve the metrics on their own port.
+  std::unique_ptr<metricsHttpServer> metrics_server;
+  const uint16_t metrics_port = absl::GetFlag(FLAGS_metrics_port);
+  if (metrics_port != 0) {
+    std::vector<std::unique_ptr<
+        grpc::experimental::ServerInterceptorFactoryInterface>> creators;
+    creators.emplace_back(new rpcMetricsFactory);
+    builder.experimental().SetInterceptorCreators(std::move(creators));
+
+    globalMetrics().AddCollector([db](std::ostream& out) {
+      std::string value;
+      out << "# TYPE kv_worker_leveldb_files gauge\n";
+      for (int level = 0; level < 7; ++level) {
+        if (db->GetProperty("leveldb.num-files-at-level" +
+                                std::to_string(level), &value)) {
+          out << "kv_worker_leveldb_files{level=\"" << level << "\"} "
+              << value << "\n";
+        }
+      }
+      if (db->GetProperty("leveldb.approximate-memory-usage", &value)) {
+        out << "# TYPE kv_worker_leveldb_memory_bytes gauge\n"
+            << "kv_worker_leveldb_memory_bytes " << value << "\n";
+      }
+      // The compaction table as comments, for humans.
+      if (db->GetProperty("leveldb.stats", &value)) {
+        std::istringstream lines(value);
+        std::string line;
+        while (std::getline(lines, line)) {
+          out << "# " << line << "\n";
+        }
+      }
+    });
+    metrics_server.reset(new metricsHttpServer(&globalMetrics()));
+    if (metrics_server->Start(metrics_port)) {
+      KV_LOG(kLogInfo) << "Metrics on 0.0.0.0:" << metrics_port
+                       << "/metrics";
+    } else {
+      KV_LOG(kLogError) << "Cannot serve metrics on port " << metrics_port;
+    }
+  }
+
   // Finally assemble the server.
   std::unique_ptr<Server> server(builder.BuildAndStart());
-  std::cout << "Server listening on " << server_address << std::endl;
+  KV_LOG(kLogInfo) << "Server listening on " << server_address;
+  engine.Start();
+
+  // Contact master for registering, it connects back to us right away,
+  // then keep reporting to it. Reconnect at the heartbeat pace rather than
+  // gRPC's growing backoff, so a restarted master hears from us soon.
+  grpc::ChannelArguments args;
+  args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS,
+              absl::GetFlag(FLAGS_heartbeat_interval_ms));
+  args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS,
+              absl::GetFlag(FLAGS_heartbeat_interval_ms));
+  heartbeatSender heartbeats(
+      grpc::CreateCustomChannel(absl::GetFlag(FLAGS_master),
+                                grpc::InsecureChannelCredentials(), args),
+      port);
 
   // Wait for the server to shutdown. Note that some other thread must be
   // responsible for shutting down the server for this call to ever return.
   server->Wait();
+  engine.Shutdown();
 }
 
 int main(int argc, char** argv) {
   absl::ParseCommandLine(argc, argv);
+  logLevel level;
+  if (!parseLogLevel(absl::GetFlag(FLAGS_log_level), &level)) {
+    std::cerr << "Unknown log level: " << absl::GetFlag(FLAGS_log_level)
+              << std::endl;
+    return 1;
+  }
+  globalLogger().SetLevel(level);
+  hash_ring.SetVirtualNodes(absl::GetFlag(FLAGS_vnodes));
 
   // Generate a random port for this worker to serve.
   std::random_device rd;
@@ -191,21 +2027,40 @@ int main(int argc, char** argv) {
   std::uniform_int_distribution<uint16_t> dist(51051, 55051);
   uint16_t random_port = dist(eng);
   
-  // Init the database
-  leveldb::DB* db;
-  leveldb::Options options;
-  options.create_if_missing = true;
-  std::string database_dir = "/tmp/testdb/" + std::to_string(random_port);
-  leveldb::Status status = leveldb::DB::Open(options, "/tmp/testdb", &db);
-  assert(status.ok());
-  // std::cout << status.ok() << std::endl;
-
-  // Contact master for registering
+  // Init the storage engine
+  std::unique_ptr<storageEngine> db;
+  const std::string engine = absl::GetFlag(FLAGS_engine);
+  if (engine == "memory") {
+    db.reset(new memoryEngine);
+  } else if (engine == "leveldb") {
+    leveldb::Env::Default()->CreateDir(absl::GetFlag(FLAGS_db_dir));
+    std::string database_dir =
+        absl::GetFlag(FLAGS_db_dir) + "/" + std::to_string(random_port);
+    leveldb::Status status =
+        leveldbEngine::Open(storageOptions(), database_dir, &db);
+    if (!status.ok()) {
+      KV_LOG(kLogError) << "Failed to open " << database_dir << ": "
+                        << status.ToString();
+      return 1;
+    }
+  } else {
+    std::cerr << "Unknown storage engine: " << engine << std::endl;
+    return 1;
+  }
 
+  // Row cache and group commit in front of the engine
+  rowCache cache(static_cast<size_t>(
+      std::max(0, absl::GetFlag(FLAGS_row_cache_mb))) << 20);
+  auto committer = std::make_unique<groupCommitter>(
+      db.get(), &cache, absl::GetFlag(FLAGS_sync_writes),
+      static_cast<size_t>(absl::GetFlag(FLAGS_commit_max_batch_kb)) << 10,
+      std::chrono::microseconds(absl::GetFlag(FLAGS_commit_max_delay_us)),
+      std::chrono::seconds(absl::GetFlag(FLAGS_commit_stats_interval_s)));
 
   // Run server
-  RunServer(random_port);
+  RunServer(random_port, db.get(), &cache, committer.get());
 
-  delete db;
+  committer.reset();
+  db.reset();
   return 0;
 }
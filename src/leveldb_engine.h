@@ -0,0 +1,121 @@
+// Storage engine over a LevelDB database on local disk.
+
+#ifndef DISTRIBUTEDKV_LEVELDB_ENGINE_H_
+#define DISTRIBUTEDKV_LEVELDB_ENGINE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "leveldb/cache.h"
+#include "leveldb/db.h"
+#include "leveldb/filter_policy.h"
+#include "leveldb/write_batch.h"
+
+#include "storage_engine.h"
+
+//! @brief storageEngine over leveldb::DB, one-to-one.
+class leveldbEngine final : public storageEngine {
+ public:
+  //! @brief Open, or create, the database in `dir`.
+  //!
+  //! @param options : its `block_cache` and `filter_policy` are owned by
+  //!                  the engine from now on, even if the open fails.
+  static leveldb::Status Open(const leveldb::Options& options,
+                              const std::string& dir,
+                              std::unique_ptr<storageEngine>* engine) {
+    std::unique_ptr<leveldbEngine> opened(new leveldbEngine(options));
+    leveldb::DB* db;
+    leveldb::Status status = leveldb::DB::Open(options, dir, &db);
+    if (status.ok()) {
+      opened->db_.reset(db);
+      *engine = std::move(opened);
+    }
+    return status;
+  }
+
+  ~leveldbEngine() override {
+    db_.reset();
+    delete options_.filter_policy;
+    delete options_.block_cache;
+  }
+
+  leveldb::Status Get(const storageReadOptions& options,
+                      const leveldb::Slice& key, std::string* value) override {
+    return db_->Get(readOptions(options), key, value);
+  }
+
+  leveldb::Status Write(const std::vector<const storageBatch*>& batches,
+                        bool sync) override {
+    leveldb::WriteOptions options;
+    options.sync = sync;
+    if (batches.size() == 1) {
+      // LevelDB only stamps its sequence into the batch's header.
+      return db_->Write(options, const_cast<leveldb::WriteBatch*>(
+                                     &batches.front()->rep()));
+    }
+    leveldb::WriteBatch group;
+    for (const storageBatch* batch : batches) {
+      group.Append(batch->rep());
+    }
+    return db_->Write(options, &group);
+  }
+
+  storageIterator* NewIterator(const storageReadOptions& options) override {
+    return new iterator(db_->NewIterator(readOptions(options)));
+  }
+
+  const storageSnapshot* GetSnapshot() override {
+    return new snapshot(db_->GetSnapshot());
+  }
+
+  void ReleaseSnapshot(const storageSnapshot* released) override {
+    const snapshot* s = static_cast<const snapshot*>(released);
+    db_->ReleaseSnapshot(s->leveldb_snapshot);
+    delete s;
+  }
+
+  bool GetProperty(const leveldb::Slice& property,
+                   std::string* value) override {
+    return db_->GetProperty(property, value);
+  }
+
+ private:
+  struct snapshot : storageSnapshot {
+    explicit snapshot(const leveldb::Snapshot* s) : leveldb_snapshot(s) {}
+    const leveldb::Snapshot* leveldb_snapshot;
+  };
+
+  class iterator final : public storageIterator {
+   public:
+    explicit iterator(leveldb::Iterator* it) : it_(it) {}
+
+    bool Valid() const override { return it_->Valid(); }
+    void Seek(const leveldb::Slice& target) override { it_->Seek(target); }
+    void Next() override { it_->Next(); }
+    leveldb::Slice key() const override { return it_->key(); }
+    leveldb::Slice value() const override { return it_->value(); }
+    leveldb::Status status() const override { return it_->status(); }
+
+   private:
+    std::unique_ptr<leveldb::Iterator> it_;
+  };
+
+  explicit leveldbEngine(const leveldb::Options& options)
+      : options_(options) {}
+
+  static leveldb::ReadOptions readOptions(const storageReadOptions& options) {
+    leveldb::ReadOptions read;
+    read.fill_cache = options.fill_cache;
+    if (options.snapshot != nullptr) {
+      read.snapshot =
+          static_cast<const snapshot*>(options.snapshot)->leveldb_snapshot;
+    }
+    return read;
+  }
+
+  const leveldb::Options options_;
+  std::unique_ptr<leveldb::DB> db_;
+};
+
+#endif  // DISTRIBUTEDKV_LEVELDB_ENGINE_H_
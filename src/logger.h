@@ -0,0 +1,279 @@
+// Asynchronous leveled logger : the calling thread formats its line into a
+// slot of a lock-free ring and moves on, a background thread writes the
+// slots out in batches. Per-request lines are sampled, and levels below
+// KV_LOG_MIN_LEVEL compile to nothing.
+
+#ifndef DISTRIBUTEDKV_LOGGER_H_
+#define DISTRIBUTEDKV_LOGGER_H_
+
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//!< Levels below it are compiled out : 0 debug, 1 info, 2 warn, 3 error.
+#ifndef KV_LOG_MIN_LEVEL
+#define KV_LOG_MIN_LEVEL 1
+#endif
+
+enum logLevel { kLogDebug = 0, kLogInfo = 1, kLogWarn = 2, kLogError = 3 };
+
+//! @brief Parse `debug`, `info`, `warn` or `error`.
+//!
+//! @return false if the name is unknown.
+inline bool parseLogLevel(const std::string& name, logLevel* level) {
+  static const char* names[] = {"debug", "info", "warn", "error"};
+  for (int i = 0; i < 4; ++i) {
+    if (name == names[i]) {
+      *level = static_cast<logLevel>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+//! @brief Ring of formatted lines drained by a flusher thread.
+//!
+//! @details A bounded multi-producer queue (sequence-numbered slots) : a
+//!          producer claims a slot with one CAS and publishes it with one
+//!          store, it never waits. When the ring is full the line is
+//!          dropped and counted, the flusher reports the drops.
+class asyncLogger {
+ public:
+  enum : size_t { kSlots = 4096, kText = 240 };
+
+  asyncLogger() : slots_(kSlots), flusher_(&asyncLogger::Flush, this) {
+    for (size_t i = 0; i < kSlots; ++i) {
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  //! @brief Write out what is queued and stop.
+  ~asyncLogger() {
+    stop_.store(true, std::memory_order_release);
+    flusher_.join();
+  }
+
+  void SetLevel(logLevel level) {
+    level_.store(level, std::memory_order_relaxed);
+  }
+
+  //! @brief Keep one in `every` sampled lines.
+  void SetSampleEvery(int every) {
+    sample_every_.store(every < 1 ? 1 : every, std::memory_order_relaxed);
+  }
+
+  bool Enabled(logLevel level) const {
+    return level >= level_.load(std::memory_order_relaxed);
+  }
+
+  //! @brief Enabled, and this thread's turn in the sampling.
+  bool Sample(logLevel level) {
+    if (!Enabled(level)) {
+      return false;
+    }
+    thread_local uint32_t count = 0;
+    return count++ % sample_every_.load(std::memory_order_relaxed) == 0;
+  }
+
+  //! @brief Queue a line, dropped if the ring is full.
+  void Push(logLevel level, const char* text, size_t size) {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    slot* s;
+    while (true) {
+      s = &slots_[pos % kSlots];
+      uint64_t seq = s->seq.load(std::memory_order_acquire);
+      int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    s->level = level;
+    s->micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    s->size = size < kText ? size : kText;
+    std::memcpy(s->text, text, s->size);
+    s->seq.store(pos + 1, std::memory_order_release);
+  }
+
+ private:
+  struct slot {
+    std::atomic<uint64_t> seq;
+    logLevel level;
+    int64_t micros;
+    size_t size;
+    char text[kText];
+  };
+
+  //! @brief Append the published lines to `out`.
+  //!
+  //! @return false if there was none.
+  bool Drain(std::string* out) {
+    bool any = false;
+    while (true) {
+      slot& s = slots_[head_ % kSlots];
+      if (s.seq.load(std::memory_order_acquire) != head_ + 1) {
+        break;
+      }
+      char prefix[40];
+      time_t seconds = s.micros / 1000000;
+      tm local;
+      localtime_r(&seconds, &local);
+      int n = std::snprintf(prefix, sizeof(prefix), "%c %02d:%02d:%02d.%06d ",
+                            "DIWE"[s.level], local.tm_hour, local.tm_min,
+                            local.tm_sec, static_cast<int>(s.micros % 1000000));
+      out->append(prefix, n);
+      out->append(s.text, s.size);
+      out->push_back('\n');
+      s.seq.store(head_ + kSlots, std::memory_order_release);
+      head_ += 1;
+      any = true;
+    }
+    return any;
+  }
+
+  void Flush() {
+    std::string out;
+    uint64_t reported = 0;
+    while (true) {
+      bool stopping = stop_.load(std::memory_order_acquire);
+      out.clear();
+      bool any = Drain(&out);
+      uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+      if (dropped != reported) {
+        out += "W log ring full, dropped " + std::to_string(dropped - reported) +
+            " lines\n";
+        reported = dropped;
+      }
+      if (!out.empty()) {
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        std::fflush(stdout);
+      }
+      if (stopping) {
+        return;
+      }
+      if (!any) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+    }
+  }
+
+  std::vector<slot> slots_;
+  //!< Next slot to claim, by producers.
+  std::atomic<uint64_t> tail_{0};
+  //!< Next slot to write out, by the flusher only.
+  uint64_t head_ = 0;
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<int> level_{kLogInfo};
+  std::atomic<int> sample_every_{1};
+  std::atomic<bool> stop_{false};
+  std::thread flusher_;
+};
+
+//! @brief The logger of this process.
+inline asyncLogger& globalLogger() {
+  static asyncLogger logger;
+  return logger;
+}
+
+//! @brief One line, formatted on the stack and queued when it goes out of
+//!        scope. Longer lines are cut at asyncLogger::kText.
+class logLine {
+ public:
+  explicit logLine(logLevel level) : level_(level) {}
+
+  ~logLine() { globalLogger().Push(level_, text_, size_); }
+
+  logLine& operator<<(const std::string& value) {
+    return append(value.data(), value.size());
+  }
+
+  logLine& operator<<(const char* value) {
+    return append(value, std::strlen(value));
+  }
+
+  logLine& operator<<(char value) { return append(&value, 1); }
+
+  logLine& operator<<(bool value) {
+    return value ? append("true", 4) : append("false", 5);
+  }
+
+  logLine& operator<<(double value) {
+    char digits[32];
+    int n = std::snprintf(digits, sizeof(digits), "%g", value);
+    return append(digits, n);
+  }
+
+  //! @brief Integers and enums (e.g. grpc::StatusCode), without printf.
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value ||
+                              std::is_enum<T>::value,
+                          logLine&>::type
+  operator<<(T value) {
+    const bool negative =
+        !std::is_unsigned<T>::value && static_cast<int64_t>(value) < 0;
+    uint64_t magnitude = static_cast<uint64_t>(value);
+    if (negative) {
+      magnitude = 0 - magnitude;
+    }
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* p = end;
+    do {
+      *--p = '0' + magnitude % 10;
+      magnitude /= 10;
+    } while (magnitude != 0);
+    if (negative) {
+      *--p = '-';
+    }
+    return append(p, end - p);
+  }
+
+ private:
+  logLine& append(const char* data, size_t size) {
+    size_t room = asyncLogger::kText - size_;
+    size = size < room ? size : room;
+    std::memcpy(text_ + size_, data, size);
+    size_ += size;
+    return *this;
+  }
+
+  const logLevel level_;
+  char text_[asyncLogger::kText];
+  size_t size_ = 0;
+};
+
+//! @brief Turns the streamed line into void for the ternary in KV_LOG.
+struct logVoidify {
+  void operator&(const logLine&) {}
+};
+
+//! @brief KV_LOG(kLogInfo) << "..." : queue a line, if the level is on.
+#define KV_LOG(level)                                                  \
+  !((level) >= KV_LOG_MIN_LEVEL && globalLogger().Enabled(level))      \
+      ? (void)0                                                        \
+      : logVoidify() & logLine(level)
+
+//! @brief Like KV_LOG, but only one in `SetSampleEvery` lines per thread :
+//!        for per-request lines.
+#define KV_LOG_SAMPLED(level)                                          \
+  !((level) >= KV_LOG_MIN_LEVEL && globalLogger().Sample(level))       \
+      ? (void)0                                                        \
+      : logVoidify() & logLine(level)
+
+#endif  // DISTRIBUTEDKV_LOGGER_H_
@@ -0,0 +1,284 @@
+// Storage engine held in memory only : for cache-tier workers with no
+// disk, and to compare the engines under the same benchmark. Nothing
+// survives the process.
+
+#ifndef DISTRIBUTEDKV_MEMORY_ENGINE_H_
+#define DISTRIBUTEDKV_MEMORY_ENGINE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "storage_engine.h"
+
+//! @brief storageEngine over an ordered map of versioned rows.
+//!
+//! @details Every key holds its versions, oldest first, tagged with the
+//!          seq of the batch that wrote them : a snapshot is a seq, a read
+//!          sees the newest version at or before it. Versions no live
+//!          snapshot can see are dropped when their key is written, or
+//!          once the snapshots holding them are released. Readers share
+//!          the map's lock, a batch takes it alone ; the workers write
+//!          from the group commit thread only, so writers never queue on
+//!          each other. Iterators do not hold the lock between steps, they
+//!          read their own snapshot.
+class memoryEngine final : public storageEngine {
+ public:
+  ~memoryEngine() override = default;
+
+  leveldb::Status Get(const storageReadOptions& options,
+                      const leveldb::Slice& key, std::string* value) override {
+    std::shared_lock<std::shared_timed_mutex> lock(mu_);
+    auto it = rows_.find(key);
+    const version* found =
+        it == rows_.end() ? nullptr : visible(it->second, seqOf(options));
+    if (found == nullptr || found->deleted) {
+      return leveldb::Status::NotFound(key);
+    }
+    value->assign(found->value);
+    return leveldb::Status::OK();
+  }
+
+  //! @brief `sync` is ignored : nothing here is durable.
+  leveldb::Status Write(const std::vector<const storageBatch*>& batches,
+                        bool /*sync*/) override {
+    std::unique_lock<std::shared_timed_mutex> lock(mu_);
+    const uint64_t seq = seq_.load(std::memory_order_relaxed) + 1;
+    const uint64_t oldest = oldestSnapshot();
+    for (const storageBatch* batch : batches) {
+      batch->ForEach([&](const leveldb::Slice& key,
+                         const leveldb::Slice& value, bool deleted) {
+        auto it = rows_.find(key);
+        if (it == rows_.end()) {
+          if (deleted) {
+            return;
+          }
+          it = rows_.emplace(key.ToString(), std::vector<version>()).first;
+          bytes_ += key.size();
+        }
+        std::vector<version>& versions = it->second;
+        if (!versions.empty() && versions.back().seq == seq) {
+          // Written twice by the batch : the last write wins.
+          bytes_ -= versions.back().value.size();
+          versions.pop_back();
+        }
+        versions.push_back({seq, deleted, value.ToString()});
+        bytes_ += value.size();
+        if (!prune(it, oldest)) {
+          pinned_.insert(key.ToString());
+        }
+      });
+    }
+    seq_.store(seq, std::memory_order_release);
+    return leveldb::Status::OK();
+  }
+
+  storageIterator* NewIterator(const storageReadOptions& options) override {
+    if (options.snapshot != nullptr) {
+      return new iterator(this, seqOf(options), nullptr);
+    }
+    const storageSnapshot* own = GetSnapshot();
+    return new iterator(this, static_cast<const snapshot*>(own)->seq, own);
+  }
+
+  const storageSnapshot* GetSnapshot() override {
+    // Under the map's lock : no batch prunes between reading the seq and
+    // registering the snapshot.
+    std::shared_lock<std::shared_timed_mutex> lock(mu_);
+    std::lock_guard<std::mutex> snapshots(snapshots_mu_);
+    uint64_t seq = seq_.load(std::memory_order_acquire);
+    snapshots_.insert(seq);
+    return new snapshot(seq);
+  }
+
+  void ReleaseSnapshot(const storageSnapshot* released) override {
+    const snapshot* s = static_cast<const snapshot*>(released);
+    bool sweep;
+    {
+      std::lock_guard<std::mutex> snapshots(snapshots_mu_);
+      snapshots_.erase(snapshots_.find(s->seq));
+      sweep = snapshots_.empty() || *snapshots_.begin() > s->seq;
+    }
+    delete s;
+    if (sweep) {
+      prunePinned();
+    }
+  }
+
+  //! @brief Answers `leveldb.approximate-memory-usage`, with the bytes of
+  //!        the keys and values held.
+  bool GetProperty(const leveldb::Slice& property,
+                   std::string* value) override {
+    if (property == "leveldb.approximate-memory-usage") {
+      std::shared_lock<std::shared_timed_mutex> lock(mu_);
+      *value = std::to_string(bytes_);
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  struct version {
+    uint64_t seq;
+    bool deleted;
+    std::string value;
+  };
+
+  //! @brief Orders std::string and leveldb::Slice alike, to look the map
+  //!        up without copying the key.
+  struct keyLess {
+    using is_transparent = void;
+    bool operator()(const leveldb::Slice& a, const leveldb::Slice& b) const {
+      return a.compare(b) < 0;
+    }
+  };
+
+  using rowMap = std::map<std::string, std::vector<version>, keyLess>;
+
+  struct snapshot : storageSnapshot {
+    explicit snapshot(uint64_t s) : seq(s) {}
+    const uint64_t seq;
+  };
+
+  class iterator final : public storageIterator {
+   public:
+    iterator(memoryEngine* engine, uint64_t seq, const storageSnapshot* own)
+        : engine_(engine), seq_(seq), own_(own) {}
+
+    ~iterator() override {
+      if (own_ != nullptr) {
+        engine_->ReleaseSnapshot(own_);
+      }
+    }
+
+    bool Valid() const override { return valid_; }
+
+    void Seek(const leveldb::Slice& target) override {
+      std::shared_lock<std::shared_timed_mutex> lock(engine_->mu_);
+      settle(engine_->rows_.lower_bound(target));
+    }
+
+    void Next() override {
+      std::shared_lock<std::shared_timed_mutex> lock(engine_->mu_);
+      settle(engine_->rows_.upper_bound(leveldb::Slice(key_)));
+    }
+
+    leveldb::Slice key() const override { return key_; }
+    leveldb::Slice value() const override { return value_; }
+    leveldb::Status status() const override { return leveldb::Status::OK(); }
+
+   private:
+    //! @brief Stop at the first key from `it` with a value in the
+    //!        snapshot, copied out so the lock can be let go.
+    void settle(rowMap::const_iterator it) {
+      for (; it != engine_->rows_.end(); ++it) {
+        const version* found = visible(it->second, seq_);
+        if (found != nullptr && !found->deleted) {
+          key_ = it->first;
+          value_ = found->value;
+          valid_ = true;
+          return;
+        }
+      }
+      valid_ = false;
+    }
+
+    memoryEngine* const engine_;
+    const uint64_t seq_;
+    //!< Snapshot taken for this iterator, released with it.
+    const storageSnapshot* const own_;
+    bool valid_ = false;
+    std::string key_;
+    std::string value_;
+  };
+
+  uint64_t seqOf(const storageReadOptions& options) const {
+    return options.snapshot != nullptr
+        ? static_cast<const snapshot*>(options.snapshot)->seq
+        : seq_.load(std::memory_order_acquire);
+  }
+
+  //! @brief The newest version written at or before seq, null if none.
+  static const version* visible(const std::vector<version>& versions,
+                                uint64_t seq) {
+    for (auto it = versions.rbegin(); it != versions.rend(); ++it) {
+      if (it->seq <= seq) {
+        return &*it;
+      }
+    }
+    return nullptr;
+  }
+
+  //! @brief The seq of the oldest live snapshot, max if there is none.
+  uint64_t oldestSnapshot() {
+    std::lock_guard<std::mutex> snapshots(snapshots_mu_);
+    return snapshots_.empty() ? std::numeric_limits<uint64_t>::max()
+                              : *snapshots_.begin();
+  }
+
+  //! @brief Drop the versions of a key that no snapshot from `oldest` on
+  //!        can see, and the key itself if what is left is a delete.
+  //!        Called with the map's lock held alone.
+  //!
+  //! @return false if versions, or the key's delete, had to be kept for
+  //!         older snapshots.
+  bool prune(rowMap::iterator it, uint64_t oldest) {
+    std::vector<version>& versions = it->second;
+    size_t keep = versions.size() - 1;
+    while (keep > 0 && versions[keep].seq > oldest) {
+      keep -= 1;
+    }
+    for (size_t i = 0; i < keep; ++i) {
+      bytes_ -= versions[i].value.size();
+    }
+    versions.erase(versions.begin(), versions.begin() + keep);
+    if (versions.size() == 1 && versions[0].deleted &&
+        versions[0].seq <= oldest) {
+      bytes_ -= it->first.size();
+      rows_.erase(it);
+      return true;
+    }
+    return versions.size() == 1 && !versions[0].deleted;
+  }
+
+  //! @brief Prune the keys that kept versions for snapshots since gone.
+  void prunePinned() {
+    {
+      std::shared_lock<std::shared_timed_mutex> lock(mu_);
+      if (pinned_.empty()) {
+        return;
+      }
+    }
+    std::unique_lock<std::shared_timed_mutex> lock(mu_);
+    const uint64_t oldest = oldestSnapshot();
+    for (auto key = pinned_.begin(); key != pinned_.end();) {
+      auto it = rows_.find(*key);
+      if (it == rows_.end() || prune(it, oldest)) {
+        key = pinned_.erase(key);
+      } else {
+        ++key;
+      }
+    }
+  }
+
+  //!< Guard of the rows, shared by the readers.
+  mutable std::shared_timed_mutex mu_;
+  rowMap rows_;
+  //!< Keys holding versions for live snapshots.
+  std::set<std::string> pinned_;
+  size_t bytes_ = 0;
+  //!< Seq of the last batch applied.
+  std::atomic<uint64_t> seq_{0};
+
+  std::mutex snapshots_mu_;
+  //!< Seqs of the live snapshots.
+  std::multiset<uint64_t> snapshots_;
+};
+
+#endif  // DISTRIBUTEDKV_MEMORY_ENGINE_H_
@@ -0,0 +1,400 @@
+// Metrics shared by the master and the workers : lock-free counters, gauges
+// and latency histograms, rendered in the Prometheus text format and served
+// over plain HTTP on a port of their own.
+
+#ifndef DISTRIBUTEDKV_METRICS_H_
+#define DISTRIBUTEDKV_METRICS_H_
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <grpcpp/support/server_interceptor.h>
+
+//! @brief Monotonic counter.
+class metricsCounter {
+ public:
+  void Add(uint64_t delta = 1) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  uint64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_{0};
+};
+
+//! @brief Value going up and down, e.g. requests in flight.
+class metricsGauge {
+ public:
+  void Add(int64_t delta) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+
+  int64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+//! @brief Latency histogram over fixed buckets from 50us to 10s.
+class metricsHistogram {
+ public:
+  static constexpr int kBuckets = 17;
+
+  //! @brief Upper bound of bucket i, in us.
+  static uint64_t Bound(int i) {
+    static const uint64_t bounds[kBuckets] = {
+        50,     100,    250,    500,     1000,    2500,    5000,
+        10000,  25000,  50000,  100000,  250000,  500000,  1000000,
+        2500000, 5000000, 10000000};
+    return bounds[i];
+  }
+
+  //! @brief Record one observation, in us.
+  void Observe(uint64_t us) {
+    int i = 0;
+    while (i < kBuckets && us > Bound(i)) {
+      ++i;
+    }
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    sum_us_.fetch_add(us, std::memory_order_relaxed);
+  }
+
+  //! @brief Record the time since `start`.
+  void ObserveSince(std::chrono::steady_clock::time_point start) {
+    Observe(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  }
+
+  //! @brief Write the cumulative buckets, sum and count.
+  void Render(std::ostream& out, const std::string& name,
+              const std::string& labels) const {
+    const std::string prefix = labels.empty() ? "" : labels + ",";
+    uint64_t count = 0;
+    for (int i = 0; i <= kBuckets; ++i) {
+      count += buckets_[i].load(std::memory_order_relaxed);
+      out << name << "_bucket{" << prefix << "le=\"";
+      if (i == kBuckets) {
+        out << "+Inf";
+      } else {
+        out << Bound(i) / 1e6;
+      }
+      out << "\"} " << count << "\n";
+    }
+    const std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braces << " "
+        << sum_us_.load(std::memory_order_relaxed) / 1e6 << "\n";
+    out << name << "_count" << braces << " " << count << "\n";
+  }
+
+ private:
+  //!< Last bucket : above the largest bound.
+  std::atomic<uint64_t> buckets_[kBuckets + 1] = {};
+  std::atomic<uint64_t> sum_us_{0};
+};
+
+//! @brief A `key="value"` label.
+inline std::string metricsLabel(const std::string& key,
+                                const std::string& value) {
+  return key + "=\"" + value + "\"";
+}
+
+//! @brief Named metrics, each name a family of labelled series.
+//!
+//! @details Series are created on first lookup and live as long as the
+//!          registry, callers keep the pointers and update them lock-free.
+//!          Collectors add values computed at scrape time.
+class metricsRegistry {
+ public:
+  using Collector = std::function<void(std::ostream&)>;
+
+  metricsCounter* Counter(const std::string& name, const std::string& help,
+                          const std::string& labels = "") {
+    return series(&family::counters, name, help, "counter", labels);
+  }
+
+  metricsGauge* Gauge(const std::string& name, const std::string& help,
+                      const std::string& labels = "") {
+    return series(&family::gauges, name, help, "gauge", labels);
+  }
+
+  metricsHistogram* Histogram(const std::string& name,
+                              const std::string& help,
+                              const std::string& labels = "") {
+    return series(&family::histograms, name, help, "histogram", labels);
+  }
+
+  void AddCollector(Collector collect) {
+    std::lock_guard<std::mutex> lock(mu_);
+    collectors_.push_back(std::move(collect));
+  }
+
+  //! @brief Render every metric in the text exposition format.
+  std::string Render() const {
+    std::ostringstream out;
+    out << std::setprecision(9);
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& named : families_) {
+      const std::string& name = named.first;
+      const family& f = named.second;
+      out << "# HELP " << name << " " << f.help << "\n";
+      out << "# TYPE " << name << " " << f.type << "\n";
+      for (const auto& s : f.counters) {
+        out << name << braces(s.first) << " " << s.second->Value() << "\n";
+      }
+      for (const auto& s : f.gauges) {
+        out << name << braces(s.first) << " " << s.second->Value() << "\n";
+      }
+      for (const auto& s : f.histograms) {
+        s.second->Render(out, name, s.first);
+      }
+    }
+    for (const Collector& collect : collectors_) {
+      collect(out);
+    }
+    return out.str();
+  }
+
+ private:
+  struct family {
+    std::string help;
+    std::string type;
+    std::map<std::string, std::unique_ptr<metricsCounter>> counters;
+    std::map<std::string, std::unique_ptr<metricsGauge>> gauges;
+    std::map<std::string, std::unique_ptr<metricsHistogram>> histograms;
+  };
+
+  static std::string braces(const std::string& labels) {
+    return labels.empty() ? "" : "{" + labels + "}";
+  }
+
+  template <typename T>
+  T* series(std::map<std::string, std::unique_ptr<T>> family::*member,
+            const std::string& name, const std::string& help,
+            const std::string& type, const std::string& labels) {
+    std::lock_guard<std::mutex> lock(mu_);
+    family& f = families_[name];
+    if (f.type.empty()) {
+      f.help = help;
+      f.type = type;
+    }
+    std::unique_ptr<T>& s = (f.*member)[labels];
+    if (s == nullptr) {
+      s.reset(new T);
+    }
+    return s.get();
+  }
+
+  mutable std::mutex mu_;
+  std::map<std::string, family> families_;
+  std::vector<Collector> collectors_;
+};
+
+//! @brief The registry of this process.
+inline metricsRegistry& globalMetrics() {
+  static metricsRegistry registry;
+  return registry;
+}
+
+
+//! @brief Latency, failures and calls in flight of every RPC of a server.
+//!
+//! @details One interceptor per call : counted in flight from its creation
+//!          to its deletion, timed until its status is sent.
+class rpcMetricsInterceptor : public grpc::experimental::Interceptor {
+ public:
+  struct methodMetrics {
+    metricsHistogram* latency;
+    metricsCounter* failures;
+    metricsGauge* inflight;
+  };
+
+  explicit rpcMetricsInterceptor(const methodMetrics* metrics)
+      : metrics_(metrics), start_(std::chrono::steady_clock::now()) {
+    metrics_->inflight->Add(1);
+  }
+
+  ~rpcMetricsInterceptor() override { metrics_->inflight->Add(-1); }
+
+  void Intercept(grpc::experimental::InterceptorBatchMethods* methods)
+      override {
+    if (methods->QueryInterceptionHookPoint(
+            grpc::experimental::InterceptionHookPoints::PRE_SEND_STATUS)) {
+      metrics_->latency->ObserveSince(start_);
+      if (!methods->GetSendStatus().ok()) {
+        metrics_->failures->Add();
+      }
+    }
+    methods->Proceed();
+  }
+
+ private:
+  const methodMetrics* metrics_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+//! @brief Hands every call of the server an rpcMetricsInterceptor.
+class rpcMetricsFactory
+    : public grpc::experimental::ServerInterceptorFactoryInterface {
+ public:
+  grpc::experimental::Interceptor* CreateServerInterceptor(
+      grpc::experimental::ServerRpcInfo* info) override {
+    return new rpcMetricsInterceptor(metricsOf(info->method()));
+  }
+
+ private:
+  const rpcMetricsInterceptor::methodMetrics* metricsOf(
+      const std::string& method) {
+    {
+      std::shared_lock<std::shared_timed_mutex> lock(mu_);
+      auto it = methods_.find(method);
+      if (it != methods_.end()) {
+        return &it->second;
+      }
+    }
+    metricsRegistry& registry = globalMetrics();
+    const std::string label = metricsLabel("method", method);
+    rpcMetricsInterceptor::methodMetrics metrics = {
+        registry.Histogram("kv_rpc_seconds", "Server-side RPC latency",
+                           label),
+        registry.Counter("kv_rpc_failures_total",
+                         "RPCs finished with a non-OK status", label),
+        registry.Gauge("kv_rpc_inflight", "RPCs being served", label)};
+    std::unique_lock<std::shared_timed_mutex> lock(mu_);
+    return &methods_.emplace(method, metrics).first->second;
+  }
+
+  std::shared_timed_mutex mu_;
+  std::unordered_map<std::string, rpcMetricsInterceptor::methodMetrics>
+      methods_;
+};
+
+
+//! @brief Serves a registry at `GET /metrics` over HTTP/1.0.
+//!
+//! @details One thread, one connection at a time : scrapes are rare and
+//!          small, a slow scraper is cut off by the socket timeout.
+class metricsHttpServer {
+ public:
+  explicit metricsHttpServer(const metricsRegistry* registry)
+      : registry_(registry) {}
+
+  ~metricsHttpServer() {
+    if (fd_ < 0) {
+      return;
+    }
+    stop_ = true;
+    shutdown(fd_, SHUT_RDWR);
+    thread_.join();
+    close(fd_);
+  }
+
+  //! @brief Listen on the port and serve from a thread.
+  //!
+  //! @return false if the port could not be bound.
+  bool Start(uint16_t port) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+      return false;
+    }
+    int on = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(fd_, 16) < 0) {
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    thread_ = std::thread(&metricsHttpServer::Serve, this);
+    return true;
+  }
+
+ private:
+  void Serve() {
+    while (!stop_) {
+      int client = accept(fd_, nullptr, nullptr);
+      if (client < 0) {
+        // Out of descriptors (EMFILE, ENFILE) or memory lasts a while :
+        // back off instead of spinning on accept.
+        if (errno != EINTR && errno != ECONNABORTED && !stop_) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        continue;
+      }
+      timeval timeout = {1, 0};
+      setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      Respond(client);
+      close(client);
+    }
+  }
+
+  void Respond(int client) {
+    // Only the request line matters.
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n") == std::string::npos && request.size() < 8192) {
+      ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+      if (n <= 0) {
+        return;
+      }
+      request.append(buffer, n);
+    }
+
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0 ||
+        request.compare(0, 13, "GET /metrics?") == 0) {
+      body = registry_->Render();
+    } else {
+      status = "404 Not Found";
+      body = "Try /metrics\n";
+    }
+    std::string response =
+        "HTTP/1.0 " + status + "\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+      ssize_t n = send(client, response.data() + sent, response.size() - sent,
+                       MSG_NOSIGNAL);
+      if (n <= 0) {
+        return;
+      }
+      sent += n;
+    }
+  }
+
+  const metricsRegistry* registry_;
+  int fd_ = -1;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+#endif  // DISTRIBUTEDKV_METRICS_H_
@@ -0,0 +1,118 @@
+// Routing table cached by smart clients : single-key requests go straight to
+// the owning worker, the master only hands out the table when it changed.
+
+#ifndef DISTRIBUTEDKV_ROUTING_TABLE_H_
+#define DISTRIBUTEDKV_ROUTING_TABLE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#ifdef BAZEL_BUILD
+#include "examples/protos/distributedKV.grpc.pb.h"
+#else
+#include "distributedKV.grpc.pb.h"
+#endif
+
+#include "consistent_hash_ring.h"
+
+//! @brief Client-side copy of the master's routing table.
+//!
+//! @details Holds the workers, one channel each, and the hash ring rebuilt
+//!          from them. Requests routed with it carry its version : a worker
+//!          that no longer owns the key answers `stale routing`
+//!          (FAILED_PRECONDITION), then the table is refreshed and the
+//!          request sent again. Thread safe.
+class routingTable {
+ public:
+  routingTable(std::shared_ptr<grpc::Channel> master)
+      : master_(distributedKV::kvMethods::NewStub(master)) {}
+
+  //! @brief Fetch the table from the master, unless it changed since the
+  //!        caller saw `seen` : concurrent refreshes of one stale table
+  //!        turn into a single call. Channels of the workers that stay are
+  //!        kept.
+  //!
+  //! @return false if the master could not be reached.
+  bool Refresh(uint64_t seen = 0) {
+    std::lock_guard<std::mutex> refreshing(refresh_mu_);
+    if (seen != 0 && Version() != seen) {
+      return true;
+    }
+
+    distributedKV::RoutingRequest request;
+    request.set_version(Version());
+    distributedKV::RoutingTable table;
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() +
+                         std::chrono::seconds(1));
+    grpc::Status status = master_->Routing(&context, request, &table);
+    if (!status.ok()) {
+      return false;
+    }
+
+    std::unordered_map<uint16_t, std::shared_ptr<distributedKV::kvMethods::Stub>>
+        workers;
+    std::vector<uint16_t> ports;
+    for (const distributedKV::WorkerEndpoint& worker : table.workers()) {
+      uint16_t port = worker.port();
+      ports.push_back(port);
+      std::shared_ptr<distributedKV::kvMethods::Stub> stub = Stub(port);
+      if (stub == nullptr) {
+        stub = distributedKV::kvMethods::NewStub(grpc::CreateChannel(
+            worker.address(), grpc::InsecureChannelCredentials()));
+      }
+      workers.emplace(port, std::move(stub));
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(mu_);
+    ring_.SetVirtualNodes(table.vnodes());
+    ring_.Reset(ports);
+    workers_.swap(workers);
+    version_ = table.version();
+    return true;
+  }
+
+  //! @brief Get the stub of the worker owning the key.
+  //!
+  //! @param version : set to the table version the owner was picked from.
+  //! @return nullptr if no worker is known.
+  std::shared_ptr<distributedKV::kvMethods::Stub> Owner(
+      const std::string& key, uint64_t* version) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mu_);
+    *version = version_;
+    auto it = workers_.find(ring_.Owner(key));
+    return it == workers_.end() ? nullptr : it->second;
+  }
+
+  uint64_t Version() const {
+    std::shared_lock<std::shared_timed_mutex> lock(mu_);
+    return version_;
+  }
+
+ private:
+  std::shared_ptr<distributedKV::kvMethods::Stub> Stub(uint16_t port) const {
+    std::shared_lock<std::shared_timed_mutex> lock(mu_);
+    auto it = workers_.find(port);
+    return it == workers_.end() ? nullptr : it->second;
+  }
+
+  std::unique_ptr<distributedKV::kvMethods::Stub> master_;
+  //!< Serializes refreshes.
+  std::mutex refresh_mu_;
+  //!< Guard of the table below.
+  mutable std::shared_timed_mutex mu_;
+  uint64_t version_ = 0;
+  consistentHashRing ring_;
+  std::unordered_map<uint16_t, std::shared_ptr<distributedKV::kvMethods::Stub>>
+      workers_;
+};
+
+#endif  // DISTRIBUTEDKV_ROUTING_TABLE_H_
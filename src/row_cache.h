@@ -0,0 +1,262 @@
+// Row cache of the workers : hot rows served from RAM before the storage
+// engine's lookups (LevelDB's memtable and tables). Flat open-addressing
+// shards with the rows stored inline, CLOCK eviction, kept in step with the
+// group commits.
+
+#ifndef DISTRIBUTEDKV_ROW_CACHE_H_
+#define DISTRIBUTEDKV_ROW_CACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "leveldb/slice.h"
+
+#include "consistent_hash_ring.h"
+#include "metrics.h"
+#include "storage_engine.h"
+
+//! @brief Sharded cache of small rows, keyed by the engine key.
+//!
+//! @details Every shard is a power-of-two array of fixed 256-byte slots
+//!          probed linearly, a row lives in its slot : key and value
+//!          inline, no pointer to chase. Rows that do not fit a slot are
+//!          not cached. The memory is allocated once, `bytes` in total.
+//!          When a shard is 3/4 full its CLOCK hand evicts the first row
+//!          not read since the hand last passed it.
+//!
+//!          Writes keep it exact : the committer drops the rows of a group
+//!          before writing it (`Invalidate`) and stores the written rows
+//!          after (`Apply`), so a read never hits a row older than what
+//!          the engine holds. A read miss loads the row with `Fill`, which
+//!          is dropped if a write went through the shard since `Epoch`
+//!          was taken, before the engine read.
+class rowCache {
+ public:
+  enum : size_t { kSlotBytes = 256, kShards = 64 };
+  //!< Largest key plus value a slot holds.
+  enum : size_t { kMaxRow = kSlotBytes - 14 };
+
+  //! @param bytes : memory of the slots, 0 disables the cache.
+  explicit rowCache(size_t bytes) {
+    size_t slots = 1;
+    while (slots * 2 * kShards * kSlotBytes <= bytes) {
+      slots *= 2;
+    }
+    if (bytes < 16 * kShards * kSlotBytes) {
+      return;
+    }
+    shards_.reset(new shard[kShards]);
+    for (size_t i = 0; i < kShards; ++i) {
+      shards_[i].slots.reset(new slot[slots]());
+    }
+    mask_ = slots - 1;
+    limit_ = slots / 4 * 3;
+    bytes_->Set(slots * kShards * kSlotBytes);
+  }
+
+  bool Enabled() const { return shards_ != nullptr; }
+
+  //! @brief Copy the cached value of key into `value`.
+  //!
+  //! @return false on a miss.
+  bool Lookup(const leveldb::Slice& key, std::string* value) {
+    if (!Enabled()) {
+      return false;
+    }
+    const uint64_t hash = Hash(key);
+    shard& s = shardOf(hash);
+    std::lock_guard<std::mutex> lock(s.mu);
+    size_t i;
+    if (!find(s, hash, key, &i)) {
+      misses_->Add();
+      return false;
+    }
+    slot& row = s.slots[i];
+    row.ref = 1;
+    value->assign(row.data + row.key_size, row.value_size);
+    hits_->Add();
+    return true;
+  }
+
+  //! @brief The write epoch of the key's shard, to pass to `Fill`.
+  uint64_t Epoch(const leveldb::Slice& key) const {
+    if (!Enabled()) {
+      return 0;
+    }
+    return shardOf(Hash(key)).epoch.load(std::memory_order_acquire);
+  }
+
+  //! @brief Cache a row read from the engine, unless its shard was written
+  //!        since `epoch`.
+  void Fill(const leveldb::Slice& key, const leveldb::Slice& value,
+            uint64_t epoch) {
+    if (!Enabled() || key.size() + value.size() > kMaxRow) {
+      return;
+    }
+    const uint64_t hash = Hash(key);
+    shard& s = shardOf(hash);
+    std::lock_guard<std::mutex> lock(s.mu);
+    if (s.epoch.load(std::memory_order_relaxed) == epoch) {
+      store(s, hash, key, value);
+    }
+  }
+
+  //! @brief Drop the rows a batch is about to write.
+  void Invalidate(const storageBatch& batch) {
+    if (Enabled()) {
+      batch.ForEach([this](const leveldb::Slice& key, const leveldb::Slice&,
+                           bool) { write(key, nullptr); });
+    }
+  }
+
+  //! @brief Store the rows a committed batch wrote, drop its deletes and
+  //!        the rows too large to cache.
+  void Apply(const storageBatch& batch) {
+    if (Enabled()) {
+      batch.ForEach([this](const leveldb::Slice& key,
+                           const leveldb::Slice& value, bool deleted) {
+        bool store = !deleted && key.size() + value.size() <= kMaxRow;
+        write(key, store ? &value : nullptr);
+      });
+    }
+  }
+
+ private:
+  struct slot {
+    uint64_t hash;
+    uint16_t key_size;
+    uint16_t value_size;
+    uint8_t used;
+    //!< Read since the CLOCK hand last passed.
+    uint8_t ref;
+    char data[kMaxRow];
+  };
+  static_assert(sizeof(slot) == kSlotBytes, "slot must fill kSlotBytes");
+
+  struct shard {
+    std::mutex mu;
+    std::unique_ptr<slot[]> slots;
+    size_t used = 0;
+    size_t hand = 0;
+    //!< Bumped, under mu, by every write to the shard.
+    std::atomic<uint64_t> epoch{0};
+  };
+
+  static uint64_t Hash(const leveldb::Slice& key) {
+    return consistentHashRing::Hash(key.data(), key.size());
+  }
+
+  shard& shardOf(uint64_t hash) const {
+    return shards_[(hash >> 32) % kShards];
+  }
+
+  //! @brief Store the row, or drop it if `value` is null.
+  void write(const leveldb::Slice& key, const leveldb::Slice* value) {
+    const uint64_t hash = Hash(key);
+    shard& s = shardOf(hash);
+    std::lock_guard<std::mutex> lock(s.mu);
+    s.epoch.fetch_add(1, std::memory_order_release);
+    if (value != nullptr) {
+      store(s, hash, key, *value);
+      return;
+    }
+    size_t i;
+    if (find(s, hash, key, &i)) {
+      erase(s, i);
+    }
+  }
+
+  //! @brief Probe for the key.
+  //!
+  //! @param i : set to its slot if found, else to the empty slot ending
+  //!            the probe.
+  bool find(const shard& s, uint64_t hash, const leveldb::Slice& key,
+            size_t* i) const {
+    for (size_t at = hash & mask_;; at = (at + 1) & mask_) {
+      const slot& row = s.slots[at];
+      if (!row.used) {
+        *i = at;
+        return false;
+      }
+      if (row.hash == hash && row.key_size == key.size() &&
+          std::memcmp(row.data, key.data(), key.size()) == 0) {
+        *i = at;
+        return true;
+      }
+    }
+  }
+
+  void store(shard& s, uint64_t hash, const leveldb::Slice& key,
+             const leveldb::Slice& value) {
+    size_t i;
+    if (!find(s, hash, key, &i)) {
+      if (s.used >= limit_) {
+        evict(s);
+        find(s, hash, key, &i);
+      }
+      s.used += 1;
+    }
+    slot& row = s.slots[i];
+    row.hash = hash;
+    row.key_size = key.size();
+    row.value_size = value.size();
+    row.used = 1;
+    row.ref = 0;
+    std::memcpy(row.data, key.data(), key.size());
+    std::memcpy(row.data + key.size(), value.data(), value.size());
+  }
+
+  //! @brief Advance the CLOCK hand to a row not read since its last pass
+  //!        and drop it.
+  void evict(shard& s) {
+    while (true) {
+      slot& row = s.slots[s.hand];
+      if (row.used && !row.ref) {
+        // The row shifted into its place is looked at by the next one.
+        erase(s, s.hand);
+        evictions_->Add();
+        return;
+      }
+      row.ref = 0;
+      s.hand = (s.hand + 1) & mask_;
+    }
+  }
+
+  //! @brief Empty slot i, shifting back the rows of the probe run after
+  //!        it so that no probe stops short of its row.
+  void erase(shard& s, size_t i) {
+    for (size_t j = (i + 1) & mask_; s.slots[j].used; j = (j + 1) & mask_) {
+      size_t home = s.slots[j].hash & mask_;
+      // Movable if its home is not cyclically within (i, j].
+      bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+      if (!stays) {
+        std::memcpy(&s.slots[i], &s.slots[j], sizeof(slot));
+        i = j;
+      }
+    }
+    s.slots[i].used = 0;
+    s.used -= 1;
+  }
+
+  std::unique_ptr<shard[]> shards_;
+  size_t mask_ = 0;
+  //!< Rows per shard before evicting.
+  size_t limit_ = 0;
+
+  metricsCounter* hits_ = globalMetrics().Counter(
+      "kv_worker_row_cache_hits_total", "Gets served by the row cache");
+  metricsCounter* misses_ = globalMetrics().Counter(
+      "kv_worker_row_cache_misses_total",
+      "Gets that went to the storage engine");
+  metricsCounter* evictions_ = globalMetrics().Counter(
+      "kv_worker_row_cache_evictions_total",
+      "Rows evicted by the CLOCK hand");
+  metricsGauge* bytes_ = globalMetrics().Gauge(
+      "kv_worker_row_cache_bytes", "Memory of the row cache slots");
+};
+
+#endif  // DISTRIBUTEDKV_ROW_CACHE_H_
@@ -0,0 +1,140 @@
+// Storage engine of the workers : what the kv service needs from the store
+// under it (point reads, atomic batches of writes, snapshots and ordered
+// iteration), implemented over LevelDB or in memory.
+
+#ifndef DISTRIBUTEDKV_STORAGE_ENGINE_H_
+#define DISTRIBUTEDKV_STORAGE_ENGINE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+#include "leveldb/write_batch.h"
+
+//! @brief Puts and deletes applied together, in order.
+//!
+//! @details Staged in a leveldb::WriteBatch, which the LevelDB engine
+//!          writes as it is. The memory engine and the row cache read the
+//!          rows back with `ForEach`. Users of this header are built
+//!          without RTTI, as the vendored LevelDB is, to derive its
+//!          WriteBatch::Handler.
+class storageBatch {
+ public:
+  void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+    rep_.Put(key, value);
+  }
+
+  void Delete(const leveldb::Slice& key) { rep_.Delete(key); }
+
+  //! @brief Bytes of the staged rows, with their encoding.
+  size_t ApproximateSize() const { return rep_.ApproximateSize(); }
+
+  //! @brief Call `visit(key, value, deleted)` on every row, in order. The
+  //!        slices point into the batch.
+  template <typename Visit>
+  void ForEach(Visit visit) const {
+    visitor<Visit> handler(&visit);
+    // Always well-formed : built by Put and Delete only.
+    rep_.Iterate(&handler);
+  }
+
+  //! @brief The batch as LevelDB writes it.
+  const leveldb::WriteBatch& rep() const { return rep_; }
+
+ private:
+  template <typename Visit>
+  class visitor final : public leveldb::WriteBatch::Handler {
+   public:
+    explicit visitor(Visit* visit) : visit_(visit) {}
+
+    void Put(const leveldb::Slice& key, const leveldb::Slice& value) override {
+      (*visit_)(key, value, false);
+    }
+
+    void Delete(const leveldb::Slice& key) override {
+      (*visit_)(key, leveldb::Slice(), true);
+    }
+
+   private:
+    Visit* visit_;
+  };
+
+  leveldb::WriteBatch rep_;
+};
+
+//! @brief A consistent view of an engine, from GetSnapshot.
+class storageSnapshot {
+ protected:
+  virtual ~storageSnapshot() = default;
+};
+
+//! @brief Options of the reads, like leveldb::ReadOptions.
+struct storageReadOptions {
+  //!< Read as of this snapshot, the latest state if null.
+  const storageSnapshot* snapshot = nullptr;
+  //!< Whether what is read should be cached, e.g. not for scans.
+  bool fill_cache = true;
+};
+
+//! @brief Cursor over the keys of an engine in key order.
+class storageIterator {
+ public:
+  virtual ~storageIterator() = default;
+
+  virtual bool Valid() const = 0;
+  //! @brief Move to the first key at or past target.
+  virtual void Seek(const leveldb::Slice& target) = 0;
+  virtual void Next() = 0;
+  //! @brief Only while Valid(), until the iterator moves.
+  virtual leveldb::Slice key() const = 0;
+  virtual leveldb::Slice value() const = 0;
+  virtual leveldb::Status status() const = 0;
+};
+
+//! @brief The store under a worker. Thread safe.
+class storageEngine {
+ public:
+  virtual ~storageEngine() = default;
+
+  //! @return NotFound if the key has no value.
+  virtual leveldb::Status Get(const storageReadOptions& options,
+                              const leveldb::Slice& key,
+                              std::string* value) = 0;
+
+  //! @brief Apply the batches, in order, as one atomic write.
+  //!
+  //! @param sync : wait for the write to be durable, if the engine is.
+  virtual leveldb::Status Write(const std::vector<const storageBatch*>& batches,
+                                bool sync) = 0;
+
+  leveldb::Status Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+    storageBatch batch;
+    batch.Put(key, value);
+    return Write({&batch}, false);
+  }
+
+  leveldb::Status Delete(const leveldb::Slice& key) {
+    storageBatch batch;
+    batch.Delete(key);
+    return Write({&batch}, false);
+  }
+
+  //! @brief Iterate from the options' snapshot, or from the state at the
+  //!        time of the call. Deleted before the snapshot is released.
+  virtual storageIterator* NewIterator(const storageReadOptions& options) = 0;
+
+  //! @brief The current state, kept readable until ReleaseSnapshot.
+  virtual const storageSnapshot* GetSnapshot() = 0;
+  virtual void ReleaseSnapshot(const storageSnapshot* snapshot) = 0;
+
+  //! @brief Engine statistics by LevelDB property name, e.g.
+  //!        `leveldb.approximate-memory-usage`.
+  //!
+  //! @return false if the engine has no such property.
+  virtual bool GetProperty(const leveldb::Slice& property,
+                           std::string* value) = 0;
+};
+
+#endif  // DISTRIBUTEDKV_STORAGE_ENGINE_H_
@@ -0,0 +1,489 @@
+// LevelDB Env writing the database files through io_uring : the tables
+// that memtable flushes and compactions build go out in large writes, the
+// last one linked to the fdatasync that seals the table, and so do large
+// log records. Everything else is the POSIX Env's, table reads included :
+// it maps the table files, a read takes no syscall there. Linux only, over
+// raw syscalls : no liburing needed.
+
+#ifndef DISTRIBUTEDKV_URING_ENV_H_
+#define DISTRIBUTEDKV_URING_ENV_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define KV_HAVE_IO_URING 1
+#endif
+
+#include "leveldb/env.h"
+#include "leveldb/slice.h"
+#include "leveldb/status.h"
+
+#ifdef KV_HAVE_IO_URING
+
+//! @brief A submission and completion ring of this thread, used
+//!        synchronously : queue a few operations, submit them with one
+//!        syscall, wait for all of them.
+class uringQueue {
+ public:
+  enum : unsigned { kEntries = 8 };
+
+  //! @brief The ring of the calling thread, set up on first use.
+  //!
+  //! @return nullptr if io_uring cannot be set up, lacks the read and
+  //!         write operations (before Linux 5.6), or failed on this
+  //!         thread before : use the POSIX calls.
+  static uringQueue* ThisThread() {
+    thread_local uringQueue queue;
+    return queue.fd_ >= 0 && !queue.failed_ ? &queue : nullptr;
+  }
+
+  ~uringQueue() {
+    if (sq_ptr_ != MAP_FAILED) {
+      munmap(sq_ptr_, sq_bytes_);
+    }
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+      munmap(cq_ptr_, cq_bytes_);
+    }
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, kEntries * sizeof(io_uring_sqe));
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  //! @brief Queue a write at `offset`, or an fdatasync.
+  //!
+  //! @param link : the next operation only runs if this one completes
+  //!               in full.
+  void Prepare(uint8_t opcode, int fd, const void* data, size_t size,
+               uint64_t offset, bool link) {
+    unsigned tail = *sq_tail_;
+    io_uring_sqe* sqe = &sqes_[tail & *sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(size);
+    sqe->off = offset;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    if (opcode == IORING_OP_FSYNC) {
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+    sqe->user_data = queued_;
+    sq_array_[tail & *sq_mask_] = tail & *sq_mask_;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    queued_ += 1;
+  }
+
+  //! @brief Submit what was prepared and wait for it.
+  //!
+  //! @param results : one per operation, in the order prepared : bytes
+  //!                  moved, or -errno.
+  //! @return false if the ring failed : the operations it refused are
+  //!         taken back, those it cannot wait for any more are given up,
+  //!         both reported -ECANCELED. The ring is not used again on this
+  //!         thread.
+  bool Run(int* results) {
+    const unsigned count = queued_;
+    queued_ = 0;
+    for (unsigned i = 0; i < count; ++i) {
+      results[i] = -ECANCELED;
+    }
+    unsigned expected = count;
+    unsigned done = 0;
+    while (done < expected) {
+      const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+      const unsigned pending = *sq_tail_ - head;
+      long entered = syscall(__NR_io_uring_enter, fd_, pending,
+                             expected - done, IORING_ENTER_GETEVENTS,
+                             nullptr, 0);
+      const int err = entered < 0 ? errno : 0;
+      if (err != 0 && err != EINTR && pending != 0) {
+        // None submitted by this call (e.g. EAGAIN) : left in the ring,
+        // the next Run would submit them again with stale buffers.
+        __atomic_store_n(sq_tail_, head, __ATOMIC_RELEASE);
+        expected -= pending;
+        failed_ = true;
+        continue;
+      }
+      const unsigned reaped = reap(results);
+      done += reaped;
+      if (err == EBUSY || err == EAGAIN) {
+        // Waiting only : the completion ring overflowed, or the kernel is
+        // short of memory. Back off unless reaping made room.
+        if (reaped == 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+      } else if (err != 0 && err != EINTR) {
+        // The ring cannot be waited on : give up on what is left.
+        failed_ = true;
+        break;
+      }
+    }
+    return !failed_;
+  }
+
+ private:
+  uringQueue() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, kEntries, &params);
+    if (fd < 0) {
+      return;
+    }
+    // Came with IORING_OP_READ and IORING_OP_WRITE.
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+      close(fd);
+      return;
+    }
+
+    sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_bytes_ > sq_bytes_) {
+      sq_bytes_ = cq_bytes_;
+    }
+    sq_ptr_ = mmap(nullptr, sq_bytes_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ptr_ = single || sq_ptr_ == MAP_FAILED
+        ? sq_ptr_
+        : mmap(nullptr, cq_bytes_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes_ = static_cast<io_uring_sqe*>(
+        mmap(nullptr, kEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED ||
+        sqes_ == MAP_FAILED) {
+      close(fd);
+      return;
+    }
+
+    char* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    fd_ = fd;
+  }
+
+  //! @brief Take the completions posted so far.
+  //!
+  //! @return how many.
+  unsigned reap(int* results) {
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    const unsigned reaped = tail - head;
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+      results[cqe.user_data] = cqe.res;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return reaped;
+  }
+
+  int fd_ = -1;
+  void* sq_ptr_ = MAP_FAILED;
+  void* cq_ptr_ = MAP_FAILED;
+  size_t sq_bytes_ = 0;
+  size_t cq_bytes_ = 0;
+  io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+  io_uring_cqe* cqes_ = nullptr;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  //!< Operations prepared since the last Run, at most kEntries.
+  unsigned queued_ = 0;
+  //!< The ring refused operations : the POSIX calls are used instead.
+  bool failed_ = false;
+};
+
+//! @brief Log, manifest or table written through the ring.
+//!
+//! @details Appends are buffered, a full buffer is written in one go.
+//!          Writes under kRingBytes, e.g. the log flushed after every
+//!          record, stay plain pwrites : alone in the ring, a small
+//!          buffered write is handed to a kernel worker and costs several
+//!          times more. A table is only read once synced and closed, so
+//!          its Flush is a no-op : its blocks go out by the full buffer,
+//!          and Sync sends the tail and the fdatasync together, linked, in
+//!          a single submission. The logs and manifests are flushed as
+//!          written, so that a crash of the process loses none of it :
+//!          their Sync is a plain fdatasync.
+class uringWritableFile final : public leveldb::WritableFile {
+ public:
+  //!< Write buffers : the logs' and manifests' as in the POSIX Env, the
+  //!  tables' larger, compactions and memtable flushes write them in
+  //!  large batches.
+  enum : size_t {
+    kRingBytes = 64 << 10,
+    kBufferBytes = 64 << 10,
+    kTableBufferBytes = 1 << 20
+  };
+
+  uringWritableFile(std::string name, int fd, uint64_t offset, bool table)
+      : name_(std::move(name)), fd_(fd), offset_(offset),
+        capacity_(table ? kTableBufferBytes : kBufferBytes),
+        buffer_(new char[capacity_]), table_(table),
+        manifest_(basename(name_).compare(0, 8, "MANIFEST") == 0) {}
+
+  ~uringWritableFile() override {
+    if (fd_ >= 0) {
+      Close();
+    }
+  }
+
+  leveldb::Status Append(const leveldb::Slice& data) override {
+    const char* p = data.data();
+    size_t left = data.size();
+    size_t copied = std::min(left, capacity_ - used_);
+    std::memcpy(buffer_.get() + used_, p, copied);
+    p += copied;
+    left -= copied;
+    used_ += copied;
+    if (left == 0) {
+      return leveldb::Status::OK();
+    }
+    leveldb::Status status = writeBuffer();
+    if (!status.ok()) {
+      return status;
+    }
+    // Large writes skip the buffer.
+    if (left >= capacity_) {
+      return write(p, left);
+    }
+    std::memcpy(buffer_.get(), p, left);
+    used_ = left;
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status Close() override {
+    leveldb::Status status = writeBuffer();
+    if (close(fd_) < 0 && status.ok()) {
+      status = leveldb::Status::IOError(name_, std::strerror(errno));
+    }
+    fd_ = -1;
+    return status;
+  }
+
+  leveldb::Status Flush() override {
+    return table_ ? leveldb::Status::OK() : writeBuffer();
+  }
+
+  leveldb::Status Sync() override {
+    // A new manifest names new files : their directory entries must be
+    // durable first, as in the POSIX Env.
+    if (manifest_) {
+      leveldb::Status status = syncDirectory();
+      if (!status.ok()) {
+        return status;
+      }
+    }
+    uringQueue* queue = uringQueue::ThisThread();
+    if (queue == nullptr || used_ == 0) {
+      return syncData();
+    }
+    queue->Prepare(IORING_OP_WRITE, fd_, buffer_.get(), used_, offset_, true);
+    queue->Prepare(IORING_OP_FSYNC, fd_, nullptr, 0, 0, false);
+    int results[2];
+    queue->Run(results);
+    if (results[0] == -ECANCELED) {
+      // The ring refused them : nothing was written.
+      return syncData();
+    }
+    if (results[0] < 0) {
+      return leveldb::Status::IOError(name_, std::strerror(-results[0]));
+    }
+    offset_ += results[0];
+    used_ -= results[0];
+    std::memmove(buffer_.get(), buffer_.get() + results[0], used_);
+    // A short write cancelled the linked sync, so did a ring refusing the
+    // sync alone : finish with the POSIX calls.
+    if (used_ != 0 || results[1] == -ECANCELED) {
+      return syncData();
+    }
+    if (results[1] < 0) {
+      return leveldb::Status::IOError(name_, std::strerror(-results[1]));
+    }
+    return leveldb::Status::OK();
+  }
+
+ private:
+  static std::string basename(const std::string& name) {
+    size_t slash = name.rfind('/');
+    return slash == std::string::npos ? name : name.substr(slash + 1);
+  }
+
+  //! @brief Write all of `data` at the end of the file.
+  leveldb::Status write(const char* data, size_t size) {
+    uringQueue* queue =
+        size >= kRingBytes ? uringQueue::ThisThread() : nullptr;
+    while (size > 0) {
+      ssize_t wrote;
+      if (queue != nullptr) {
+        int res;
+        queue->Prepare(IORING_OP_WRITE, fd_, data,
+                       std::min<size_t>(size, 1 << 30), offset_, false);
+        queue->Run(&res);
+        wrote = res;
+      } else {
+        wrote = pwrite(fd_, data, size, static_cast<off_t>(offset_));
+        if (wrote < 0) {
+          wrote = -errno;
+        }
+      }
+      if (wrote == -EINTR) {
+        continue;
+      }
+      if (wrote == -ECANCELED) {
+        // The ring refused it : pwrite from now on.
+        queue = nullptr;
+        continue;
+      }
+      if (wrote < 0) {
+        return leveldb::Status::IOError(name_, std::strerror(-wrote));
+      }
+      data += wrote;
+      size -= wrote;
+      offset_ += wrote;
+    }
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status writeBuffer() {
+    leveldb::Status status = write(buffer_.get(), used_);
+    used_ = 0;
+    return status;
+  }
+
+  //! @brief Write the buffer and fdatasync, without the ring.
+  leveldb::Status syncData() {
+    leveldb::Status status = writeBuffer();
+    if (status.ok() && fdatasync(fd_) < 0) {
+      status = leveldb::Status::IOError(name_, std::strerror(errno));
+    }
+    return status;
+  }
+
+  leveldb::Status syncDirectory() {
+    size_t slash = name_.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : name_.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return leveldb::Status::IOError(dir, std::strerror(errno));
+    }
+    leveldb::Status status;
+    if (fsync(fd) < 0) {
+      status = leveldb::Status::IOError(dir, std::strerror(errno));
+    }
+    close(fd);
+    return status;
+  }
+
+  const std::string name_;
+  int fd_;
+  //!< Where the buffer goes in the file.
+  uint64_t offset_;
+  const size_t capacity_;
+  std::unique_ptr<char[]> buffer_;
+  size_t used_ = 0;
+  //!< A table file : flushed by Sync and Close only.
+  const bool table_;
+  const bool manifest_;
+};
+
+//! @brief The POSIX Env with the database files written through io_uring.
+//!        Threads whose ring cannot be set up use pwrite and fdatasync
+//!        instead.
+class uringEnv final : public leveldb::EnvWrapper {
+ public:
+  //! @brief The io_uring Env of the process, it is never deleted.
+  //!
+  //! @return nullptr if this kernel does not let us set up a ring.
+  static leveldb::Env* Get() {
+    static uringEnv* env =
+        uringQueue::ThisThread() != nullptr ? new uringEnv : nullptr;
+    return env;
+  }
+
+  leveldb::Status NewWritableFile(const std::string& name,
+                                  leveldb::WritableFile** result) override {
+    *result = nullptr;
+    int fd = open(name.c_str(), O_TRUNC | O_WRONLY | O_CREAT | O_CLOEXEC,
+                  0644);
+    if (fd < 0) {
+      return error(name, errno);
+    }
+    *result = new uringWritableFile(name, fd, 0, isTable(name));
+    return leveldb::Status::OK();
+  }
+
+  leveldb::Status NewAppendableFile(const std::string& name,
+                                    leveldb::WritableFile** result) override {
+    *result = nullptr;
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return error(name, errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      int err = errno;
+      close(fd);
+      return error(name, err);
+    }
+    *result = new uringWritableFile(name, fd, st.st_size, isTable(name));
+    return leveldb::Status::OK();
+  }
+
+ private:
+  uringEnv() : leveldb::EnvWrapper(leveldb::Env::Default()) {}
+
+  static bool isTable(const std::string& name) {
+    const std::string suffix = ".ldb";
+    return name.size() >= suffix.size() &&
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  static leveldb::Status error(const std::string& name, int err) {
+    if (err == ENOENT) {
+      return leveldb::Status::NotFound(name, std::strerror(err));
+    }
+    return leveldb::Status::IOError(name, std::strerror(err));
+  }
+};
+
+#else  // KV_HAVE_IO_URING
+
+//! @brief No io_uring on this platform.
+class uringEnv {
+ public:
+  //! @return nullptr : use the POSIX Env.
+  static leveldb::Env* Get() { return nullptr; }
+};
+
+#endif  // KV_HAVE_IO_URING
+
+#endif  // DISTRIBUTEDKV_URING_ENV_H_
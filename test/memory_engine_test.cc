@@ -0,0 +1,243 @@
+// Tests of the memory storage engine against the LevelDB one : random
+// batches, reads and scans under live snapshots must see the same rows in
+// both, and versions no snapshot can see any more must be pruned.
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+
+#include "leveldb/env.h"
+
+#include "leveldb_engine.h"
+#include "memory_engine.h"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                \
+  do {                                                             \
+    if (!(cond)) {                                                 \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " << #cond    \
+                << std::endl;                                      \
+      ++failures;                                                  \
+    }                                                              \
+  } while (0)
+
+//! @brief A snapshot of each engine, taken together.
+using snapshotPair = std::pair<const storageSnapshot*, const storageSnapshot*>;
+
+//! @brief Every row seen by the iterator from `start`, at most `limit`.
+std::string scan(storageIterator* it, const std::string& start,
+                 int limit = -1) {
+  std::string rows;
+  for (it->Seek(start); it->Valid() && limit != 0; it->Next(), --limit) {
+    rows += it->key().ToString() + "=" + it->value().ToString() + ";";
+  }
+  CHECK(it->status().ok());
+  return rows;
+}
+
+std::string scan(storageEngine* engine, const storageSnapshot* snapshot,
+                 const std::string& start, int limit = -1) {
+  storageReadOptions options;
+  options.snapshot = snapshot;
+  std::unique_ptr<storageIterator> it(engine->NewIterator(options));
+  return scan(it.get(), start, limit);
+}
+
+size_t memoryUsage(storageEngine* engine) {
+  std::string value;
+  CHECK(engine->GetProperty("leveldb.approximate-memory-usage", &value));
+  return std::stoull(value);
+}
+
+class engineTest {
+ public:
+  engineTest() {
+    leveldb::Env::Default()->GetTestDirectory(&dir_);
+    dir_ += "/memory_engine_test";
+    leveldb::Options options;
+    leveldb::DestroyDB(dir_, options);
+    options.create_if_missing = true;
+    CHECK(leveldbEngine::Open(options, dir_, &leveldb_).ok());
+  }
+
+  ~engineTest() {
+    leveldb_.reset();
+    leveldb::DestroyDB(dir_, leveldb::Options());
+  }
+
+  //! @brief Random operations on both engines, compared step by step.
+  void Run(int rounds) {
+    for (int round = 0; round < rounds && leveldb_ != nullptr; ++round) {
+      const int op = rng_() % 100;
+      if (op < 40) {
+        write();
+      } else if (op < 50) {
+        snapshots_.push_back(
+            {memory_.GetSnapshot(), leveldb_->GetSnapshot()});
+      } else if (op < 60) {
+        if (!snapshots_.empty()) {
+          release(rng_() % snapshots_.size());
+        }
+      } else if (op < 85) {
+        get();
+      } else if (op < 95) {
+        const snapshotPair at = pick();
+        const std::string start = key();
+        const int limit = rng_() % 2 ? -1 : static_cast<int>(rng_() % 8);
+        CHECK(scan(&memory_, at.first, start, limit) ==
+              scan(leveldb_.get(), at.second, start, limit));
+      } else {
+        iterateAcrossWrite();
+      }
+      if (snapshots_.empty()) {
+        checkPruned();
+      }
+    }
+    while (!snapshots_.empty()) {
+      release(0);
+    }
+    checkPruned();
+  }
+
+ private:
+  std::string key() { return "k" + std::to_string(rng_() % 200); }
+
+  //! @brief A batch of puts and deletes, some of them to the same key.
+  void write() {
+    storageBatch batch;
+    const int rows = 1 + rng_() % 4;
+    for (int i = 0; i < rows; ++i) {
+      const std::string k = key();
+      if (rng_() % 3 == 0) {
+        batch.Delete(k);
+        live_.erase(k);
+      } else {
+        std::string value(rng_() % 20, 'a' + rng_() % 26);
+        batch.Put(k, value);
+        live_[k] = value;
+      }
+    }
+    CHECK(memory_.Write({&batch}, false).ok());
+    CHECK(leveldb_->Write({&batch}, false).ok());
+  }
+
+  void get() {
+    const snapshotPair at = pick();
+    const std::string k = key();
+    storageReadOptions options;
+    std::string in_memory;
+    std::string in_leveldb;
+    options.snapshot = at.first;
+    leveldb::Status memory_status = memory_.Get(options, k, &in_memory);
+    options.snapshot = at.second;
+    leveldb::Status leveldb_status = leveldb_->Get(options, k, &in_leveldb);
+    CHECK(memory_status.ok() == leveldb_status.ok());
+    CHECK(memory_status.IsNotFound() == leveldb_status.IsNotFound());
+    if (memory_status.ok() && leveldb_status.ok()) {
+      CHECK(in_memory == in_leveldb);
+    }
+  }
+
+  //! @brief An iterator without a snapshot reads the state it was created
+  //!        in, and holds back pruning until it is deleted.
+  void iterateAcrossWrite() {
+    std::unique_ptr<storageIterator> memory_it(
+        memory_.NewIterator(storageReadOptions()));
+    std::unique_ptr<storageIterator> leveldb_it(
+        leveldb_->NewIterator(storageReadOptions()));
+    const std::string before = scan(&memory_, nullptr, "");
+    write();
+    write();
+    CHECK(scan(memory_it.get(), "") == before);
+    CHECK(scan(leveldb_it.get(), "") == before);
+  }
+
+  //! @brief A live snapshot pair, or none (the latest state).
+  snapshotPair pick() {
+    if (snapshots_.empty() || rng_() % 3 == 0) {
+      return {nullptr, nullptr};
+    }
+    return snapshots_[rng_() % snapshots_.size()];
+  }
+
+  void release(size_t i) {
+    memory_.ReleaseSnapshot(snapshots_[i].first);
+    leveldb_->ReleaseSnapshot(snapshots_[i].second);
+    snapshots_.erase(snapshots_.begin() + i);
+  }
+
+  //! @brief With no snapshot left, every key holds its latest version only
+  //!        and deleted keys are gone : the engine holds the live rows'
+  //!        bytes, no more.
+  void checkPruned() {
+    size_t bytes = 0;
+    for (const auto& row : live_) {
+      bytes += row.first.size() + row.second.size();
+    }
+    CHECK(memoryUsage(&memory_) == bytes);
+  }
+
+  std::string dir_;
+  std::unique_ptr<storageEngine> leveldb_;
+  memoryEngine memory_;
+  std::mt19937_64 rng_{3};
+  std::deque<snapshotPair> snapshots_;
+  //!< The latest value of every live key.
+  std::map<std::string, std::string> live_;
+};
+
+//! @brief Versions pinned by a snapshot stay readable through later writes
+//!        and deletes, and are dropped with it.
+void testPinnedVersions() {
+  memoryEngine engine;
+  CHECK(engine.Put("a", "1").ok());
+  CHECK(engine.Put("b", "2").ok());
+  const storageSnapshot* first = engine.GetSnapshot();
+  CHECK(engine.Put("a", "10").ok());
+  CHECK(engine.Delete("b").ok());
+  const storageSnapshot* second = engine.GetSnapshot();
+  CHECK(engine.Put("a", "100").ok());
+
+  storageReadOptions options;
+  std::string value;
+  options.snapshot = first;
+  CHECK(engine.Get(options, "a", &value).ok() && value == "1");
+  CHECK(engine.Get(options, "b", &value).ok() && value == "2");
+  options.snapshot = second;
+  CHECK(engine.Get(options, "a", &value).ok() && value == "10");
+  CHECK(engine.Get(options, "b", &value).IsNotFound());
+  CHECK(engine.Get(storageReadOptions(), "a", &value).ok() && value == "100");
+  CHECK(scan(&engine, first, "") == "a=1;b=2;");
+  CHECK(scan(&engine, second, "") == "a=10;");
+
+  // The versions only the first one saw go with it.
+  engine.ReleaseSnapshot(first);
+  CHECK(memoryUsage(&engine) == 1 + 2 + 3);
+  options.snapshot = second;
+  CHECK(engine.Get(options, "a", &value).ok() && value == "10");
+  engine.ReleaseSnapshot(second);
+  CHECK(memoryUsage(&engine) == 1 + 3);
+  CHECK(scan(&engine, nullptr, "") == "a=100;");
+}
+
+}  // namespace
+
+int main() {
+  testPinnedVersions();
+  engineTest test;
+  test.Run(20000);
+  if (failures != 0) {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "memory_engine_test passed" << std::endl;
+  return 0;
+}
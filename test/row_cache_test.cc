@@ -0,0 +1,222 @@
+// Tests of the worker's row cache : probing and backward-shift erase in
+// dense shards, CLOCK eviction, and a randomized run against a plain map
+// checking that a hit is never stale.
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "row_cache.h"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                \
+  do {                                                             \
+    if (!(cond)) {                                                 \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " << #cond    \
+                << std::endl;                                      \
+      ++failures;                                                  \
+    }                                                              \
+  } while (0)
+
+//!< Smallest cache : 16 slots a shard, evicting from 12 rows on.
+const size_t kSmallCache = 16 * rowCache::kShards * rowCache::kSlotBytes;
+const size_t kShardLimit = 12;
+
+size_t shardOf(const std::string& key) {
+  return (consistentHashRing::Hash(key) >> 32) % rowCache::kShards;
+}
+
+uint64_t evictions() {
+  return globalMetrics()
+      .Counter("kv_worker_row_cache_evictions_total", "")
+      ->Value();
+}
+
+void put(rowCache* cache, const std::string& key, const std::string& value) {
+  storageBatch batch;
+  batch.Put(key, value);
+  cache->Invalidate(batch);
+  cache->Apply(batch);
+}
+
+void del(rowCache* cache, const std::string& key) {
+  storageBatch batch;
+  batch.Delete(key);
+  cache->Invalidate(batch);
+  cache->Apply(batch);
+}
+
+//! @brief Keys spread so that no shard holds more than `per_shard`.
+std::vector<std::string> spreadKeys(size_t per_shard, size_t count,
+                                    const std::string& prefix) {
+  std::vector<size_t> used(rowCache::kShards);
+  std::vector<std::string> keys;
+  for (size_t i = 0; keys.size() < count; ++i) {
+    std::string key = prefix + std::to_string(i);
+    if (used[shardOf(key)] < per_shard) {
+      used[shardOf(key)] += 1;
+      keys.push_back(key);
+    }
+  }
+  return keys;
+}
+
+//! @brief Shards kept at their limit, rows erased and stored in random
+//!        order : long probe runs wrapping around the end of the slots,
+//!        shifted back by every erase. No row is evicted, so every live
+//!        row must be found and every erased one missed.
+void testProbeRuns() {
+  rowCache cache(kSmallCache);
+  CHECK(cache.Enabled());
+  std::mt19937_64 rng(1);
+  std::vector<std::string> keys =
+      spreadKeys(kShardLimit, rowCache::kShards * kShardLimit, "probe");
+  std::map<std::string, std::string> live;
+  const uint64_t evicted = evictions();
+
+  for (int round = 0; round < 200000; ++round) {
+    const std::string& key = keys[rng() % keys.size()];
+    if (live.count(key) && rng() % 2) {
+      del(&cache, key);
+      live.erase(key);
+    } else {
+      std::string value = std::to_string(rng());
+      put(&cache, key, value);
+      live[key] = value;
+    }
+    if (round % 1000 == 0) {
+      for (const std::string& k : keys) {
+        std::string value;
+        bool hit = cache.Lookup(k, &value);
+        auto it = live.find(k);
+        CHECK(hit == (it != live.end()));
+        if (hit && it != live.end()) {
+          CHECK(value == it->second);
+        }
+      }
+    }
+  }
+  CHECK(evictions() == evicted);
+}
+
+//! @brief A row read between the passes of the hand outlives the rows
+//!        never read, however many come through.
+void testClock() {
+  rowCache cache(kSmallCache);
+  // Keys of a single shard.
+  std::vector<std::string> keys;
+  for (size_t i = 0; keys.size() < 8 * kShardLimit; ++i) {
+    std::string key = "clock" + std::to_string(i);
+    if (shardOf(key) == shardOf("clock")) {
+      keys.push_back(key);
+    }
+  }
+
+  const uint64_t evicted = evictions();
+  std::string value;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    put(&cache, keys[i], "v");
+    CHECK(cache.Lookup(keys[0], &value));
+  }
+  CHECK(evictions() == evicted + keys.size() - kShardLimit);
+
+  size_t cached = 0;
+  for (const std::string& key : keys) {
+    cached += cache.Lookup(key, &value);
+  }
+  CHECK(cached == kShardLimit);
+  // A stored row is found at once, whatever it evicted.
+  CHECK(cache.Lookup(keys.back(), &value));
+}
+
+//! @brief Rows too large for a slot, and fills racing a write.
+void testFill() {
+  rowCache cache(kSmallCache);
+  std::string value;
+
+  const std::string large(rowCache::kMaxRow, 'x');
+  put(&cache, "large", "small");
+  CHECK(cache.Lookup("large", &value) && value == "small");
+  put(&cache, "large", large);
+  CHECK(!cache.Lookup("large", &value));
+  cache.Fill("large", large, cache.Epoch("large"));
+  CHECK(!cache.Lookup("large", &value));
+  const std::string fits(rowCache::kMaxRow - 3, 'y');
+  put(&cache, "fit", fits);
+  CHECK(cache.Lookup("fit", &value) && value == fits);
+
+  // The engine was read before the write : its value must not come back.
+  uint64_t epoch = cache.Epoch("raced");
+  put(&cache, "raced", "new");
+  cache.Fill("raced", "old", epoch);
+  CHECK(cache.Lookup("raced", &value) && value == "new");
+  del(&cache, "raced");
+  cache.Fill("raced", "new", epoch);
+  CHECK(!cache.Lookup("raced", &value));
+  cache.Fill("raced", "loaded", cache.Epoch("raced"));
+  CHECK(cache.Lookup("raced", &value) && value == "loaded");
+
+  rowCache disabled(0);
+  CHECK(!disabled.Enabled());
+  put(&disabled, "key", "value");
+  CHECK(!disabled.Lookup("key", &value));
+}
+
+//! @brief Random writes, deletes and fills of many more keys than fit,
+//!        against a map : a hit always has the latest value, a write is
+//!        seen at once.
+void testAgainstMap() {
+  rowCache cache(kSmallCache);
+  std::mt19937_64 rng(2);
+  std::map<std::string, std::string> model;
+  const uint64_t evicted = evictions();
+
+  for (int round = 0; round < 500000; ++round) {
+    const std::string key = "k" + std::to_string(rng() % 4000);
+    std::string value;
+    switch (rng() % 4) {
+      case 0: {
+        std::string written(rng() % 64, 'a' + rng() % 26);
+        put(&cache, key, written);
+        model[key] = written;
+        CHECK(cache.Lookup(key, &value) && value == written);
+        break;
+      }
+      case 1:
+        del(&cache, key);
+        model.erase(key);
+        CHECK(!cache.Lookup(key, &value));
+        break;
+      default: {
+        auto it = model.find(key);
+        if (cache.Lookup(key, &value)) {
+          CHECK(it != model.end() && value == it->second);
+        } else if (it != model.end()) {
+          cache.Fill(key, it->second, cache.Epoch(key));
+        }
+      }
+    }
+  }
+  CHECK(evictions() > evicted);
+}
+
+}  // namespace
+
+int main() {
+  testProbeRuns();
+  testClock();
+  testFill();
+  testAgainstMap();
+  if (failures != 0) {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "row_cache_test passed" << std::endl;
+  return 0;
+}
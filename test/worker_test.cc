@@ -0,0 +1,178 @@
+// End-to-end tests of the worker through a master, both started from the
+// binaries named on the command line : chunked values and reserved keys
+// seen through MultiGet.
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "distributedKV.grpc.pb.h"
+
+using distributedKV::KVRequest;
+using distributedKV::KVResponse;
+using distributedKV::MultiKVRequest;
+using distributedKV::MultiKVResponse;
+using distributedKV::ValueChunk;
+using distributedKV::kvMethods;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                \
+  do {                                                             \
+    if (!(cond)) {                                                 \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " << #cond    \
+                << std::endl;                                      \
+      ++failures;                                                  \
+    }                                                              \
+  } while (0)
+
+const char kMasterPort[] = "50151";
+
+//! @brief A server process, stopped when this goes.
+class serverProcess {
+ public:
+  explicit serverProcess(std::vector<std::string> args) {
+    pid_ = fork();
+    if (pid_ == 0) {
+      std::vector<char*> argv;
+      for (std::string& arg : args) {
+        argv.push_back(&arg[0]);
+      }
+      argv.push_back(nullptr);
+      execv(argv[0], argv.data());
+      _exit(127);
+    }
+  }
+
+  ~serverProcess() {
+    if (pid_ > 0) {
+      kill(pid_, SIGKILL);
+      waitpid(pid_, nullptr, 0);
+    }
+  }
+
+ private:
+  pid_t pid_;
+};
+
+//! @brief Wait until the master has a worker to write to.
+bool waitForWorker(kvMethods::Stub* stub) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (std::chrono::steady_clock::now() < deadline) {
+    grpc::ClientContext context;
+    KVRequest request;
+    request.set_key("ready");
+    request.set_value("1");
+    KVResponse response;
+    if (stub->Put(&context, request, &response).ok() && !response.error()) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return false;
+}
+
+//! @brief Store `value` under `key` in chunks of `step` bytes.
+bool putStream(kvMethods::Stub* stub, const std::string& key,
+               const std::string& value, size_t step) {
+  grpc::ClientContext context;
+  KVResponse response;
+  std::unique_ptr<grpc::ClientWriter<ValueChunk>> writer(
+      stub->PutStream(&context, &response));
+  ValueChunk chunk;
+  chunk.set_key(key);
+  for (size_t offset = 0; offset < value.size(); offset += step) {
+    chunk.set_data(value.substr(offset, step));
+    chunk.set_last(offset + step >= value.size());
+    writer->Write(chunk);
+    chunk.clear_key();
+  }
+  writer->WritesDone();
+  return writer->Finish().ok() && !response.error();
+}
+
+grpc::Status multiGet(kvMethods::Stub* stub,
+                      const std::vector<std::string>& keys,
+                      MultiKVResponse* response) {
+  grpc::ClientContext context;
+  MultiKVRequest request;
+  for (const std::string& key : keys) {
+    request.add_requests()->set_key(key);
+  }
+  return stub->MultiGet(&context, request, response);
+}
+
+//! @brief A chunked value is reported as such, as by Get, not missing.
+void testChunkedValue(kvMethods::Stub* stub) {
+  CHECK(putStream(stub, "chunked", std::string(1000, 'c'), 100));
+  MultiKVResponse response;
+  CHECK(multiGet(stub, {"ready", "chunked", "missing"}, &response).ok());
+  CHECK(response.responses_size() == 3);
+  if (response.responses_size() != 3) {
+    return;
+  }
+  CHECK(!response.responses(0).error() &&
+        response.responses(0).value() == "1");
+  CHECK(response.responses(1).error());
+  CHECK(response.responses(1).message() ==
+        "Value of 1000 bytes is chunked, read it with GetStream.");
+  CHECK(!response.responses(2).error());
+  CHECK(response.responses(2).message() == "Key not found.");
+}
+
+//! @brief The manifest and chunk rows of a value are not readable : the
+//!        worker refuses the batch, the master reports it on every key.
+void testReservedKeys(kvMethods::Stub* stub) {
+  for (const std::string& key :
+       {std::string("\0m", 2) + "chunked", std::string("\0", 1)}) {
+    MultiKVResponse response;
+    CHECK(multiGet(stub, {"ready", key}, &response).ok());
+    CHECK(response.error());
+    CHECK(response.message() == "keys starting with a NUL byte are reserved");
+    for (const KVResponse& reply : response.responses()) {
+      CHECK(reply.error() && reply.value().empty());
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " kv_master_server kv_worker_server"
+              << std::endl;
+    return 2;
+  }
+  serverProcess master({argv[1], std::string("--port=") + kMasterPort,
+                        "--log_level=warn"});
+  serverProcess worker({argv[2],
+                        std::string("--master=localhost:") + kMasterPort,
+                        "--engine=memory", "--log_level=warn"});
+  std::unique_ptr<kvMethods::Stub> stub = kvMethods::NewStub(
+      grpc::CreateChannel(std::string("localhost:") + kMasterPort,
+                          grpc::InsecureChannelCredentials()));
+  if (!waitForWorker(stub.get())) {
+    std::cerr << "no worker joined the master" << std::endl;
+    return 1;
+  }
+
+  testChunkedValue(stub.get());
+  testReservedKeys(stub.get());
+  if (failures != 0) {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "worker_test passed" << std::endl;
+  return 0;
+}